@@ -7,9 +7,12 @@
  * in the source distribution.
 */
 #include "CBlock.h"
+#include "CPayloadCache.h"
+#include "storage/codec.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdexcept>
 
 namespace blockchain
 {
@@ -29,6 +32,12 @@ namespace blockchain
         mNonce = 0;
         mDataSize = 0;
         mData = 0;
+        mPackedData = 0;
+        mPackedSize = 0;
+        mPackedCodec = storage::ECT_NONE;
+        mResident = true;
+        mCache = 0;
+        pthread_mutex_init(&mDataLock, 0);
         if(!hash)
             calculateHash();
     }
@@ -37,6 +46,9 @@ namespace blockchain
     {
         if(mData)
             delete[] mData;
+        if(mPackedData)
+            delete[] mPackedData;
+        pthread_mutex_destroy(&mDataLock);
     }
 
     void CBlock::calculateHash(uint8_t* ret)
@@ -53,7 +65,8 @@ namespace blockchain
         ptr += sizeof(time_t);
         if(mDataSize != 0)
         {
-            memcpy(ptr, mData, mDataSize);
+            CBlockData data(this);
+            memcpy(ptr, data.get(), mDataSize);
             ptr += mDataSize;
         }
         memcpy(ptr, &mNonce, sizeof(uint32_t));
@@ -100,6 +113,8 @@ namespace blockchain
 
     void CBlock::appendData(uint8_t* data, uint32_t size)
     {
+        if(mPackedData)
+            unpack();
         uint8_t* newData = new uint8_t[mDataSize + size];
         uint8_t* ptr = newData;
         if(mDataSize != 0)
@@ -208,17 +223,109 @@ namespace blockchain
         return mDataSize;
     }
 
-    uint8_t* CBlock::getData()
+    uint8_t* CBlock::pinData()
     {
+        if(mCache)
+            mCache->pin(this);
+        if(mPackedData)
+        {
+            try
+            {
+                unpack();
+            }
+            catch(std::exception& e)
+            {
+                unpinData();
+                throw;
+            }
+        }
         return mData;
     }
 
+    void CBlock::unpinData()
+    {
+        if(mCache)
+            mCache->unpin(this);
+    }
+
     void CBlock::setAllocatedData(uint8_t* data, uint32_t sz)
     {
+        pthread_mutex_lock(&mDataLock);
         if(mData)
             delete[] mData;
+        if(mPackedData)
+            delete[] mPackedData;
+        mPackedData = 0;
+        mPackedSize = 0;
         mData = data;
         mDataSize = sz;
+        mResident = true;
+        pthread_mutex_unlock(&mDataLock);
+    }
+
+    void CBlock::setPackedData(uint8_t* packed, uint32_t packedSize, storage::E_CODEC_TYPE codec, uint32_t sz)
+    {
+        pthread_mutex_lock(&mDataLock);
+        if(mData)
+            delete[] mData;
+        if(mPackedData)
+            delete[] mPackedData;
+        mData = 0;
+        mDataSize = sz;
+        mPackedData = packed;
+        mPackedSize = packedSize;
+        mPackedCodec = codec;
+        mResident = true;
+        pthread_mutex_unlock(&mDataLock);
+    }
+
+    bool CBlock::isPacked()
+    {
+        return mPackedData != 0;
+    }
+
+    bool CBlock::isResident()
+    {
+        return mResident;
+    }
+
+    void CBlock::evictData()
+    {
+        pthread_mutex_lock(&mDataLock);
+        if(mData)
+            delete[] mData;
+        if(mPackedData)
+            delete[] mPackedData;
+        mData = 0;
+        mPackedData = 0;
+        mPackedSize = 0;
+        mResident = false;
+        pthread_mutex_unlock(&mDataLock);
+    }
+
+    void CBlock::setCache(CPayloadCache* cache)
+    {
+        mCache = cache;
+    }
+
+    void CBlock::unpack()
+    {
+        pthread_mutex_lock(&mDataLock);
+        if(mPackedData)
+        {
+            uint8_t* data = new uint8_t[mDataSize];
+            if(!storage::decompressData(mPackedCodec, mPackedData, mPackedSize, data, mDataSize))
+            {
+                delete[] data;
+                pthread_mutex_unlock(&mDataLock);
+                throw std::runtime_error("Could not decompress block data: " + getHashStr());
+            }
+            delete[] mPackedData;
+            mPackedData = 0;
+            mPackedSize = 0;
+            mData = data;
+        }
+        pthread_mutex_unlock(&mDataLock);
     }
 
     bool CBlock::isValid()
@@ -9,13 +9,17 @@
 #ifndef __C_BLOCK_INCLUDED__
 #define __C_BLOCK_INCLUDED__
 #include "CLog.h"
+#include "storage/ECodecType.h"
 #include <string>
 #include <openssl/sha.h>
 #include <sys/time.h>
 #include <ctime>
+#include <pthread.h>
 
 namespace blockchain
 {
+    class CPayloadCache;
+
     class CBlock
     {
     private:
@@ -26,8 +30,16 @@ namespace blockchain
         uint32_t mDataSize;                             // Size of the data
         time_t mCreatedTS;                              // Timestamp of block creation
         uint32_t mNonce;                                // Nonce of the block
+        uint8_t* mPackedData;                           // Compressed payload as stored, unpacked on first access
+        uint32_t mPackedSize;                           // Size of the compressed payload
+        storage::E_CODEC_TYPE mPackedCodec;             // Codec of the compressed payload
+        pthread_mutex_t mDataLock;                      // Guards unpacking
+        bool mResident;                                 // Payload in memory, false once evicted by the cache
+        CPayloadCache* mCache;                          // Cache managing the payload, null when always resident
 
         CLog mLog;
+
+        void unpack();                                  // Decompress mPackedData into mData
     public:
         CBlock(CBlock* prevBlock, const uint8_t* hash = 0);                      // Constructor
         ~CBlock();                                      //
@@ -51,12 +63,43 @@ namespace blockchain
         void setCreatedTS(time_t createdTS);                    //
         void setNonce(uint32_t nonce);                          //
         uint32_t getDataSize();                                 //
-        uint8_t* getData();                                     //
+        uint8_t* pinData();                                     // Payload stays in memory until unpinData, see CBlockData
+        void unpinData();                                       //
         void setAllocatedData(uint8_t* data, uint32_t sz);      //
+        void setPackedData(uint8_t* packed, uint32_t packedSize, storage::E_CODEC_TYPE codec, uint32_t sz);   // Takes ownership, decompressed lazily
+        bool isPacked();                                        //
+        bool isResident();                                      //
+        void evictData();                                       // Free the payload, header and size stay
+        void setCache(CPayloadCache* cache);                    //
 
         bool isValid();
     };
 
+    // Holds a block's payload in memory for the guard's scope, the payload cache does not evict
+    // a pinned block. The pointer is only valid while the guard lives.
+    class CBlockData
+    {
+    private:
+        CBlock* mBlock;
+        uint8_t* mData;
+
+        CBlockData(const CBlockData&);
+        CBlockData& operator=(const CBlockData&);
+    public:
+        CBlockData(CBlock* block)
+        {
+            mBlock = block;
+            mData = block->pinData();
+        }
+
+        ~CBlockData()
+        {
+            mBlock->unpinData();
+        }
+
+        uint8_t* get() { return mData; }
+    };
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CBloomFilter.h"
+#include "storage/crc32c.h"
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <algorithm>
+
+namespace blockchain
+{
+    CBloomFilter::CBloomFilter(uint64_t capacity)
+    {
+        pthread_rwlock_init(&mLock, 0);
+        reset(capacity);
+    }
+
+    CBloomFilter::~CBloomFilter()
+    {
+        pthread_rwlock_destroy(&mLock);
+    }
+
+    void CBloomFilter::locate(const uint8_t* hash, uint64_t* block, uint16_t* bits)
+    {
+        uint64_t h = 0;
+        memcpy(&h, hash, sizeof(uint64_t));
+        *block = h % mBlockCount;
+        for(uint32_t n = 0; n < Probes; n++)
+        {
+            uint16_t v = 0;
+            memcpy(&v, hash + sizeof(uint64_t) + n * sizeof(uint16_t), sizeof(uint16_t));
+            bits[n] = v % (WordsPerBlock * 64);
+        }
+    }
+
+    void CBloomFilter::add(const uint8_t* hash)
+    {
+        uint64_t block = 0;
+        uint16_t bits[Probes];
+        pthread_rwlock_rdlock(&mLock);
+        locate(hash, &block, bits);
+        uint64_t* words = mWords.data() + block * WordsPerBlock;
+        for(uint32_t n = 0; n < Probes; n++)
+            __atomic_fetch_or(&words[bits[n] / 64], (uint64_t)1 << (bits[n] % 64), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&mKeyCount, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&mLock);
+    }
+
+    bool CBloomFilter::mayContain(const uint8_t* hash)
+    {
+        uint64_t block = 0;
+        uint16_t bits[Probes];
+        bool found = true;
+        pthread_rwlock_rdlock(&mLock);
+        locate(hash, &block, bits);
+        uint64_t* words = mWords.data() + block * WordsPerBlock;
+        for(uint32_t n = 0; n < Probes && found; n++)
+            found = (__atomic_load_n(&words[bits[n] / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (bits[n] % 64))) != 0;
+        pthread_rwlock_unlock(&mLock);
+        return found;
+    }
+
+    bool CBloomFilter::isFull()
+    {
+        return __atomic_load_n(&mKeyCount, __ATOMIC_RELAXED) >= mCapacity;
+    }
+
+    uint64_t CBloomFilter::getBlocksFor(uint64_t capacity)
+    {
+        return (capacity * 16 + WordsPerBlock * 64 - 1) / (WordsPerBlock * 64);     // 16 bits per key, ~0.1% false positives
+    }
+
+    void CBloomFilter::reset(uint64_t capacity)
+    {
+        pthread_rwlock_wrlock(&mLock);
+        mCapacity = capacity < 1024 ? 1024 : capacity;
+        mBlockCount = getBlocksFor(mCapacity);
+        mWords.assign(mBlockCount * WordsPerBlock, 0);
+        mKeyCount = 0;
+        pthread_rwlock_unlock(&mLock);
+    }
+
+    void CBloomFilter::swap(CBloomFilter* other)
+    {
+        pthread_rwlock_wrlock(&mLock);
+        mWords.swap(other->mWords);
+        std::swap(mBlockCount, other->mBlockCount);
+        std::swap(mCapacity, other->mCapacity);
+        std::swap(mKeyCount, other->mKeyCount);
+        pthread_rwlock_unlock(&mLock);
+    }
+
+    bool CBloomFilter::load(const std::string& path, const uint8_t* tipHash)
+    {
+        FILE* file = fopen(path.c_str(), "rb");
+        if(!file)
+            return false;
+
+        // The file size bounds the capacity before anything is allocated, the checksum covers header and bits
+        uint8_t header[HeaderSize];
+        uint32_t magic = 0, version = 0, crc = 0;
+        uint64_t capacity = 0, keyCount = 0, blockCount = 0;
+        struct stat info;
+        bool ok = fstat(fileno(file), &info) == 0 && fread(header, sizeof(uint8_t), HeaderSize, file) == HeaderSize;
+        if(ok)
+        {
+            memcpy(&magic, header, sizeof(uint32_t));
+            memcpy(&version, header + sizeof(uint32_t), sizeof(uint32_t));
+            memcpy(&capacity, header + sizeof(uint32_t) * 2, sizeof(uint64_t));
+            memcpy(&keyCount, header + sizeof(uint32_t) * 2 + sizeof(uint64_t), sizeof(uint64_t));
+            ok = magic == Magic && version == Version && memcmp(header + HeaderSize - SHA256_DIGEST_LENGTH, tipHash, SHA256_DIGEST_LENGTH) == 0
+                && capacity >= 1024 && capacity <= (uint64_t)info.st_size;
+        }
+        std::vector<uint64_t> words;
+        if(ok)
+        {
+            blockCount = getBlocksFor(capacity);
+            ok = (uint64_t)info.st_size == HeaderSize + blockCount * WordsPerBlock * sizeof(uint64_t) + sizeof(uint32_t);
+        }
+        if(ok)
+        {
+            words.resize(blockCount * WordsPerBlock);
+            ok = fread(words.data(), sizeof(uint64_t), words.size(), file) == words.size() && fread(&crc, sizeof(uint32_t), 1, file) == 1
+                && crc == storage::crc32c((const uint8_t*)words.data(), words.size() * sizeof(uint64_t), storage::crc32c(header, HeaderSize));
+        }
+        fclose(file);
+        if(!ok)
+        {
+            reset(mCapacity);
+            return false;
+        }
+
+        pthread_rwlock_wrlock(&mLock);
+        mWords.swap(words);
+        mBlockCount = blockCount;
+        mCapacity = capacity;
+        mKeyCount = keyCount;
+        pthread_rwlock_unlock(&mLock);
+        return true;
+    }
+
+    void CBloomFilter::save(const std::string& path, const uint8_t* tipHash)
+    {
+        std::string tmpPath(path + ".tmp");
+        FILE* file = fopen(tmpPath.c_str(), "wb");
+        if(!file)
+            throw std::runtime_error("Could not write bloom filter: " + path);
+
+        pthread_rwlock_wrlock(&mLock);
+        uint8_t header[HeaderSize];
+        uint32_t magic = Magic, version = Version;
+        memcpy(header, &magic, sizeof(uint32_t));
+        memcpy(header + sizeof(uint32_t), &version, sizeof(uint32_t));
+        memcpy(header + sizeof(uint32_t) * 2, &mCapacity, sizeof(uint64_t));
+        memcpy(header + sizeof(uint32_t) * 2 + sizeof(uint64_t), &mKeyCount, sizeof(uint64_t));
+        memcpy(header + HeaderSize - SHA256_DIGEST_LENGTH, tipHash, SHA256_DIGEST_LENGTH);
+        uint32_t crc = storage::crc32c((const uint8_t*)mWords.data(), mWords.size() * sizeof(uint64_t), storage::crc32c(header, HeaderSize));
+        bool ok = fwrite(header, sizeof(uint8_t), HeaderSize, file) == HeaderSize
+            && fwrite(mWords.data(), sizeof(uint64_t), mWords.size(), file) == mWords.size()
+            && fwrite(&crc, sizeof(uint32_t), 1, file) == 1;
+        pthread_rwlock_unlock(&mLock);
+        ok = fflush(file) == 0 && ok;
+        fclose(file);
+        if(!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+        {
+            unlink(tmpPath.c_str());
+            throw std::runtime_error("Could not write bloom filter: " + path);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_BLOOM_FILTER_INCLUDED__
+#define __C_BLOOM_FILTER_INCLUDED__
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    // Blocked Bloom filter over block hashes. Every key sets its bits inside one 64 byte
+    // block, so a lookup costs a single cache miss. Hashes are already uniform, the block
+    // and bit positions are taken from the hash bytes directly.
+    class CBloomFilter
+    {
+    private:
+        static const uint32_t Magic = 0x46424342;       // "BCBF"
+        static const uint32_t Version = 2;              // 2: the checksum covers the header
+        static const uint32_t WordsPerBlock = 8;        // 512 bits
+        static const uint32_t Probes = 8;
+        static const uint32_t HeaderSize = sizeof(uint32_t) * 2 + sizeof(uint64_t) * 2 + SHA256_DIGEST_LENGTH;
+
+        std::vector<uint64_t> mWords;
+        uint64_t mBlockCount;
+        uint64_t mCapacity;                             // Keys before the false positive rate degrades
+        uint64_t mKeyCount;
+        pthread_rwlock_t mLock;                         // Bits are set atomically, write lock only to resize
+
+        void locate(const uint8_t* hash, uint64_t* block, uint16_t* bits);
+        static uint64_t getBlocksFor(uint64_t capacity);
+    public:
+        CBloomFilter(uint64_t capacity = 65536);
+        ~CBloomFilter();
+
+        void add(const uint8_t* hash);
+        bool mayContain(const uint8_t* hash);           // False means the hash was never added
+        bool isFull();
+        void reset(uint64_t capacity);                  // Empty filter sized for capacity keys
+        void swap(CBloomFilter* other);                 // Take other's contents, other must not be shared
+
+        bool load(const std::string& path, const uint8_t* tipHash);     // False when missing, damaged or for another tip
+        void save(const std::string& path, const uint8_t* tipHash);
+
+        uint64_t getKeyCount() { return mKeyCount; }
+        uint64_t getCapacity() { return mCapacity; }
+    };
+}
+
+#endif
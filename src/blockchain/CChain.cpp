@@ -11,18 +11,26 @@
 #include "storage/storage.h"
 #include <stdexcept>
 #include <unistd.h>
+#include <algorithm>
 
 namespace blockchain
 {
-    CChain::CChain(const std::string& hostname, uint32_t hostPort, int difficulty, storage::E_STORAGE_TYPE storageType) : mLog("Chain")
+    CChain::CChain(const std::string& hostname, uint32_t hostPort, int difficulty, storage::E_STORAGE_TYPE storageType) : mSeen(SeenLifetime, MaxSeen), mRequested(RequestLifetime, MaxSeen), mLog("Chain")
     {
         CLog::open(false);
         mRunning = true;
         mStopped = false;
+        mSyncing = false;
+        pthread_mutex_init(&mClientLock, 0);
+        pthread_rwlock_init(&mChainLock, 0);
         mHostName = hostname;
         mDifficulty = difficulty;
         mNetPort = hostPort;
         mStorage = storage::createStorage(storageType);  // initialize storage
+        mPayloadCache = 0;
+        if(storageType == storage::EST_LOCAL && CPayloadCache::isEnabled())
+            mPayloadCache = new CPayloadCache(mStorage);    // payloads can only be evicted when they can be loaded back
+        mStorage->setBlockSource(this);
         mServer = new net::CServer(this, mNetPort);
         CBlock* block = new CBlock(0);
         mChain.push_back(block);  // First block (genesis)
@@ -39,9 +47,52 @@ namespace blockchain
         {
             if(connectToNode.empty())
                 throw std::runtime_error("When not creating a new chain, you must specify 'connectToNode'.");
-            net::CClient* client = connectNewClient(connectToNode, connectPort);
+
+            // host[:port],host[:port]... the first node syncs us, the others help download blocks,
+            // a node on this machine can be given by its Unix socket path
+            std::vector<std::pair<std::string, uint32_t> > nodes;
+            for(size_t start = 0, end; start <= connectToNode.size(); start = end + 1)
+            {
+                end = connectToNode.find(',', start);
+                if(end == std::string::npos)
+                    end = connectToNode.size();
+                std::string node(connectToNode.substr(start, end - start));
+                size_t pos = node.find(':');
+                if(net::INet::isLocalAddress(node))
+                    nodes.push_back(std::make_pair(node, (uint32_t)0));
+                else if(!node.empty())
+                    nodes.push_back(std::make_pair(node.substr(0, pos), pos == std::string::npos ? connectPort : (uint32_t)std::stoi(node.substr(pos + 1))));
+            }
+            if(nodes.empty())
+                throw std::runtime_error("When not creating a new chain, you must specify 'connectToNode'.");
+
+            std::vector<net::CClient*> helpers;
+            for(size_t n = 1; n < nodes.size(); n++)
+            {
+                try
+                {
+                    helpers.push_back(connectNewClient(nodes[n].first, nodes[n].second, true));
+                }
+                catch(std::runtime_error& e)
+                {
+                    mLog.errorLine("Could not connect to " + net::INet::formatAddress(nodes[n].first, nodes[n].second) + ": " + e.what());
+                }
+            }
+            for(uint32_t wait = 0; wait < 5000; wait++)
+            {
+                bool registered = true;
+                for(std::vector<net::CClient*>::iterator it = helpers.begin(); it != helpers.end(); ++it)
+                    registered = registered && ((*it)->isReady() || (*it)->isStopped());
+                if(registered)
+                    break;
+                usleep(1000);
+            }
+            releaseClients(&helpers);
+
+            net::CClient* client = connectNewClient(nodes[0].first, nodes[0].second);
             while(!client->isReady())
                 usleep(1);
+            client->drop();
             mReady = true;
             mLog.writeLine("Chain ready!");
         }
@@ -53,17 +104,36 @@ namespace blockchain
         {
             for(std::vector<net::CClient*>::iterator it = mClients.begin(); it != mClients.end(); ++it)
             {
-                delete (*it);
+                (*it)->stop();
+                (*it)->drop();      // a worker still running holds its own reference
             }
             mClients.clear();
         }
         delete mServer;
+        if(mCurrentBlock && mCurrentBlock->getPrevBlock())
+        {
+            try
+            {
+                mStorage->saveFilter(&mFilter, mCurrentBlock->getPrevBlock()->getHash());
+            }
+            catch(std::runtime_error& e)
+            {
+                mLog.errorLine(e.what());
+            }
+        }
+        if(mPayloadCache)
+        {
+            mPayloadCache->logStats();
+            mPayloadCache->dispose();
+        }
         mStorage->dispose();
         for(std::vector<CBlock*>::iterator it = mChain.begin(); it != mChain.end(); ++it)
         {
             delete (*it);
         }
         mChain.clear();
+        pthread_rwlock_destroy(&mChainLock);
+        pthread_mutex_destroy(&mClientLock);
         CLog::close();
         mRunning = false;
         mLog.writeLine("Cleanup completed.");
@@ -76,27 +146,61 @@ namespace blockchain
 
     void CChain::nextBlock(bool save, bool distribute)
     {
+        pthread_rwlock_wrlock(&mChainLock);
         mCurrentBlock->calculateHash();
+        filterBlock(mCurrentBlock);
+        pthread_rwlock_unlock(&mChainLock);
         if(save)
-            mStorage->save(mCurrentBlock, mChain.size());
+        {
+            storage::CIORequest* request = mStorage->saveAsync(mCurrentBlock, mChain.size());   // completes on the storage I/O engine
+            if(mPayloadCache)
+                mPayloadCache->add(mCurrentBlock, request);
+            request->drop();
+        }
         CBlock* block = new CBlock(mCurrentBlock);
-        mChain.push_back(block);
-        block->mine(mDifficulty);
+        block->mine(mDifficulty);       // not in the chain yet, readers do not wait for it
         
         if(distribute)
             distributeBlock(mCurrentBlock);
+        pthread_rwlock_wrlock(&mChainLock);
+        mChain.push_back(block);
         mCurrentBlock = block;
+        pthread_rwlock_unlock(&mChainLock);
 
-        if(!isValid())
+        // Pruned chains only check the new block, a full walk would load every payload back
+        if(mPayloadCache ? !block->getPrevBlock()->isValid() : !isValid())
             throw new std::runtime_error("Chain has been broken!");
     }
 
-    void CChain::distributeBlock(CBlock* block)
+    void CChain::distributeBlock(CBlock* block, const uint8_t* relayId)
     {
-        for(std::vector<net::CClient*>::iterator it = mClients.begin(); it != mClients.end(); ++it)
+        // One copy of the block for every peer, each peer only takes the payload if it has not seen the block
+        if(!relayId)
+            relayId = block->getHash();
+        markRelayed(relayId);
+        net::COutMessage* message = new net::COutMessage(net::EMT_WRITE_BLOCK, block, relayId);
+        std::vector<net::CClient*> clients(getClientsByScore());    // fastest peers hear of it first
+        for(std::vector<net::CClient*>::iterator it = clients.begin(); it != clients.end(); ++it)
         {
-            (*it)->sendBlock(block);
+            (*it)->sendMessage(message);
         }
+        releaseClients(&clients);
+        message->drop();
+    }
+
+    bool CChain::markRelayed(const uint8_t* relayId)
+    {
+        return mSeen.insert(relayId);
+    }
+
+    bool CChain::isRelayed(const uint8_t* relayId)
+    {
+        return mSeen.contains(relayId);
+    }
+
+    bool CChain::requestRelay(const uint8_t* relayId)
+    {
+        return !mSeen.contains(relayId) && mRequested.insert(relayId);
     }
 
     CBlock* CChain::getCurrentBlock()
@@ -113,8 +217,15 @@ namespace blockchain
 
     void CChain::load()
     {
-        mStorage->loadChain(&mChain);
+        mStorage->loadChain(&mChain, mPayloadCache);
         mCurrentBlock = mChain.back();
+        if(!mStorage->loadFilter(&mFilter, mCurrentBlock->getHash()))
+        {
+            mFilter.reset(mChain.size() * 2);
+            for(std::vector<CBlock*>::iterator it = mChain.begin(); it != mChain.end(); ++it)
+                mFilter.add((*it)->getHash());
+            mLog.writeLine("Rebuilt block filter for " + std::to_string(mChain.size()) + " blocks.");
+        }
         if(mChain.size() > 1)
             nextBlock(false);
     }
@@ -177,16 +288,118 @@ namespace blockchain
 
     net::CClient* CChain::connectNewClient(const std::string& hostname, uint32_t port, bool child)
     {
-        net::CClient* client = new net::CClient(this, hostname, port, child);
+        net::CClient* client = new net::CClient(this, hostname, port, child);    // the first reference belongs to mClients
+        pthread_mutex_lock(&mClientLock);
         mClients.push_back(client);
-        mLog.writeLine("Connect Client: " + hostname + ":" + std::to_string(port));
-        client->start();
+        pthread_mutex_unlock(&mClientLock);
+        mLog.writeLine("Connect Client: " + net::INet::formatAddress(hostname, port));
+        client->grab();     // the caller's, taken before the worker can remove the client
+        try
+        {
+            client->start();
+        }
+        catch(std::runtime_error& e)
+        {
+            removeClient(client);   // the worker never started
+            client->drop();
+            throw;
+        }
         return client;
     }
 
-    std::vector<net::CClient*>* CChain::getClientsPtr()
+    void CChain::shareDownload(net::CDownloadScheduler* download, net::CClient* except)
+    {
+        std::vector<double> scores;
+        std::vector<net::CClient*> clients(getClientsByScore(&scores));
+        double best = 0;
+        for(size_t n = 0; n < clients.size(); n++)
+        {
+            if(clients[n] == except || !clients[n]->isReady() || clients[n]->getWireVersion() < 3)     // batched downloads need version 3 framing
+                continue;
+            if(best == 0)
+                best = scores[n];
+            else if(scores[n] * SlowPeerFactor < best)
+                break;      // would hold ranges the faster peers finish sooner
+            clients[n]->assignDownload(download);
+        }
+        releaseClients(&clients);
+    }
+
+    std::vector<net::CClient*> CChain::getClients()
+    {
+        pthread_mutex_lock(&mClientLock);
+        std::vector<net::CClient*> clients(mClients);
+        for(std::vector<net::CClient*>::iterator it = clients.begin(); it != clients.end(); ++it)
+            (*it)->grab();
+        pthread_mutex_unlock(&mClientLock);
+        return clients;
+    }
+
+    void CChain::releaseClients(std::vector<net::CClient*>* clients)
+    {
+        for(std::vector<net::CClient*>::iterator it = clients->begin(); it != clients->end(); ++it)
+            (*it)->drop();
+        clients->clear();
+    }
+
+    std::vector<net::CClient*> CChain::getClientsByScore(std::vector<double>* scores)
+    {
+        std::vector<net::CClient*> clients(getClients());
+        std::vector<std::pair<double, size_t> > order;
+        for(size_t n = 0; n < clients.size(); n++)
+            order.push_back(std::make_pair(-clients[n]->getScore(), n));
+        std::sort(order.begin(), order.end());
+
+        std::vector<net::CClient*> ranked;
+        if(scores)
+            scores->clear();
+        for(size_t n = 0; n < order.size(); n++)
+        {
+            ranked.push_back(clients[order[n].second]);
+            if(scores)
+                scores->push_back(-order[n].first);
+        }
+        return ranked;
+    }
+
+    void CChain::removeClient(net::CClient* client)
+    {
+        pthread_mutex_lock(&mClientLock);
+        std::vector<net::CClient*>::iterator it = std::find(mClients.begin(), mClients.end(), client);
+        bool found = it != mClients.end();
+        if(found)
+            mClients.erase(it);
+        pthread_mutex_unlock(&mClientLock);
+        if(found)
+            client->drop();
+    }
+
+    bool CChain::isConnected(const std::string& hostname, uint32_t port)
+    {
+        bool connected = false;
+        pthread_mutex_lock(&mClientLock);
+        for(std::vector<net::CClient*>::iterator it = mClients.begin(); it != mClients.end() && !connected; ++it)
+            connected = (*it)->getHost() == hostname && (*it)->getPort() == port && !(*it)->isStopped();
+        pthread_mutex_unlock(&mClientLock);
+        return connected;
+    }
+
+    size_t CChain::getClientCount()
+    {
+        size_t count = 0;
+        pthread_mutex_lock(&mClientLock);
+        for(std::vector<net::CClient*>::iterator it = mClients.begin(); it != mClients.end(); ++it)
+        {
+            if(!(*it)->isStopped())
+                count++;
+        }
+        pthread_mutex_unlock(&mClientLock);
+        return count;
+    }
+
+    net::CServer* CChain::getServer()
     {
-        return &mClients;
+        return mServer;
     }
 
     bool CChain::isReady()
@@ -194,15 +407,31 @@ namespace blockchain
         return mReady;
     }
 
+    void CChain::setSyncing(bool syncing)
+    {
+        mSyncing = syncing;
+        if(syncing && mServer)
+            mServer->drainBlocks();     // later blocks are refused, the one being taken lands before the sync starts
+    }
+
+    bool CChain::isSyncing()
+    {
+        return mSyncing;
+    }
+
     void CChain::insertBlock(CBlock* block)
     {
+        pthread_rwlock_wrlock(&mChainLock);
+        filterBlock(block);
         if(mChain.empty())
             mCurrentBlock = block;
         mChain.insert(mChain.begin(), block);
+        pthread_rwlock_unlock(&mChainLock);
     }
 
     void CChain::pushBlock(CBlock* block)
     {
+        pthread_rwlock_wrlock(&mChainLock);
         if(!mChain.empty())
         {
             block->setPrevBlock(mCurrentBlock);
@@ -210,19 +439,164 @@ namespace blockchain
         }
         mChain.push_back(block);
         mCurrentBlock = block;
+        filterBlock(block);
+        pthread_rwlock_unlock(&mChainLock);
     }
 
     void CChain::clear()
     {
+        pthread_rwlock_wrlock(&mChainLock);
+        mFilter.reset(mFilter.getCapacity());
+        if(mPayloadCache)
+            mPayloadCache->clear();
         for(std::vector<CBlock*>::iterator it = mChain.begin(); it != mChain.end(); ++it)
         {
             delete (*it);
         }
         mChain.clear();
+        pthread_rwlock_unlock(&mChainLock);
+    }
+
+    void CChain::getLocator(std::vector<uint8_t>* locator)
+    {
+        locator->clear();
+        if(mChain.empty())
+            return;
+        size_t step = 1;
+        for(size_t n = mChain.size() - 1, count = 0; ; count++)
+        {
+            locator->insert(locator->end(), mChain[n]->getHash(), mChain[n]->getHash() + SHA256_DIGEST_LENGTH);
+            if(n == 0)
+                break;
+            if(count >= 10)
+                step *= 2;
+            n = n > step ? n - step : 0;
+        }
+    }
+
+    void CChain::truncate(CBlock* fork)
+    {
+        pthread_rwlock_wrlock(&mChainLock);     // no reader is walking the blocks dropped here
+        while(!mChain.empty() && mChain.back() != fork)
+        {
+            CBlock* block = mChain.back();
+            if(mPayloadCache)
+                mPayloadCache->remove(block);
+            mChain.pop_back();
+            delete block;
+        }
+        mCurrentBlock = mChain.empty() ? 0 : mChain.back();
+        pthread_rwlock_unlock(&mChainLock);
+    }
+
+    void CChain::attachBlock(CBlock* block)
+    {
+        static const uint8_t noHash[SHA256_DIGEST_LENGTH] = { 0 };
+        pthread_rwlock_wrlock(&mChainLock);
+        bool links = memcmp(block->getPrevHash(), mChain.empty() ? noHash : mChain.back()->getHash(), SHA256_DIGEST_LENGTH) == 0;
+        if(links)
+        {
+            if(!mChain.empty())
+                block->setPrevBlock(mChain.back());
+            mChain.push_back(block);
+            mCurrentBlock = block;
+            filterBlock(block);
+        }
+        pthread_rwlock_unlock(&mChainLock);
+        if(!links)
+        {
+            std::string hash(block->getHashStr());
+            delete block;
+            throw std::runtime_error("Block does not extend the chain: " + hash);
+        }
+        storage::CIORequest* request = mStorage->saveAsync(block, mChain.size());    // a restart resumes from here
+        if(mPayloadCache)
+            mPayloadCache->add(block, request);
+        request->drop();
+    }
+
+    void CChain::openBlock()
+    {
+        CBlock* block = new CBlock(mCurrentBlock);
+        block->mine(mDifficulty);
+        pthread_rwlock_wrlock(&mChainLock);
+        mChain.push_back(block);
+        mCurrentBlock = block;
+        pthread_rwlock_unlock(&mChainLock);
     }
 
-    bool CChain::hasHash(uint8_t* hash, uint32_t depth)
+    CPayloadCache* CChain::getPayloadCache()
     {
+        return mPayloadCache;
+    }
+
+    storage::IStorage* CChain::getStorage()
+    {
+        return mStorage;
+    }
+
+    void CChain::lockRead()
+    {
+        pthread_rwlock_rdlock(&mChainLock);
+    }
+
+    void CChain::unlockRead()
+    {
+        pthread_rwlock_unlock(&mChainLock);
+    }
+
+    void CChain::filterBlock(CBlock* block)
+    {
+        if(mFilter.isFull())
+        {
+            // Rebuild at twice the size aside, readers keep the full filter until the swap
+            CBloomFilter bigger(mFilter.getCapacity() * 2);
+            for(std::vector<CBlock*>::iterator it = mChain.begin(); it != mChain.end(); ++it)
+                bigger.add((*it)->getHash());
+            bigger.add(block->getHash());
+            mFilter.swap(&bigger);
+            mLog.writeLine("Rebuilt block filter for " + std::to_string(mChain.size()) + " blocks.");
+            return;
+        }
+        mFilter.add(block->getHash());
+    }
+
+    CBlock* CChain::findBlock(const uint8_t* hash)
+    {
+        if(memcmp(mCurrentBlock->getHash(), hash, SHA256_DIGEST_LENGTH) != 0 && !mFilter.mayContain(hash))
+            return 0;
+        CBlock* cur = mCurrentBlock;
+        do
+        {
+            if(memcmp(cur->getHash(), hash, SHA256_DIGEST_LENGTH) == 0)
+                return cur;
+        } while ((cur = cur->getPrevBlock()));
+        return 0;
+    }
+
+    CBlock* CChain::getBlock(size_t height)
+    {
+        if(height >= mChain.size())
+            return 0;
+        return mChain[height];
+    }
+
+    bool CChain::fetchBlock(const uint8_t* hash, CBlock* block)
+    {
+        std::vector<net::CClient*> clients(getClients());
+        bool found = false;
+        for(std::vector<net::CClient*>::iterator it = clients.begin(); it != clients.end() && !found; ++it)
+            found = (*it)->fetchBlock(hash, block);
+        releaseClients(&clients);
+        return found;
+    }
+
+    bool CChain::hasHash(const uint8_t* hash, uint32_t depth)
+    {
+        // A full search for a hash the filter never saw can stop here, the open block is not in it
+        if(depth == 0 && memcmp(mCurrentBlock->getHash(), hash, SHA256_DIGEST_LENGTH) != 0 && !mFilter.mayContain(hash))
+            return false;
+
         uint32_t c = 0;
         CBlock* cur = mCurrentBlock;
         do
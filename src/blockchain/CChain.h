@@ -9,23 +9,31 @@
 #ifndef __C_CHAIN_INCLUDED__
 #define __C_CHAIN_INCLUDED__
 #include "CBlock.h"
+#include "CPayloadCache.h"
+#include "CBloomFilter.h"
 #include "storage/EStorageType.h"
 #include "storage/IStorage.h"
 #include "net/CServer.h"
 #include "net/CClient.h"
 #include "CLog.h"
+#include "net/CSeenCache.h"
 #include <vector>
+#include <string>
+#include <atomic>
+#include <pthread.h>
 
 namespace blockchain
 {
 
-    class CChain
+    class CChain : public storage::IBlockSource
     {
     private:
         std::vector<CBlock*> mChain; // List of blocks
         CBlock* mCurrentBlock;      // Pointer to the current block &mChain.last()
         int mDifficulty;            // Difficulty
         storage::IStorage* mStorage; //
+        CPayloadCache* mPayloadCache;   // Pruned mode, null keeps every payload resident
+        CBloomFilter mFilter;           // Every sealed block hash, answers most hasHash misses
         std::string mHostName;
         uint32_t mNetPort;
         net::CServer* mServer;
@@ -33,6 +41,15 @@ namespace blockchain
         bool mRunning;
         bool mStopped;
         bool mReady;
+        std::atomic<bool> mSyncing;     // Blocks are being replaced, peers are refused until done
+        static const uint32_t SeenLifetime = 600;   // Seconds a relay id is remembered
+        static const size_t MaxSeen = 65536;
+        static const uint32_t RequestLifetime = 10;     // Seconds before an announced block is asked for again
+        static const uint32_t SlowPeerFactor = 10;  // Peers scoring this far below the best do not help downloads
+        net::CSeenCache mSeen;          // Relayed blocks taken or sent, by the hash they were first mined with
+        net::CSeenCache mRequested;     // Announced blocks asked for and not taken yet
+        pthread_mutex_t mClientLock;    // Guards mClients, changed by the server, client and gossip threads
+        pthread_rwlock_t mChainLock;    // Written while blocks are added or dropped, read by I/O threads walking them
         CLog mLog;
     public:
         CChain(const std::string& hostname, uint32_t hostPort = 7698, int difficulty = 0, storage::E_STORAGE_TYPE storageType = storage::EST_NONE);
@@ -40,7 +57,10 @@ namespace blockchain
         ~CChain();                                                                          //
         void appendToCurrentBlock(uint8_t* data, uint32_t size); 
         void nextBlock(bool save = true, bool distribute = true);       // Continue to next block
-        void distributeBlock(CBlock* block);   // Distribute written block to other nodes
+        void distributeBlock(CBlock* block, const uint8_t* relayId = 0);   // Announce written block to other nodes, relayId defaults to its own hash
+        bool markRelayed(const uint8_t* relayId);   // False when the block was already taken
+        bool isRelayed(const uint8_t* relayId);
+        bool requestRelay(const uint8_t* relayId);  // False when the block was taken or is already being asked for
         CBlock* getCurrentBlock(); // Gets a pointer to the current block
         CBlock* getGenesisBlock();
         void load();                                                                          // load the chain
@@ -51,13 +71,55 @@ namespace blockchain
         bool isRunning();
         std::string getHostName();
         uint32_t getNetPort();
-        net::CClient* connectNewClient(const std::string& hostname, uint32_t port, bool child = false);
-        std::vector<net::CClient*>* getClientsPtr();
+        net::CClient* connectNewClient(const std::string& hostname, uint32_t port, bool child = false);    // Caller drops the returned reference
+        void shareDownload(net::CDownloadScheduler* download, net::CClient* except);    // Let the other ready clients fetch ranges
+        std::vector<net::CClient*> getClients();        // Snapshot holding a reference to each, released with releaseClients
+        std::vector<net::CClient*> getClientsByScore(std::vector<double>* scores = 0);   // Snapshot, best scored first
+        static void releaseClients(std::vector<net::CClient*>* clients);
+        void removeClient(net::CClient* client);        // Drops the chain's reference
+        bool isConnected(const std::string& hostname, uint32_t port);
+        size_t getClientCount();                        // Clients still running
+        net::CServer* getServer();
         bool isReady();
+        void setSyncing(bool syncing);          // Starting a sync waits for the block being taken
+        bool isSyncing();
         void insertBlock(CBlock* block);
         void pushBlock(CBlock* block);
         void clear();
-        bool hasHash(uint8_t* hash, uint32_t depth);
+        void getLocator(std::vector<uint8_t>* locator);    // Hashes from the tip back, ten in a row then doubling gaps, genesis last
+        void truncate(CBlock* fork);            // Drop the blocks above fork, every block when fork is null
+        void attachBlock(CBlock* block);        // Sealed block on top of the chain, saved like a mined one, deleted and thrown when it does not link
+        void openBlock();                       // New current block on top of the last sealed one
+        bool hasHash(const uint8_t* hash, uint32_t depth);
+        CPayloadCache* getPayloadCache();
+        void filterBlock(CBlock* block);        // Add a block hash to the filter, growing it when full
+        CBlock* findBlock(const uint8_t* hash);
+        CBlock* getBlock(size_t height);        // Null past the tip
+        virtual bool fetchBlock(const uint8_t* hash, CBlock* block);   // Ask connected nodes in turn
+        storage::IStorage* getStorage();
+        void lockRead();                        // Blocks stay in place until unlockRead, see CChainReadLock
+        void unlockRead();
+    };
+
+    // Keeps the chain's blocks in place for the guard's scope, a sync or a new block waits for it
+    class CChainReadLock
+    {
+    private:
+        CChain* mChain;
+
+        CChainReadLock(const CChainReadLock&);
+        CChainReadLock& operator=(const CChainReadLock&);
+    public:
+        CChainReadLock(CChain* chain)
+        {
+            mChain = chain;
+            mChain->lockRead();
+        }
+
+        ~CChainReadLock()
+        {
+            mChain->unlockRead();
+        }
     };
 
 }
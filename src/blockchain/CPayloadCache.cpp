@@ -0,0 +1,217 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CPayloadCache.h"
+#include <stdexcept>
+
+namespace blockchain
+{
+    uint32_t CPayloadCache::mDefaultMaxBlocks(0);
+    uint64_t CPayloadCache::mDefaultMaxBytes(0);
+
+    void CPayloadCache::setDefaultBudget(uint32_t maxBlocks, uint64_t maxBytes)
+    {
+        mDefaultMaxBlocks = maxBlocks;
+        mDefaultMaxBytes = maxBytes;
+    }
+
+    bool CPayloadCache::isEnabled()
+    {
+        return mDefaultMaxBlocks != 0 || mDefaultMaxBytes != 0;
+    }
+
+    CPayloadCache::CPayloadCache(storage::IStorage* storage) : mLog("Cache")
+    {
+        mStorage = storage;
+        mMaxBlocks = mDefaultMaxBlocks;
+        mMaxBytes = mDefaultMaxBytes;
+        mBytes = 0;
+        mHits = 0;
+        mMisses = 0;
+        mEvictions = 0;
+        pthread_mutex_init(&mLock, 0);
+        pthread_cond_init(&mLoaded, 0);
+    }
+
+    CPayloadCache::~CPayloadCache()
+    {
+        clear();
+        pthread_cond_destroy(&mLoaded);
+        pthread_mutex_destroy(&mLock);
+    }
+
+    void CPayloadCache::add(CBlock* block, storage::CIORequest* save, bool recent)
+    {
+        pthread_mutex_lock(&mLock);
+        block->setCache(this);
+        if(mEntries.count(block) == 0 && block->isResident())
+        {
+            insert(block, save, recent);
+            evict();
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void CPayloadCache::pin(CBlock* block)
+    {
+        pthread_mutex_lock(&mLock);
+        while(true)
+        {
+            std::map<CBlock*, CEntry>::iterator it = mEntries.find(block);
+            if(it != mEntries.end())
+            {
+                mHits++;
+                it->second.mPins++;
+                mLRU.splice(mLRU.begin(), mLRU, it->second.mPos);
+                break;
+            }
+            if(block->isResident())
+                break;
+            if(mLoading.count(block) != 0)
+            {
+                pthread_cond_wait(&mLoaded, &mLock);    // another thread is reading it, use its copy
+                continue;
+            }
+
+            // Read without the lock so hits and other faults do not queue behind the disk
+            mMisses++;
+            mLoading.insert(block);
+            pthread_mutex_unlock(&mLock);
+            try
+            {
+                mStorage->load(block);
+            }
+            catch(std::exception& e)
+            {
+                pthread_mutex_lock(&mLock);
+                mLoading.erase(block);
+                pthread_cond_broadcast(&mLoaded);
+                pthread_mutex_unlock(&mLock);
+                throw;
+            }
+            pthread_mutex_lock(&mLock);
+            mLoading.erase(block);
+            pthread_cond_broadcast(&mLoaded);
+            insert(block, 0, true);
+            mEntries[block].mPins++;
+            evict();
+            break;
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void CPayloadCache::unpin(CBlock* block)
+    {
+        pthread_mutex_lock(&mLock);
+        std::map<CBlock*, CEntry>::iterator it = mEntries.find(block);
+        if(it != mEntries.end() && it->second.mPins != 0)
+            it->second.mPins--;
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void CPayloadCache::remove(CBlock* block)
+    {
+        pthread_mutex_lock(&mLock);
+        std::map<CBlock*, CEntry>::iterator it = mEntries.find(block);
+        if(it != mEntries.end())
+        {
+            if(it->second.mSave)
+                it->second.mSave->drop();
+            mBytes -= it->second.mSize;
+            mLRU.erase(it->second.mPos);
+            mEntries.erase(it);
+        }
+        block->setCache(0);
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void CPayloadCache::clear()
+    {
+        pthread_mutex_lock(&mLock);
+        for(std::map<CBlock*, CEntry>::iterator it = mEntries.begin(); it != mEntries.end(); ++it)
+        {
+            if(it->second.mSave)
+                it->second.mSave->drop();
+        }
+        mEntries.clear();
+        mLRU.clear();
+        mBytes = 0;
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void CPayloadCache::insert(CBlock* block, storage::CIORequest* save, bool recent)
+    {
+        CEntry entry;
+        entry.mPos = recent ? mLRU.insert(mLRU.begin(), block) : mLRU.insert(mLRU.end(), block);
+        entry.mSize = block->getDataSize();
+        entry.mSave = save;
+        entry.mPins = 0;
+        if(save)
+            save->grab();
+        mEntries[block] = entry;
+        mBytes += entry.mSize;
+    }
+
+    void CPayloadCache::evict()
+    {
+        std::list<CBlock*>::iterator it = mLRU.end();
+        while(it != mLRU.begin() && ((mMaxBlocks != 0 && mEntries.size() > mMaxBlocks) || (mMaxBytes != 0 && mBytes > mMaxBytes)))
+        {
+            --it;
+            if(it == mLRU.begin())
+                break;      // keep the block just used resident
+            CEntry& entry = mEntries[*it];
+            if(entry.mPins != 0)
+                continue;           // payload in use by another thread
+            if(entry.mSave)
+            {
+                if(!entry.mSave->isDone())
+                    continue;       // not on disk yet, cannot be loaded back
+                entry.mSave->drop();
+                entry.mSave = 0;
+            }
+            (*it)->evictData();
+            mBytes -= entry.mSize;
+            mEvictions++;
+            mEntries.erase(*it);
+            it = mLRU.erase(it);
+        }
+    }
+
+    uint64_t CPayloadCache::getHits()
+    {
+        return mHits;
+    }
+
+    uint64_t CPayloadCache::getMisses()
+    {
+        return mMisses;
+    }
+
+    uint64_t CPayloadCache::getEvictions()
+    {
+        return mEvictions;
+    }
+
+    uint64_t CPayloadCache::getResidentBytes()
+    {
+        return mBytes;
+    }
+
+    void CPayloadCache::logStats()
+    {
+        pthread_mutex_lock(&mLock);
+        mLog.writeLine("Resident blocks " + std::to_string(mEntries.size()) + ", bytes " + std::to_string(mBytes) + ", hits " + std::to_string(mHits) + ", misses " + std::to_string(mMisses) + ", evictions " + std::to_string(mEvictions));
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void CPayloadCache::dispose()
+    {
+        delete this;
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_PAYLOAD_CACHE_INCLUDED__
+#define __C_PAYLOAD_CACHE_INCLUDED__
+#include "CBlock.h"
+#include "CLog.h"
+#include "storage/IStorage.h"
+#include "storage/CIORequest.h"
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <set>
+#include <pthread.h>
+
+namespace blockchain
+{
+    // Keeps the payloads of the most recently used stored blocks in memory, up to a block
+    // count and a byte budget. Evicted blocks keep their header and are loaded back from
+    // storage when next pinned.
+    class CPayloadCache
+    {
+    private:
+        class CEntry
+        {
+        public:
+            std::list<CBlock*>::iterator mPos;
+            uint32_t mSize;
+            uint32_t mPins;                     // Holders of the payload, not evicted while any remain
+            storage::CIORequest* mSave;         // Save still referenced, block is not evicted before it completes
+        };
+
+        static uint32_t mDefaultMaxBlocks;
+        static uint64_t mDefaultMaxBytes;
+        storage::IStorage* mStorage;
+        uint32_t mMaxBlocks;
+        uint64_t mMaxBytes;
+        std::list<CBlock*> mLRU;                // Resident blocks, most recently used first
+        std::map<CBlock*, CEntry> mEntries;
+        uint64_t mBytes;                        // Resident payload bytes
+        uint64_t mHits;
+        uint64_t mMisses;
+        uint64_t mEvictions;
+        std::set<CBlock*> mLoading;             // Payloads being read back, outside mLock
+        pthread_mutex_t mLock;
+        pthread_cond_t mLoaded;                 // A load finished
+
+        CLog mLog;
+
+        void insert(CBlock* block, storage::CIORequest* save, bool recent);    // mLock held
+        void evict();                           // Drop least recently used payloads until within budget, mLock held
+    public:
+        static void setDefaultBudget(uint32_t maxBlocks, uint64_t maxBytes = 0);  // 0 is unlimited, both 0 disables pruning
+        static bool isEnabled();
+
+        CPayloadCache(storage::IStorage* storage);
+        ~CPayloadCache();
+
+        void add(CBlock* block, storage::CIORequest* save = 0, bool recent = true);    // Manage a stored block, older blocks are added with recent false
+        void pin(CBlock* block);                // Mark used and keep resident until unpin, loads the payload back when it was evicted
+        void unpin(CBlock* block);
+        void remove(CBlock* block);
+        void clear();
+
+        uint64_t getHits();
+        uint64_t getMisses();
+        uint64_t getEvictions();
+        uint64_t getResidentBytes();
+        void logStats();
+
+        void dispose();
+    };
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __I_REFERENCE_COUNTED_INCLUDED__
+#define __I_REFERENCE_COUNTED_INCLUDED__
+#include <atomic>
+#include <stdint.h>
+
+namespace blockchain
+{
+    // Intrusive reference count, objects start with one reference owned by the creator
+    class IReferenceCounted
+    {
+    private:
+        std::atomic<uint32_t> mReferenceCounter;
+    public:
+        IReferenceCounted() : mReferenceCounter(1) {}
+        virtual ~IReferenceCounted() {}
+
+        void grab() { mReferenceCounter.fetch_add(1, std::memory_order_relaxed); }
+
+        bool drop()     // true when this was the last reference and the object is gone
+        {
+            if(mReferenceCounter.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                delete this;
+                return true;
+            }
+            return false;
+        }
+
+        uint32_t getReferenceCount() { return mReferenceCounter.load(std::memory_order_relaxed); }
+    };
+}
+
+#endif
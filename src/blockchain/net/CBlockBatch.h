@@ -0,0 +1,109 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_BLOCK_BATCH_INCLUDED__
+#define __C_BLOCK_BATCH_INCLUDED__
+#include "CBlockHeader.h"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Many blocks in one EMT_BLOCKS frame, so a bulk transfer pays the framing and the
+        // send once instead of once per block.
+        //
+        // count, count x CBlockHeader, then the payloads in table order
+        //
+        // A batch built with addHeader leaves the payloads out of encode, the sender writes them
+        // after it in the same order, straight from wherever they are kept.
+        class CBlockBatch
+        {
+        public:
+            static const uint32_t MaxCount = 256;               // Blocks per batch
+            static const uint32_t MaxBytes = 4 * 1024 * 1024;   // Payload bytes a batch stops growing at
+
+        private:
+            std::vector<uint8_t> mTable;
+            std::vector<uint8_t> mPayloads;
+            uint32_t mCount;
+            uint64_t mBytes;                                    // Payload bytes, including the ones left to the sender
+
+        public:
+            CBlockBatch()
+            {
+                mCount = 0;
+                mBytes = 0;
+            }
+
+            void add(const uint8_t* hash, const uint8_t* prevHash, uint64_t createdTS, uint32_t nonce, const uint8_t* data, uint32_t dataSize)
+            {
+                CBlockHeader::append(hash, prevHash, createdTS, nonce, dataSize, &mTable);
+                if(dataSize != 0)
+                    mPayloads.insert(mPayloads.end(), data, data + dataSize);
+                mCount++;
+                mBytes += dataSize;
+            }
+
+            void add(CBlock* block)
+            {
+                CBlockData payload(block);
+                add(block->getHash(), block->getPrevHash(), (uint64_t)block->getCreatedTS(), block->getNonce(), payload.get(), block->getDataSize());
+            }
+
+            void addHeader(CBlock* block)
+            {
+                CBlockHeader::append(block, &mTable);
+                mCount++;
+                mBytes += block->getDataSize();
+            }
+
+            uint32_t getCount() { return mCount; }
+            bool isFull() { return mCount >= MaxCount || mBytes >= MaxBytes; }
+
+            // Wire form, valid until the batch changes
+            void encode(std::vector<uint8_t>* out)
+            {
+                out->resize(sizeof(uint32_t));
+                putUInt32(out->data(), mCount);
+                out->insert(out->end(), mTable.begin(), mTable.end());
+                out->insert(out->end(), mPayloads.begin(), mPayloads.end());
+            }
+
+            // Split a received batch, payloads point into data. False when the sizes do not add up.
+            static bool decode(const uint8_t* data, uint32_t size, std::vector<CBlockHeader>* headers, std::vector<const uint8_t*>* payloads)
+            {
+                if(size < sizeof(uint32_t))
+                    return false;
+                uint32_t count = getUInt32(data);
+                if(count > MaxCount || size < sizeof(uint32_t) + (uint64_t)count * CBlockHeader::Size)
+                    return false;
+
+                headers->resize(count);
+                payloads->resize(count);
+                const uint8_t* payload = data + sizeof(uint32_t) + count * CBlockHeader::Size;
+                uint64_t left = size - (payload - data);
+                for(uint32_t n = 0; n < count; n++)
+                {
+                    CBlockHeader& header = (*headers)[n];
+                    header.decode(data + sizeof(uint32_t) + n * CBlockHeader::Size);
+                    if(header.mDataSize > left)
+                        return false;
+                    (*payloads)[n] = payload;
+                    payload += header.mDataSize;
+                    left -= header.mDataSize;
+                }
+                return left == 0;
+            }
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_BLOCK_HEADER_INCLUDED__
+#define __C_BLOCK_HEADER_INCLUDED__
+#include "wire.h"
+#include "../CBlock.h"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Block without its payload, as carried by EMT_HEADERS and EMT_BLOCKS
+        //
+        // hash[32], prevHash[32], createdTS (64), nonce, dataSize, little endian
+        class CBlockHeader
+        {
+        public:
+            static const uint32_t Size = SHA256_DIGEST_LENGTH * 2 + sizeof(uint64_t) + 2 * sizeof(uint32_t);
+            static const uint32_t MaxCount = 2000;          // Headers per EMT_HEADERS, more are asked for again
+
+            uint8_t mHash[SHA256_DIGEST_LENGTH];
+            uint8_t mPrevHash[SHA256_DIGEST_LENGTH];
+            uint64_t mCreatedTS;
+            uint32_t mNonce;
+            uint32_t mDataSize;
+
+            static void append(const uint8_t* hash, const uint8_t* prevHash, uint64_t createdTS, uint32_t nonce, uint32_t dataSize, std::vector<uint8_t>* out)
+            {
+                uint8_t entry[Size];
+                memcpy(entry, hash, SHA256_DIGEST_LENGTH);
+                memcpy(entry + SHA256_DIGEST_LENGTH, prevHash, SHA256_DIGEST_LENGTH);
+                putUInt64(entry + SHA256_DIGEST_LENGTH * 2, createdTS);
+                putUInt32(entry + SHA256_DIGEST_LENGTH * 2 + sizeof(uint64_t), nonce);
+                putUInt32(entry + SHA256_DIGEST_LENGTH * 2 + sizeof(uint64_t) + sizeof(uint32_t), dataSize);
+                out->insert(out->end(), entry, entry + Size);
+            }
+
+            static void append(CBlock* block, std::vector<uint8_t>* out)
+            {
+                append(block->getHash(), block->getPrevHash(), (uint64_t)block->getCreatedTS(), block->getNonce(), block->getDataSize(), out);
+            }
+
+            void decode(const uint8_t* entry)
+            {
+                memcpy(mHash, entry, SHA256_DIGEST_LENGTH);
+                memcpy(mPrevHash, entry + SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+                mCreatedTS = getUInt64(entry + SHA256_DIGEST_LENGTH * 2);
+                mNonce = getUInt32(entry + SHA256_DIGEST_LENGTH * 2 + sizeof(uint64_t));
+                mDataSize = getUInt32(entry + SHA256_DIGEST_LENGTH * 2 + sizeof(uint64_t) + sizeof(uint32_t));
+            }
+        };
+    }
+}
+
+#endif
@@ -7,22 +7,48 @@
  * in the source distribution.
  */
 #include "CClient.h"
+#include "CBlockHeader.h"
 #include "../CChain.h"
 #include <stdexcept>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <string.h>
 #include <iostream>
 #include <signal.h>
 #include <algorithm>
+#include <errno.h>
+#include <time.h>
 
 #define PCHAIN ((CChain *)mChain)
 
+static double monotonicNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
 namespace blockchain
 {
     namespace net
     {
-        CClient::CClient(void *chain, const std::string &host, uint32_t port, bool child) : mLog("Client")
+        uint32_t CClient::mDefaultQueueCapacity(1024);
+        E_QUEUE_POLICY CClient::mDefaultQueuePolicy(EQP_BLOCK);
+        uint32_t CClient::mDefaultWindow(16);
+
+        void CClient::setDefaultQueue(uint32_t capacity, E_QUEUE_POLICY policy)
+        {
+            mDefaultQueueCapacity = capacity;
+            mDefaultQueuePolicy = policy;
+        }
+
+        void CClient::setDefaultWindow(uint32_t window)
+        {
+            mDefaultWindow = window < 1 ? 1 : window;
+        }
+
+        CClient::CClient(void *chain, const std::string &host, uint32_t port, bool child) : mLog("Client"), mQueue(mDefaultQueueCapacity), mInfo(host, port)
         {
             mChain = chain;
             mHost = host;
@@ -34,32 +60,49 @@ namespace blockchain
             mStopped = false;
             mWorkerThread = 0;
             mPingConfirm = false;
-            memset((char *)&mAddr, 0, sizeof(mAddr));
-            mAddr.sin_family = AF_INET;
-            mAddr.sin_port = htons(port);
+            mFetch = 0;
+            mDownload = 0;
+            mLastPeerExchange = 0;
+            mQueuePolicy = mDefaultQueuePolicy;
+            mBlockedSenders = 0;
+            mDroppedMessages = 0;
+            mWindow = 1;
+            mNextRequestId = 0;
+            PCHAIN->getServer()->recallNode(&mInfo);
+            pthread_mutex_init(&mLock, 0);
+            pthread_cond_init(&mWakeCond, 0);
+            pthread_cond_init(&mSpaceCond, 0);
+            pthread_cond_init(&mFetchCond, 0);
             std::cout << host << "\n";
-            if (inet_pton(AF_INET, host.c_str(), &mAddr.sin_addr) <= 0)
-                throw std::runtime_error("Invalid host to connect to.");
+            mAddrSize = INet::resolveAddress(host, port, &mAddr);
         }
 
         CClient::~CClient()
         {
             stop();
+            pthread_cond_destroy(&mFetchCond);
+            pthread_cond_destroy(&mSpaceCond);
+            pthread_cond_destroy(&mWakeCond);
+            pthread_mutex_destroy(&mLock);
         }
 
         void CClient::start()
         {
             mRunning = true;
-            mSocket = socket(AF_INET, SOCK_STREAM, 0);
+            mSocket = socket(mAddr.ss_family, SOCK_STREAM, 0);
             if (mSocket < 0)
                 throw std::runtime_error("Could not open socket.");
 
             mLog.writeLine("Connecting...");
 
-            if (connect(mSocket, (struct sockaddr *)&mAddr, sizeof(mAddr)) < 0)
+            if (connect(mSocket, (struct sockaddr *)&mAddr, mAddrSize) < 0)
                 throw std::runtime_error("Failed to connect to host.");
 
-            mLog.writeLine("Connected to host:  " + mHost + ":" + std::to_string(mPort));
+            mLog.writeLine("Connected to host:  " + INet::formatAddress(mHost, mPort));
+
+            int val = 1;
+            if (mAddr.ss_family == AF_INET)
+                setsockopt(mSocket, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(int));   // every packet waits for its answer
 
             startWorker();
         }
@@ -69,9 +112,14 @@ namespace blockchain
             pthread_attr_t tattr;
             pthread_attr_init(&tattr);
             pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
-            if (pthread_create(&mWorkerThread, &tattr, &static_worker, this) != 0)
-                throw std::runtime_error("Failed to start client worker thread.");
+            grab();     // the worker's, dropped when it exits
+            int created = pthread_create(&mWorkerThread, &tattr, &static_worker, this);
             pthread_attr_destroy(&tattr);
+            if (created != 0)
+            {
+                drop();
+                throw std::runtime_error("Failed to start client worker thread.");
+            }
         }
 
         void *CClient::static_worker(void *param)
@@ -96,14 +144,27 @@ namespace blockchain
                 // Register node hostname
                 CPacket writePacket, gotPacket;
                 writePacket.mMessageType = EMT_NODE_REGISTER;
-                mLog.writeLine("Hostname size: " + std::to_string(PCHAIN->getHostName().size()));
-                writePacket.setData((uint8_t *)PCHAIN->getHostName().c_str(), PCHAIN->getHostName().size());
+                writePacket.mVersion = CPacketParser::MaxVersion;     // highest framing we speak, the answer holds the one to use
+                writePacket.mNonce = CWireCompression::FeatureLZ;   // we read compressed frames, so does a server that answers with it
+                std::string hostName(PCHAIN->getHostName());     // the packet points at it until sent
+                mLog.writeLine("Hostname size: " + std::to_string(hostName.size()));
+                writePacket.setData((uint8_t *)hostName.c_str(), hostName.size());
+                double sent = monotonicNow();
                 sendPacket(&writePacket);
 
                 gotPacket = recvPacket();
                 gotPacket.destroyData();
                 if (gotPacket.mMessageType != EMT_ACK)
                     throw std::runtime_error("Server has rejected client.");
+                pthread_mutex_lock(&mLock);
+                mInfo.sampleRtt(monotonicNow() - sent);
+                pthread_mutex_unlock(&mLock);
+                if (gotPacket.mVersion > 1 && gotPacket.mVersion <= CPacketParser::MaxVersion)
+                    mWireVersion = gotPacket.mVersion;
+                if (gotPacket.mNonce & CWireCompression::FeatureLZ)
+                    mCompression.enable(mWireVersion);
+                if (mWireVersion >= 3)
+                    mWindow = mDefaultWindow;       // answers can be matched to requests
 
                 mLog.writeLine("Server has acknoledged client.");
 
@@ -120,16 +181,34 @@ namespace blockchain
                     throw std::runtime_error("Server has rejected client port.");
 
                 bool initialized = mChild;
+                struct timespec keepAlive;      // Ping when nothing else went out before this
+                clock_gettime(CLOCK_REALTIME, &keepAlive);
 
-                // Main loop
+                // Main loop, sleeps until there is something to send
                 while (mRunning)
                 {
-                    // Will always ping every 0.5 seconds (maybe this is too little? maybe too much?)
-                    writePacket.mMessageType = EMT_PING;
-                    sendPacket(&writePacket);
-                    gotPacket = recvPacket();
-                    processPacket(&gotPacket, writePacket.mMessageType);
-                    gotPacket.destroyData();
+                    pthread_mutex_lock(&mLock);
+                    while (mRunning && mQueue.isEmpty() && !(mFetch && !mFetch->mSent) && !mDownload
+                           && pthread_cond_timedwait(&mWakeCond, &mLock, &keepAlive) != ETIMEDOUT);
+                    bool idle = mQueue.isEmpty() && !(mFetch && !mFetch->mSent) && !mDownload;
+                    pthread_mutex_unlock(&mLock);
+                    if (!mRunning)
+                        break;
+
+                    if (idle)
+                    {
+                        // Idle link, check it is still alive
+                        writePacket.reset();
+                        writePacket.mMessageType = EMT_PING;
+                        double sent = monotonicNow();
+                        sendPacket(&writePacket);
+                        gotPacket = recvPacket();
+                        pthread_mutex_lock(&mLock);
+                        mInfo.sampleRtt(monotonicNow() - sent);
+                        pthread_mutex_unlock(&mLock);
+                        processPacket(&gotPacket, writePacket.mMessageType);
+                        gotPacket.destroyData();
+                    }
 
                     if (!initialized)
                     {
@@ -140,19 +219,14 @@ namespace blockchain
                     if(!mReady)
                         mReady = true;
 
-                    // Process queue
-                    while (mQueue.size() > 0)
-                    {
-                        CPacket next = mQueue.front();
-                        sendPacket(&next);
-                        next.destroyData();
-                        gotPacket = recvPacket();
-                        processPacket(&gotPacket, next.mMessageType);
-                        gotPacket.destroyData();
-                        mQueue.pop();
-                    }
+                    processQueue();
+                    processFetch();
+                    processDownload();
+                    if (mWireVersion >= 3 && time(0) - mLastPeerExchange >= PeerExchangeInterval)
+                        exchangePeers();
 
-                    usleep(50000);
+                    clock_gettime(CLOCK_REALTIME, &keepAlive);
+                    keepAlive.tv_sec += KeepAliveInterval;
                 }
 
                 gotPacket.destroyData();
@@ -160,18 +234,42 @@ namespace blockchain
             catch (std::runtime_error e)
             {
                 mLog.errorLine(std::string("Error: ") + e.what());
+                sampleRequest(true);
             }
             shutdown(mSocket, SHUT_RDWR);
             close(mSocket);
+            if (mCompression.hasTraffic())
+                mLog.writeLine("Compression with " + mHost + ": " + mCompression.getReport());
             mLog.writeLine("Closed.");
+            pthread_mutex_lock(&mLock);
             mStopped = true;
-            std::vector<CClient *>::iterator f = std::find(PCHAIN->getClientsPtr()->begin(), PCHAIN->getClientsPtr()->end(), this);
-            if (f != PCHAIN->getClientsPtr()->end())
-                PCHAIN->getClientsPtr()->erase(f);
+            if (mFetch)
+            {
+                mFetch->mDone = true;
+                pthread_cond_broadcast(&mFetchCond);
+            }
+            pthread_cond_broadcast(&mSpaceCond);
+            CDownloadScheduler* download = mDownload;
+            mDownload = 0;
+            pthread_mutex_unlock(&mLock);
+            if (download)
+                download->drop();
+            for (std::map<uint32_t, std::vector<COutMessage*> >::iterator it = mAnnounced.begin(); it != mAnnounced.end(); ++it)
+                dropMessages(&it->second);
+            mAnnounced.clear();
+            PCHAIN->getServer()->rememberNode(getInfo());   // a later client to the node starts from what we measured
+            PCHAIN->removeClient(this);
+            drop();
         }
 
         void CClient::init()
         {
+            if (mWireVersion >= 3)
+            {
+                syncHeaders();
+                return;
+            }
+
             CPacket writePacket;
 
             // Request initialize chain
@@ -196,9 +294,7 @@ namespace blockchain
                         block->setPrevHash(gotPacket.mPrevHash);
                         block->setCreatedTS(gotPacket.mCreatedTS);
                         block->setNonce(gotPacket.mNonce);
-                        uint8_t *data = new uint8_t[gotPacket.mDataSize];
-                        memcpy(data, gotPacket.mData, gotPacket.mDataSize);
-                        block->setAllocatedData(data, gotPacket.mDataSize);
+                        block->setAllocatedData(gotPacket.releaseData(), gotPacket.mDataSize);    // block takes the received buffer
 
                         if(nextBlock)
                             nextBlock->setPrevBlock(block);
@@ -236,6 +332,222 @@ namespace blockchain
             }
         }
 
+        void CClient::syncHeaders()
+        {
+            uint64_t fetched = 0, bytes = 0;
+            size_t peers = 0;
+            PCHAIN->setSyncing(true);
+            try
+            {
+                syncBatches(&fetched, &bytes, &peers);
+            }
+            catch (std::runtime_error e)
+            {
+                PCHAIN->setSyncing(false);
+                throw;
+            }
+            PCHAIN->setSyncing(false);
+            if (fetched == 0)
+                mLog.writeLine("Chain is up to date.");
+            else
+                mLog.writeLine("Sync complete, fetched " + std::to_string(fetched) + " blocks (" + std::to_string(bytes) + " bytes) from " + std::to_string(peers) + " nodes.");
+        }
+
+        void CClient::syncBatches(uint64_t* fetched, uint64_t* bytes, size_t* peers)
+        {
+            while (true)
+            {
+                std::vector<uint8_t> locator;
+                PCHAIN->getLocator(&locator);
+                CPacket writePacket;
+                writePacket.mMessageType = EMT_GET_HEADERS;
+                writePacket.setData(locator.data(), locator.size());
+                sendPacket(&writePacket);
+
+                CPacket gotPacket = recvPacket();
+                if (gotPacket.mMessageType != EMT_HEADERS || gotPacket.mDataSize % CBlockHeader::Size != 0)
+                {
+                    gotPacket.destroyData();
+                    throw std::runtime_error("Sync error no headers.");
+                }
+                std::vector<CBlockHeader> headers(gotPacket.mDataSize / CBlockHeader::Size);
+                for (size_t n = 0; n < headers.size(); n++)
+                    headers[n].decode(gotPacket.mData + n * CBlockHeader::Size);
+                gotPacket.destroyData();
+                if (headers.empty())
+                    break;
+
+                // Everything above the fork point is replaced by the node's blocks
+                static const uint8_t noHash[SHA256_DIGEST_LENGTH] = { 0 };
+                CBlock *fork = PCHAIN->findBlock(headers[0].mPrevHash);
+                if (!fork && memcmp(headers[0].mPrevHash, noHash, SHA256_DIGEST_LENGTH) != 0)
+                    throw std::runtime_error("Sync error headers do not connect.");
+                if (fork == PCHAIN->getCurrentBlock())
+                    fork = fork->getPrevBlock();    // our open block is not sealed, never build on it
+
+                // Nothing is dropped unless the headers form one chain on top of the fork
+                if (memcmp(headers[0].mPrevHash, fork ? fork->getHash() : noHash, SHA256_DIGEST_LENGTH) != 0)
+                    throw std::runtime_error("Sync error headers do not connect.");
+                for (size_t n = 1; n < headers.size(); n++)
+                {
+                    if (memcmp(headers[n].mPrevHash, headers[n - 1].mHash, SHA256_DIGEST_LENGTH) != 0)
+                        throw std::runtime_error("Sync error headers are not linked at " + std::to_string(n) + ".");
+                }
+                if (*fetched == 0)
+                    mLog.writeLine("Fetching " + std::to_string(headers.size()) + (headers.size() == CBlockHeader::MaxCount ? " or more" : "") + " blocks from node.");
+                PCHAIN->truncate(fork);
+
+                // Connected peers fetch ranges alongside us, blocks are attached in height order
+                CDownloadScheduler* download = new CDownloadScheduler(headers);
+                PCHAIN->shareDownload(download, this);
+                time_t progress = time(0);
+                try
+                {
+                    while (!download->isDone())
+                    {
+                        bool worked = downloadRanges(download, RangesAhead * 2) != 0;
+                        while (CBlock* block = download->next(worked ? 0 : 1000))
+                        {
+                            *bytes += block->getDataSize();
+                            PCHAIN->attachBlock(block);
+                            (*fetched)++;
+                            progress = time(0);
+                        }
+                        if (time(0) - progress > CDownloadScheduler::Timeout * 3)
+                            throw std::runtime_error("Sync error download stalled.");
+                    }
+                }
+                catch (std::runtime_error e)
+                {
+                    download->cancel();
+                    download->drop();
+                    PCHAIN->openBlock();
+                    throw;
+                }
+                if (download->getPeerCount() > *peers)
+                    *peers = download->getPeerCount();
+                download->cancel();
+                download->drop();
+                PCHAIN->openBlock();
+                if (headers.size() < CBlockHeader::MaxCount)
+                    break;
+            }
+        }
+
+        size_t CClient::downloadRanges(CDownloadScheduler* download, size_t count)
+        {
+            // One EMT_GET_BLOCKS per range, the next range is asked for before the last one is answered
+            std::map<uint32_t, std::vector<size_t> > requests;
+            std::map<uint32_t, double> sentAt;
+            size_t taken = 0, done = 0;
+            uint32_t ahead = mWindow < RangesAhead ? mWindow : RangesAhead;
+            while (true)
+            {
+                while (taken < count && requests.size() < ahead)
+                {
+                    std::vector<size_t> range;
+                    if (!download->take(this, &range))
+                    {
+                        count = taken;
+                        break;
+                    }
+                    std::vector<uint8_t> hashes;
+                    for (std::vector<size_t>::iterator it = range.begin(); it != range.end(); ++it)
+                        hashes.insert(hashes.end(), download->getHeader(*it).mHash, download->getHeader(*it).mHash + SHA256_DIGEST_LENGTH);
+                    CPacket writePacket;
+                    writePacket.mMessageType = EMT_GET_BLOCKS;
+                    writePacket.mRequestId = ++mNextRequestId;
+                    writePacket.setData(hashes.data(), hashes.size());
+                    sendPacket(&writePacket);
+                    requests[writePacket.mRequestId].swap(range);
+                    sentAt[writePacket.mRequestId] = monotonicNow();
+                    taken++;
+                }
+                if (requests.empty())
+                    return done;
+
+                CPacket gotPacket = recvPacket();
+                std::map<uint32_t, std::vector<size_t> >::iterator it = mWindow > 1 ? requests.find(gotPacket.mRequestId) : requests.begin();
+                if (it == requests.end())
+                {
+                    gotPacket.destroyData();
+                    throw std::runtime_error("Answer to an unknown request " + std::to_string(gotPacket.mRequestId) + ".");
+                }
+                std::vector<size_t> range;
+                range.swap(it->second);
+                double elapsed = monotonicNow() - sentAt[it->first];
+                sentAt.erase(it->first);
+                requests.erase(it);
+                done++;
+
+                // The batch keeps the order asked for and leaves out what the node does not hold
+                std::vector<CBlockHeader> headers;
+                std::vector<const uint8_t*> payloads;
+                if (gotPacket.mMessageType != EMT_BLOCKS || !CBlockBatch::decode(gotPacket.mData, gotPacket.mDataSize, &headers, &payloads))
+                    headers.clear();
+                size_t found = 0, failed = 0;
+                for (std::vector<size_t>::iterator index = range.begin(); index != range.end(); ++index)
+                {
+                    const CBlockHeader& header = download->getHeader(*index);
+                    if (found == headers.size() || memcmp(headers[found].mHash, header.mHash, SHA256_DIGEST_LENGTH) != 0)
+                    {
+                        download->fail(*index, this);
+                        failed++;
+                        continue;
+                    }
+                    uint32_t size = headers[found].mDataSize;
+                    uint8_t* data = size != 0 ? new uint8_t[size] : 0;
+                    if (size != 0)
+                        memcpy(data, payloads[found], size);
+                    found++;
+
+                    CBlock *block = new CBlock(0, header.mHash);
+                    block->setPrevHash(header.mPrevHash);
+                    block->setCreatedTS((time_t)header.mCreatedTS);
+                    block->setNonce(header.mNonce);
+                    block->setAllocatedData(data, size);
+                    if (!download->complete(*index, block, this))
+                    {
+                        mLog.writeLine("Block from " + mHost + " was late or did not match its header.");
+                        failed++;
+                    }
+                }
+                pthread_mutex_lock(&mLock);
+                mInfo.sampleTransfer(gotPacket.mDataSize, elapsed);
+                pthread_mutex_unlock(&mLock);
+                sampleRequest(failed != 0);
+                gotPacket.destroyData();
+            }
+        }
+
+        void CClient::processDownload()
+        {
+            pthread_mutex_lock(&mLock);
+            CDownloadScheduler* download = mDownload;
+            pthread_mutex_unlock(&mLock);
+            if (!download)
+                return;
+            uint64_t ranges = downloadRanges(download, (size_t)-1);
+            if (ranges != 0)
+                mLog.writeLine("Helped sync with " + std::to_string(ranges) + " ranges from " + mHost + ".");
+            pthread_mutex_lock(&mLock);
+            mDownload = 0;
+            pthread_mutex_unlock(&mLock);
+            download->drop();
+        }
+
+        void CClient::assignDownload(CDownloadScheduler* download)
+        {
+            pthread_mutex_lock(&mLock);
+            if (!mDownload && mRunning)
+            {
+                download->grab();
+                mDownload = download;
+                pthread_cond_signal(&mWakeCond);
+            }
+            pthread_mutex_unlock(&mLock);
+        }
+
         void CClient::processPacket(CPacket *packet, EMessageType responseTo)
         {
             // Response from ping request
@@ -251,7 +563,7 @@ namespace blockchain
             }
             
             // Response when packet was distributed
-            else if (responseTo == EMT_WRITE_BLOCK)
+            else if (responseTo == EMT_WRITE_BLOCK || responseTo == EMT_BLOCKS)
             {
                 if (packet->mMessageType == EMT_ACK)
                     mLog.writeLine("Client " + mHost + ": responded with ACK.");
@@ -260,21 +572,292 @@ namespace blockchain
             }
         }
 
+        void CClient::processQueue()
+        {
+            while (true)
+            {
+                while (mInFlight.size() < mWindow)
+                {
+                    // Blocks queued behind each other are announced together
+                    std::vector<COutMessage*> messages;
+                    size_t limit = mWireVersion >= 3 ? CBlockBatch::MaxCount : 1;
+                    while (messages.size() < limit)
+                    {
+                        COutMessage* next = mQueue.pop();
+                        if (!next)
+                            break;
+                        messages.push_back(next);
+                    }
+                    if (messages.empty())
+                        break;
+                    std::atomic_thread_fence(std::memory_order_seq_cst);    // pairs with the fence in sendMessage
+                    if (mBlockedSenders.load() != 0)
+                    {
+                        pthread_mutex_lock(&mLock);
+                        pthread_cond_broadcast(&mSpaceCond);
+                        pthread_mutex_unlock(&mLock);
+                    }
+
+                    // Version 3 peers get the relay ids and ask for the payloads they miss, older
+                    // peers get a copy of the shared header with our id
+                    CPacket packet;
+                    std::vector<uint8_t> ids;
+                    if (mWireVersion >= 3)
+                    {
+                        for (std::vector<COutMessage*>::iterator it = messages.begin(); it != messages.end(); ++it)
+                            ids.insert(ids.end(), (*it)->getPacket()->mHash, (*it)->getPacket()->mHash + SHA256_DIGEST_LENGTH);
+                        packet.mMessageType = EMT_INV;
+                        packet.setData(ids.data(), ids.size());
+                    }
+                    else
+                    {
+                        packet = *messages[0]->getPacket();
+                        packet.mTrackDataAlloc = false;
+                    }
+                    packet.mRequestId = ++mNextRequestId;
+                    mInFlight[packet.mRequestId] = packet.mMessageType;
+                    mAnnounced[packet.mRequestId].swap(messages);   // kept until answered, the packet may point into them
+                    sendPacket(&packet);
+                }
+                if (mInFlight.empty())
+                    return;
+
+                CPacket gotPacket = recvPacket();
+                std::map<uint32_t, EMessageType>::iterator it = mWindow > 1 ? mInFlight.find(gotPacket.mRequestId) : mInFlight.begin();
+                if (it == mInFlight.end())
+                {
+                    gotPacket.destroyData();
+                    throw std::runtime_error("Answer to an unknown request " + std::to_string(gotPacket.mRequestId) + ".");
+                }
+                EMessageType responseTo = it->second;
+                sampleRequest(gotPacket.mMessageType == EMT_ERR);
+                std::vector<COutMessage*> messages;
+                messages.swap(mAnnounced[it->first]);
+                mAnnounced.erase(it->first);
+                mInFlight.erase(it);
+                try
+                {
+                    if (responseTo == EMT_INV)
+                        sendAnnounced(&gotPacket, &messages);
+                    else
+                        processPacket(&gotPacket, responseTo);
+                }
+                catch (std::runtime_error e)
+                {
+                    gotPacket.destroyData();
+                    dropMessages(&messages);
+                    throw;
+                }
+                gotPacket.destroyData();
+                dropMessages(&messages);
+            }
+        }
+
+        void CClient::sendAnnounced(CPacket* wanted, std::vector<COutMessage*>* messages)
+        {
+            if (wanted->mMessageType != EMT_GET_BLOCKS)
+                return;
+
+            // The peer lists what it wants in announcement order
+            CBlockBatch batch;
+            size_t n = 0;
+            for (uint32_t pos = 0; pos + SHA256_DIGEST_LENGTH <= wanted->mDataSize; pos += SHA256_DIGEST_LENGTH)
+            {
+                while (n < messages->size() && memcmp((*messages)[n]->getPacket()->mHash, wanted->mData + pos, SHA256_DIGEST_LENGTH) != 0)
+                    n++;
+                if (n == messages->size())
+                    break;
+                CPacket* queued = (*messages)[n++]->getPacket();
+                batch.add(queued->mHash, queued->mPrevHash, (uint64_t)queued->mCreatedTS, queued->mNonce, queued->mData, queued->mDataSize);
+                if (batch.isFull())
+                    sendBatch(&batch);
+            }
+            if (batch.getCount() != 0)
+                sendBatch(&batch);
+        }
+
+        void CClient::sendBatch(CBlockBatch* batch)
+        {
+            std::vector<uint8_t> data;
+            batch->encode(&data);
+            *batch = CBlockBatch();
+            CPacket packet;
+            packet.mMessageType = EMT_BLOCKS;
+            packet.mRequestId = ++mNextRequestId;
+            packet.setData(data.data(), data.size());
+            sendPacket(&packet);
+            mInFlight[packet.mRequestId] = EMT_BLOCKS;
+        }
+
+        void CClient::dropMessages(std::vector<COutMessage*>* messages)
+        {
+            for (std::vector<COutMessage*>::iterator it = messages->begin(); it != messages->end(); ++it)
+                (*it)->drop();
+            messages->clear();
+        }
+
+        void CClient::exchangePeers()
+        {
+            mLastPeerExchange = time(0);
+            CPacket writePacket;
+            writePacket.mMessageType = EMT_GET_PEERS;
+            writePacket.mRequestId = ++mNextRequestId;
+            sendPacket(&writePacket);
+            CPacket gotPacket = recvPacket();
+            std::vector<CNodeInfo> nodes;
+            bool valid = gotPacket.mMessageType == EMT_PEERS && CNodeInfo::decode(gotPacket.mData, gotPacket.mDataSize, &nodes);
+            gotPacket.destroyData();
+            if (valid)
+                PCHAIN->getServer()->learnNodes(nodes);
+        }
+
+        void CClient::processFetch()
+        {
+            pthread_mutex_lock(&mLock);
+            CFetchRequest* fetch = mFetch;
+            if (fetch)
+                fetch->mSent = true;
+            pthread_mutex_unlock(&mLock);
+            if (!fetch || fetch->mDone)
+                return;
+
+            CPacket writePacket;
+            writePacket.mMessageType = EMT_GET_BLOCK;
+            memcpy(writePacket.mHash, fetch->mHash, SHA256_DIGEST_LENGTH);
+            sendPacket(&writePacket);
+            CPacket gotPacket = recvPacket();
+            bool found = gotPacket.mMessageType == EMT_WRITE_BLOCK && memcmp(gotPacket.mHash, fetch->mHash, SHA256_DIGEST_LENGTH) == 0;
+            sampleRequest(!found);
+            if (found)
+            {
+                fetch->mBlock->setPrevHash(gotPacket.mPrevHash);
+                fetch->mBlock->setCreatedTS(gotPacket.mCreatedTS);
+                fetch->mBlock->setNonce(gotPacket.mNonce);
+                fetch->mBlock->setAllocatedData(gotPacket.releaseData(), gotPacket.mDataSize);
+            }
+            gotPacket.destroyData();
+
+            pthread_mutex_lock(&mLock);
+            fetch->mFound = found;
+            fetch->mDone = true;
+            pthread_cond_broadcast(&mFetchCond);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        bool CClient::fetchBlock(const uint8_t* hash, CBlock* block)
+        {
+            CFetchRequest fetch;
+            fetch.mHash = hash;
+            fetch.mBlock = block;
+            fetch.mSent = false;
+            fetch.mDone = false;
+            fetch.mFound = false;
+
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 10;
+
+            pthread_mutex_lock(&mLock);
+            while (mFetch && !mStopped)
+                pthread_cond_wait(&mFetchCond, &mLock);    // one fetch at a time
+            if (mStopped || !mReady)
+            {
+                pthread_mutex_unlock(&mLock);
+                return false;
+            }
+            mFetch = &fetch;
+            pthread_cond_signal(&mWakeCond);
+            while (!fetch.mDone)
+            {
+                // Give up if the worker never picked it up, once sent the socket timeout bounds the wait
+                if (pthread_cond_timedwait(&mFetchCond, &mLock, &until) == ETIMEDOUT && !fetch.mSent)
+                    break;
+            }
+            mFetch = 0;
+            pthread_cond_broadcast(&mFetchCond);
+            pthread_mutex_unlock(&mLock);
+            return fetch.mFound;
+        }
+
+        void CClient::sampleRequest(bool failed)
+        {
+            pthread_mutex_lock(&mLock);
+            mInfo.sampleRequest(failed);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        CNodeInfo CClient::getInfo()
+        {
+            pthread_mutex_lock(&mLock);
+            CNodeInfo info(mInfo);
+            pthread_mutex_unlock(&mLock);
+            return info;
+        }
+
+        double CClient::getScore()
+        {
+            pthread_mutex_lock(&mLock);
+            double score = mInfo.getScore();
+            pthread_mutex_unlock(&mLock);
+            return score;
+        }
+
         void CClient::stop()
         {
+            pthread_mutex_lock(&mLock);
             mRunning = false;
+            pthread_cond_signal(&mWakeCond);
+            pthread_mutex_unlock(&mLock);
         }
 
         // Send distribute block
-        void CClient::sendBlock(CBlock *block)
+        void CClient::sendMessage(COutMessage *message)
         {
-            CPacket packet;
-            packet.mMessageType = EMT_WRITE_BLOCK;
-            packet.mData = block->getData();
-            packet.mDataSize = block->getDataSize();
-            memcpy(packet.mHash, block->getHash(), SHA256_DIGEST_LENGTH);
-            memcpy(packet.mPrevHash, block->getPrevHash(), SHA256_DIGEST_LENGTH);
-            mQueue.push(packet);
+            if (!mRunning)
+                return;
+            if (!mQueue.push(message))
+            {
+                if (mQueuePolicy == EQP_DISCONNECT)
+                {
+                    mLog.errorLine("Outbound queue to " + mHost + " is full, disconnecting.");
+                    stop();
+                    return;
+                }
+                else if (mQueuePolicy == EQP_DROP_OLDEST)
+                {
+                    // Another sender may refill the slot, keep going until the push lands
+                    do
+                    {
+                        if (COutMessage* oldest = mQueue.pop())
+                        {
+                            oldest->drop();
+                            if (mDroppedMessages.fetch_add(1, std::memory_order_relaxed) % 1024 == 0)
+                                mLog.errorLine("Outbound queue to " + mHost + " is full, dropped " + std::to_string(getDroppedMessages()) + " messages so far.");
+                        }
+                    } while (!mQueue.push(message));
+                }
+                else
+                {
+                    pthread_mutex_lock(&mLock);
+                    mBlockedSenders++;
+                    std::atomic_thread_fence(std::memory_order_seq_cst);    // the worker sees us or we see its pop
+                    while (!mQueue.push(message))
+                    {
+                        if (mStopped || !mRunning)
+                        {
+                            mBlockedSenders--;
+                            pthread_mutex_unlock(&mLock);
+                            return;
+                        }
+                        pthread_cond_wait(&mSpaceCond, &mLock);
+                    }
+                    mBlockedSenders--;
+                    pthread_mutex_unlock(&mLock);
+                }
+            }
+            pthread_mutex_lock(&mLock);
+            pthread_cond_signal(&mWakeCond);
+            pthread_mutex_unlock(&mLock);
         }
 
     }
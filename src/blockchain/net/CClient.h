@@ -9,29 +9,46 @@
 #ifndef __C_CLIENT_INCLUDED__
 #define __C_CLIENT_INCLUDED__
 #include "INet.h"
+#include "CPacketParser.h"
+#include "COutQueue.h"
+#include "CDownloadScheduler.h"
+#include "CBlockBatch.h"
+#include "CNodeInfo.h"
 #include "../CLog.h"
 #include "../CBlock.h"
+#include "../IReferenceCounted.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdint.h>
 #include <string>
 #include <pthread.h>
-#include <queue>
+#include <atomic>
+#include <map>
+#include <vector>
 
 
 namespace blockchain
 {
     namespace net
     {
-        class CClient : protected INet
+        // Reference counted, the chain's client list and the running worker each hold a reference
+        class CClient : public IReferenceCounted, protected INet
         {
         private:
+            static const uint32_t KeepAliveInterval = 5;   // Seconds idle before a ping, under the server idle timeout
+            static const uint32_t RangesAhead = 2;          // Download ranges requested before the first is answered
+            static const uint32_t PeerExchangeInterval = 30;    // Seconds between asking the node for its peers
+            static uint32_t mDefaultQueueCapacity;
+            static E_QUEUE_POLICY mDefaultQueuePolicy;
+            static uint32_t mDefaultWindow;
+
             void* mChain;
             uint32_t mPort;
             bool mRunning;
             bool mStopped;
-            struct sockaddr_in mAddr;
+            struct sockaddr_storage mAddr;                      // TCP or Unix socket path
+            socklen_t mAddrSize;
             pthread_t mWorkerThread;
             bool mPingConfirm;
             bool mChild;
@@ -40,7 +57,33 @@ namespace blockchain
 
             std::string mHost;
 
-            std::queue<CPacket> mQueue;
+            COutQueue mQueue;                   // Messages to distribute
+            E_QUEUE_POLICY mQueuePolicy;        // When mQueue is full
+            std::atomic<uint32_t> mBlockedSenders;  // Senders waiting on mSpaceCond
+            std::atomic<uint64_t> mDroppedMessages;
+            uint32_t mWindow;                   // Messages sent before waiting for an answer, 1 below version 3 framing
+            uint32_t mNextRequestId;
+            std::map<uint32_t, EMessageType> mInFlight;     // Request id to the type sent, worker only
+            std::map<uint32_t, std::vector<COutMessage*> > mAnnounced;     // Messages held until their request is answered, worker only
+
+            class CFetchRequest
+            {
+            public:
+                const uint8_t* mHash;
+                CBlock* mBlock;
+                bool mSent;
+                bool mDone;
+                bool mFound;
+            };
+
+            pthread_mutex_t mLock;
+            pthread_cond_t mWakeCond;           // packet queued, fetch requested or stopping
+            pthread_cond_t mSpaceCond;          // message taken off a full queue
+            pthread_cond_t mFetchCond;          // fetch answered
+            CFetchRequest* mFetch;              // Block requested by fetchBlock, sent by the worker
+            CDownloadScheduler* mDownload;      // Sync another client asked us to help with
+            time_t mLastPeerExchange;
+            CNodeInfo mInfo;                    // Measurements of the node, under mLock
         protected:
             void startWorker();
             static void* static_worker(void* param);
@@ -51,16 +94,53 @@ namespace blockchain
 
             // Initialize client
             void init();
+
+            // Catch up from the fork point, used with version 3 framing
+            void syncHeaders();
+            void syncBatches(uint64_t* fetched, uint64_t* bytes, size_t* peers);
+
+            // Fetch up to count ranges of a download in batches, returns the ranges fetched, 0 when none were left
+            size_t downloadRanges(CDownloadScheduler* download, size_t count);
+
+            // Help with an assigned download until it runs out of ranges
+            void processDownload();
+
+            // Ask the node for the nodes it knows and hand them to our server, version 3 only
+            void exchangePeers();
+
+            // Send a pending fetch and fill its block from the answer
+            void processFetch();
+
+            // Send queued messages keeping up to mWindow unanswered, returns once all are answered
+            void processQueue();
+
+            // Send the announced blocks the peer asked for
+            void sendAnnounced(CPacket* wanted, std::vector<COutMessage*>* messages);
+            void sendBatch(CBlockBatch* batch);
+            void dropMessages(std::vector<COutMessage*>* messages);
+
+            void sampleRequest(bool failed);
         public:
             CClient(void* chain, const std::string& host, uint32_t port, bool child);
-            ~CClient();
+            virtual ~CClient();
             void start();
             void stop();
-            void sendBlock(CBlock* block);
+            void sendMessage(COutMessage* message);                 // Queue for the peer, applies the queue policy when full
+            bool fetchBlock(const uint8_t* hash, CBlock* block);    // Ask the node for one block, blocks until answered
+            void assignDownload(CDownloadScheduler* download);      // Fetch ranges of it from the worker
             std::string getHost() { return mHost; }
             uint32_t getPort() { return mPort; }
             bool isStopped() { return mStopped; }
             bool isReady() { return mReady; }
+            bool isChild() { return mChild; }
+            uint32_t getWireVersion() { return mWireVersion; }
+            uint32_t getQueueDepth() { return mQueue.getDepth(); }
+            uint64_t getDroppedMessages() { return mDroppedMessages.load(std::memory_order_relaxed); }
+            CNodeInfo getInfo();
+            double getScore();                  // CNodeInfo::getScore of the node, higher is better
+
+            static void setDefaultQueue(uint32_t capacity, E_QUEUE_POLICY policy);
+            static void setDefaultWindow(uint32_t window);
         };
     }
 }
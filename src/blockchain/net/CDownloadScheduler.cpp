@@ -0,0 +1,142 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+ */
+#include "CDownloadScheduler.h"
+#include "../storage/CThrottle.h"
+#include <string.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        CDownloadScheduler::CDownloadScheduler(const std::vector<CBlockHeader>& headers)
+        {
+            mSlots.resize(headers.size());
+            for(size_t n = 0; n < headers.size(); n++)
+            {
+                mSlots[n].mHeader = headers[n];
+                mSlots[n].mBlock = 0;
+                mSlots[n].mPeer = 0;
+                mSlots[n].mFailedPeer = 0;
+                mSlots[n].mAssigned = 0;
+            }
+            mNext = 0;
+            mCancelled = false;
+            pthread_mutex_init(&mLock, 0);
+            pthread_cond_init(&mCond, 0);
+        }
+
+        CDownloadScheduler::~CDownloadScheduler()
+        {
+            for(std::vector<CSlot>::iterator it = mSlots.begin(); it != mSlots.end(); ++it)
+                delete it->mBlock;
+            pthread_cond_destroy(&mCond);
+            pthread_mutex_destroy(&mLock);
+        }
+
+        bool CDownloadScheduler::take(void* peer, std::vector<size_t>* range)
+        {
+            range->clear();
+            time_t now = time(0);
+            pthread_mutex_lock(&mLock);
+            for(size_t n = mNext; n < mSlots.size() && range->size() < RangeSize && !mCancelled; n++)
+            {
+                CSlot& slot = mSlots[n];
+                // The peer that failed a block gets it back once Timeout has passed, it may be the only one
+                bool overdue = now - slot.mAssigned >= Timeout;
+                bool free = !slot.mBlock && (slot.mFailedPeer != peer || overdue) && (!slot.mPeer || overdue);
+                if(free)
+                {
+                    slot.mPeer = peer;
+                    slot.mAssigned = now;
+                    range->push_back(n);
+                }
+                else if(!range->empty())
+                    break;      // keep ranges contiguous
+            }
+            pthread_mutex_unlock(&mLock);
+            return !range->empty();
+        }
+
+        bool CDownloadScheduler::complete(size_t index, CBlock* block, void* peer)
+        {
+            bool valid = memcmp(block->getPrevHash(), mSlots[index].mHeader.mPrevHash, SHA256_DIGEST_LENGTH) == 0 && block->isValid();
+            pthread_mutex_lock(&mLock);
+            CSlot& slot = mSlots[index];
+            bool taken = index >= mNext && !slot.mBlock;
+            if(valid && taken)
+            {
+                slot.mBlock = block;
+                mPeers.insert(peer);
+                pthread_cond_broadcast(&mCond);
+            }
+            else if(taken)
+            {
+                slot.mPeer = 0;
+                slot.mFailedPeer = peer;
+                slot.mAssigned = time(0);
+            }
+            pthread_mutex_unlock(&mLock);
+            if(!valid || !taken)
+                delete block;
+            return valid && taken;
+        }
+
+        void CDownloadScheduler::fail(size_t index, void* peer)
+        {
+            pthread_mutex_lock(&mLock);
+            CSlot& slot = mSlots[index];
+            if(index >= mNext && !slot.mBlock)
+            {
+                slot.mPeer = 0;
+                slot.mFailedPeer = peer;
+                slot.mAssigned = time(0);
+            }
+            pthread_mutex_unlock(&mLock);
+        }
+
+        CBlock* CDownloadScheduler::next(uint32_t waitMs)
+        {
+            struct timespec until = storage::CThrottle::deadline((uint64_t)waitMs * 1000);
+            CBlock* block = 0;
+            pthread_mutex_lock(&mLock);
+            while(!mCancelled && mNext < mSlots.size() && !mSlots[mNext].mBlock && pthread_cond_timedwait(&mCond, &mLock, &until) == 0);
+            if(mNext < mSlots.size() && mSlots[mNext].mBlock)
+            {
+                block = mSlots[mNext].mBlock;
+                mSlots[mNext++].mBlock = 0;
+            }
+            pthread_mutex_unlock(&mLock);
+            return block;
+        }
+
+        bool CDownloadScheduler::isDone()
+        {
+            pthread_mutex_lock(&mLock);
+            bool done = mNext == mSlots.size();
+            pthread_mutex_unlock(&mLock);
+            return done;
+        }
+
+        void CDownloadScheduler::cancel()
+        {
+            pthread_mutex_lock(&mLock);
+            mCancelled = true;
+            pthread_cond_broadcast(&mCond);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        size_t CDownloadScheduler::getPeerCount()
+        {
+            pthread_mutex_lock(&mLock);
+            size_t count = mPeers.size();
+            pthread_mutex_unlock(&mLock);
+            return count;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_DOWNLOAD_SCHEDULER_INCLUDED__
+#define __C_DOWNLOAD_SCHEDULER_INCLUDED__
+#include "../IReferenceCounted.h"
+#include "../CBlock.h"
+#include "CBlockHeader.h"
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <set>
+#include <pthread.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Splits the payload download of a header batch between peers.
+        //
+        // Each peer takes ranges of missing blocks and hands back what it fetched. A block is checked
+        // against its header when it arrives, and a range still missing blocks after Timeout can be
+        // taken by another peer, so a slow or dead peer only delays its own range. The syncing client
+        // takes blocks back out in height order to attach them.
+        class CDownloadScheduler : public IReferenceCounted
+        {
+        public:
+            static const uint32_t RangeSize = 16;       // Blocks handed to a peer at once
+            static const uint32_t Timeout = 10;         // Seconds before an unfinished block goes to another peer
+
+        private:
+            class CSlot
+            {
+            public:
+                CBlockHeader mHeader;
+                CBlock* mBlock;         // Checked block waiting for its turn
+                void* mPeer;            // Peer it was handed to, 0 when free
+                void* mFailedPeer;      // Last peer that could not provide it
+                time_t mAssigned;       // Handed out, or failed when mPeer is 0
+            };
+
+            std::vector<CSlot> mSlots;
+            size_t mNext;               // First slot not taken out by next()
+            std::set<void*> mPeers;     // Peers that delivered a block
+            bool mCancelled;
+            pthread_mutex_t mLock;
+            pthread_cond_t mCond;       // block delivered
+
+            CDownloadScheduler(const CDownloadScheduler&);
+            CDownloadScheduler& operator=(const CDownloadScheduler&);
+        public:
+            CDownloadScheduler(const std::vector<CBlockHeader>& headers);
+            virtual ~CDownloadScheduler();
+
+            bool take(void* peer, std::vector<size_t>* range);     // Free or overdue blocks, false when there are none
+            const CBlockHeader& getHeader(size_t index) { return mSlots[index].mHeader; }
+            bool complete(size_t index, CBlock* block, void* peer);    // Takes the block, false when it does not match or came late
+            void fail(size_t index, void* peer);                        // Peer could not provide the block
+            CBlock* next(uint32_t waitMs);          // Next block in height order, 0 when it is not there within waitMs
+            bool isDone();
+            void cancel();                          // Stop handing out ranges
+            size_t getPeerCount();
+        };
+    }
+}
+
+#endif
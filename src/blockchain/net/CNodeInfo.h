@@ -8,31 +8,126 @@
 */
 #ifndef __C_NODE_INFO_INCLUDED__
 #define __C_NODE_INFO_INCLUDED__
+#include "wire.h"
 #include <time.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
+#include <vector>
 
 namespace blockchain
 {
     namespace net
     {
+        // Known node, as listed by EMT_PEERS: port, hostname size (little endian), hostname
+        //
+        // The client connected to a node also measures it: ping round trip, download bandwidth and
+        // how many requests failed, each smoothed so recent behaviour counts most. getScore()
+        // folds them into the rate a typical block could be fetched at, discounted by failures and
+        // by how long ago the node was last heard from.
         class CNodeInfo
         {
         public:
+            static const uint32_t MaxHostNameSize = 255;
+            static const uint32_t Smoothing = 8;                // Weight of the history against a new sample
+            static const uint32_t DefaultRttUsec = 100000;      // Assumed until measured
+            static const uint32_t DefaultBandwidth = 1024 * 1024;   // Bytes per second, assumed until measured
+            static const uint32_t TypicalBlockSize = 65536;
+            static const uint32_t StaleAge = 60;                // Seconds of silence that halve the score
+
             std::string mHostName;
             uint32_t mPort;
             time_t mLastSeen;
+            double mRtt;                // Seconds, 0 until measured
+            double mBandwidth;          // Payload bytes per second, 0 until measured
+            double mRequests;           // Decaying counts
+            double mErrors;
 
             CNodeInfo(const std::string& hostname, uint32_t port)
             {
                 mHostName = hostname;
                 mPort = port;
                 mLastSeen = time(0);
+                mRtt = 0;
+                mBandwidth = 0;
+                mRequests = 0;
+                mErrors = 0;
             }
 
             void seen()
             {
                 mLastSeen = time(0);
             }
+
+            void sampleRtt(double seconds)
+            {
+                mRtt = mRtt == 0 ? seconds : mRtt + (seconds - mRtt) / Smoothing;
+                seen();
+            }
+
+            void sampleTransfer(uint64_t bytes, double seconds)
+            {
+                if(seconds <= 0)
+                    return;
+                double rate = bytes / seconds;
+                mBandwidth = mBandwidth == 0 ? rate : mBandwidth + (rate - mBandwidth) / Smoothing;
+            }
+
+            void sampleRequest(bool failed)
+            {
+                mRequests = mRequests - mRequests / Smoothing + 1;
+                mErrors = mErrors - mErrors / Smoothing + (failed ? 1 : 0);
+                if(!failed)
+                    seen();
+            }
+
+            // Keep what another record measured, used when a client to the node goes away
+            void takeMeasurements(const CNodeInfo& other)
+            {
+                mRtt = other.mRtt;
+                mBandwidth = other.mBandwidth;
+                mRequests = other.mRequests;
+                mErrors = other.mErrors;
+                if(other.mLastSeen > mLastSeen)
+                    mLastSeen = other.mLastSeen;
+            }
+
+            // Typical blocks per second, higher is better
+            double getScore() const
+            {
+                double rtt = mRtt != 0 ? mRtt : DefaultRttUsec / 1000000.0;
+                double bandwidth = mBandwidth != 0 ? mBandwidth : DefaultBandwidth;
+                double reliability = (mRequests - mErrors + 1) / (mRequests + 2);
+                double age = difftime(time(0), mLastSeen);
+                return reliability / (rtt + TypicalBlockSize / bandwidth) / (1 + age / StaleAge);
+            }
+
+            void append(std::vector<uint8_t>* out) const
+            {
+                uint8_t fields[2 * sizeof(uint32_t)];
+                putUInt32(fields, mPort);
+                putUInt32(fields + sizeof(uint32_t), mHostName.size());
+                out->insert(out->end(), fields, fields + sizeof(fields));
+                out->insert(out->end(), mHostName.begin(), mHostName.end());
+            }
+
+            // False when the list is malformed
+            static bool decode(const uint8_t* data, uint32_t size, std::vector<CNodeInfo>* nodes)
+            {
+                uint32_t pos = 0;
+                while(pos < size)
+                {
+                    if(size - pos < 2 * sizeof(uint32_t))
+                        return false;
+                    uint32_t port = getUInt32(data + pos), length = getUInt32(data + pos + sizeof(uint32_t));
+                    pos += 2 * sizeof(uint32_t);
+                    if(length == 0 || length > MaxHostNameSize || size - pos < length)
+                        return false;
+                    nodes->push_back(CNodeInfo(std::string((const char*)data + pos, length), port));
+                    pos += length;
+                }
+                return true;
+            }
         };
     }
 }
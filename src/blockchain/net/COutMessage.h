@@ -0,0 +1,56 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_OUT_MESSAGE_INCLUDED__
+#define __C_OUT_MESSAGE_INCLUDED__
+#include "../IReferenceCounted.h"
+#include "../CBlock.h"
+#include "CPacket.h"
+#include <string.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Packet queued for one or more peers. Built once per fan out and shared, it owns a copy of
+        // the payload so the block can be evicted or repacked while the message waits. Not changed
+        // after construction, so any number of client workers may send it at once.
+        //
+        // mHash is the relay id, the hash the block was first mined with. A relayed block is mined
+        // again on top of each chain it reaches, the relay id lets every node recognise it.
+        class COutMessage : public IReferenceCounted
+        {
+        private:
+            CPacket mPacket;
+        public:
+            COutMessage(EMessageType type, CBlock* block, const uint8_t* relayId = 0)
+            {
+                mPacket.mMessageType = type;
+                memcpy(mPacket.mHash, relayId ? relayId : block->getHash(), SHA256_DIGEST_LENGTH);
+                memcpy(mPacket.mPrevHash, block->getPrevHash(), SHA256_DIGEST_LENGTH);
+                uint32_t size = block->getDataSize();
+                if(size != 0)
+                {
+                    CBlockData payload(block);
+                    uint8_t* data = new uint8_t[size];
+                    memcpy(data, payload.get(), size);
+                    mPacket.setData(data, size, true);
+                }
+            }
+
+            virtual ~COutMessage()
+            {
+                mPacket.destroyData();
+            }
+
+            CPacket* getPacket() { return &mPacket; }   // Shared, read only
+        };
+    }
+}
+
+#endif
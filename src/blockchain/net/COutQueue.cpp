@@ -0,0 +1,105 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+ */
+#include "COutQueue.h"
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace net
+    {
+        COutQueue::COutQueue(uint32_t capacity)
+        {
+            uint64_t size = 2;
+            while(size < capacity)
+                size <<= 1;
+            mSlots = new CSlot[size];
+            for(uint64_t n = 0; n < size; n++)
+            {
+                mSlots[n].mSequence.store(n, std::memory_order_relaxed);
+                mSlots[n].mMessage = 0;
+            }
+            mMask = size - 1;
+            mHead.store(0, std::memory_order_relaxed);
+            mTail.store(0, std::memory_order_relaxed);
+        }
+
+        COutQueue::~COutQueue()
+        {
+            while(COutMessage* message = pop())
+                message->drop();
+            delete[] mSlots;
+        }
+
+        bool COutQueue::push(COutMessage* message)
+        {
+            uint64_t pos = mTail.load(std::memory_order_relaxed);
+            CSlot* slot;
+            for(;;)
+            {
+                slot = &mSlots[pos & mMask];
+                int64_t diff = (int64_t)slot->mSequence.load(std::memory_order_acquire) - (int64_t)pos;
+                if(diff == 0)
+                {
+                    if(mTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if(diff < 0)
+                    return false;       // slot still holds the message from one lap ago
+                else
+                    pos = mTail.load(std::memory_order_relaxed);
+            }
+            message->grab();
+            slot->mMessage = message;
+            slot->mSequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        COutMessage* COutQueue::pop()
+        {
+            uint64_t pos = mHead.load(std::memory_order_relaxed);
+            CSlot* slot;
+            for(;;)
+            {
+                slot = &mSlots[pos & mMask];
+                int64_t diff = (int64_t)slot->mSequence.load(std::memory_order_acquire) - (int64_t)(pos + 1);
+                if(diff == 0)
+                {
+                    if(mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if(diff < 0)
+                    return 0;           // empty, or the push for this slot has not finished
+                else
+                    pos = mHead.load(std::memory_order_relaxed);
+            }
+            COutMessage* message = slot->mMessage;
+            slot->mMessage = 0;
+            slot->mSequence.store(pos + mMask + 1, std::memory_order_release);
+            return message;
+        }
+
+        uint32_t COutQueue::getDepth()
+        {
+            uint64_t head = mHead.load(std::memory_order_acquire);
+            uint64_t tail = mTail.load(std::memory_order_acquire);
+            return tail > head ? (uint32_t)(tail - head) : 0;
+        }
+
+        E_QUEUE_POLICY COutQueue::policyFromName(const std::string& name)
+        {
+            if(name == "block")
+                return EQP_BLOCK;
+            else if(name == "drop")
+                return EQP_DROP_OLDEST;
+            else if(name == "disconnect")
+                return EQP_DISCONNECT;
+            throw std::runtime_error("Unknown queue policy: " + name);
+        }
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_OUT_QUEUE_INCLUDED__
+#define __C_OUT_QUEUE_INCLUDED__
+#include "COutMessage.h"
+#include "EQueuePolicy.h"
+#include <stdint.h>
+#include <string>
+#include <atomic>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Bounded lock free queue of outbound messages for one peer.
+        //
+        // Slots carry a sequence number that says whether they are free for the push at that
+        // position or hold the message for the pop at that position, so pushes only contend on
+        // the tail and never take a lock. Any number of threads may push. The client worker pops,
+        // and a pusher may pop too when it drops the oldest message to make room.
+        class COutQueue
+        {
+        private:
+            class CSlot
+            {
+            public:
+                std::atomic<uint64_t> mSequence;
+                COutMessage* mMessage;
+            };
+
+            CSlot* mSlots;
+            uint64_t mMask;                     // Capacity - 1, capacity is a power of two
+            std::atomic<uint64_t> mHead;        // Next pop
+            std::atomic<uint64_t> mTail;        // Next push
+
+            COutQueue(const COutQueue&);
+            COutQueue& operator=(const COutQueue&);
+        public:
+            COutQueue(uint32_t capacity);
+            ~COutQueue();                       // Drops what is still queued
+
+            bool push(COutMessage* message);    // Takes a reference, false when full
+            COutMessage* pop();                 // Oldest message or 0, the caller drops it
+            bool isEmpty() { return getDepth() == 0; }
+            uint32_t getDepth();
+            uint32_t getCapacity() { return mMask + 1; }
+
+            static E_QUEUE_POLICY policyFromName(const std::string& name);
+        };
+    }
+}
+
+#endif
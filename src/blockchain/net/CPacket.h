@@ -30,6 +30,8 @@ namespace blockchain
             uint8_t mPrevHash[SHA256_DIGEST_LENGTH];
             time_t mCreatedTS;
             uint32_t mNonce;
+            uint32_t mRequestId;        // Version 3 framing, answers carry the id of their request
+            uint16_t mFlags;            // Version 2 framing, CWireCompression::FlagLZ
 
             CPacket()
             {
@@ -57,6 +59,8 @@ namespace blockchain
                 mVersion = 1;
                 mMessageType = EMT_NULL;
                 mNonce = 0;
+                mRequestId = 0;
+                mFlags = 0;
                 mCreatedTS = 0;
                 memset(mHash, 0, SHA256_DIGEST_LENGTH);
                 memset(mPrevHash, 0, SHA256_DIGEST_LENGTH);
@@ -64,6 +68,15 @@ namespace blockchain
                 mData = 0;
             }
 
+            // Hand the payload buffer to a new owner, 0 when the packet does not own one
+            uint8_t* releaseData()
+            {
+                uint8_t* data = mTrackDataAlloc ? mData : 0;
+                mTrackDataAlloc = false;
+                mData = 0;
+                return data;
+            }
+
             void setData(uint8_t* data, uint64_t dataSize, bool trackAlloc = false)
             {
                 mData = data;
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CPacketParser.h"
+#include "wire.h"
+#include "../storage/crc32c.h"
+#include <stdexcept>
+#include <string>
+#include <netinet/in.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        static const size_t CrcOffset = 2 * sizeof(uint32_t);
+
+        static inline uint32_t readUInt(const uint8_t* ptr)
+        {
+            uint32_t netNum = 0;
+            memcpy(&netNum, ptr, sizeof(uint32_t));
+            return ntohl(netNum);
+        }
+
+        static inline void writeUInt(uint8_t* ptr, uint32_t num)
+        {
+            uint32_t netNum = htonl(num);
+            memcpy(ptr, &netNum, sizeof(uint32_t));
+        }
+
+        static uint32_t headerCrc(const uint8_t* header, size_t headerSize)
+        {
+            uint8_t copy[CPacketParser::MaxHeaderSize];
+            memcpy(copy, header, headerSize);
+            memset(copy + CrcOffset, 0, sizeof(uint32_t));
+            return storage::crc32c(copy, headerSize);
+        }
+
+        CPacketParser::CPacketParser()
+        {
+            mStart = 0;
+            mEnd = 0;
+            mPendingVersion = 0;
+            mPayload = 0;
+            mPayloadFill = 0;
+        }
+
+        CPacketParser::~CPacketParser()
+        {
+            if(mPayload)
+                delete[] mPayload;
+        }
+
+        uint8_t* CPacketParser::reserve(size_t* size)
+        {
+            if(mPayload)
+            {
+                *size = mPending.mDataSize - mPayloadFill;
+                return mPayload + mPayloadFill;
+            }
+            if(mBuffer.size() - mEnd < ReadSize)
+            {
+                if(mStart != 0)
+                {
+                    // Move the partial packet to the front before growing
+                    memmove(mBuffer.data(), mBuffer.data() + mStart, mEnd - mStart);
+                    mEnd -= mStart;
+                    mStart = 0;
+                }
+                if(mBuffer.size() - mEnd < ReadSize)
+                    mBuffer.resize(mEnd + ReadSize);
+            }
+            *size = mBuffer.size() - mEnd;
+            return mBuffer.data() + mEnd;
+        }
+
+        void CPacketParser::commit(size_t size)
+        {
+            if(mPayload)
+                mPayloadFill += size;
+            else
+                mEnd += size;
+        }
+
+        bool CPacketParser::finishPayload(CPacket* packet)
+        {
+            uint8_t* data = mPayload;
+            uint32_t dataSize = mPending.mDataSize;
+            mPayload = 0;
+            mPayloadFill = 0;
+            if(!checkData(mPendingHeader, mPendingVersion, data, dataSize))
+            {
+                delete[] data;
+                throw std::runtime_error("Packet checksum mismatch.");
+            }
+            packet->reset();
+            *packet = mPending;
+            packet->setData(data, dataSize, true);
+            return true;
+        }
+
+        bool CPacketParser::next(CPacket* packet)
+        {
+            if(mPayload)
+                return mPayloadFill == mPending.mDataSize && finishPayload(packet);
+            if(mEnd - mStart < sizeof(uint32_t))
+                return false;
+            const uint8_t* ptr = mBuffer.data() + mStart;
+            uint32_t version = getVersion(ptr);
+            size_t headerSize = getHeaderSize(version);
+            if(mEnd - mStart < headerSize)
+                return false;
+
+            CPacket header;
+            uint32_t dataSize = decodeHeader(ptr, version, &header);
+            if(mEnd - mStart < headerSize + dataSize)
+            {
+                if(dataSize < DirectSize)
+                    return false;
+
+                // Large payload, take what is staged and read the rest in place
+                size_t staged = mEnd - mStart - headerSize;
+                memcpy(mPendingHeader, ptr, headerSize);
+                mPendingVersion = version;
+                mPending = header;
+                mPayload = new uint8_t[dataSize];
+                memcpy(mPayload, ptr + headerSize, staged);
+                mPayloadFill = staged;
+                mStart = mEnd = 0;
+                return false;
+            }
+            if(!checkData(ptr, version, ptr + headerSize, dataSize))
+                throw std::runtime_error("Packet checksum mismatch.");
+
+            packet->reset();
+            *packet = header;
+            if(dataSize != 0)
+            {
+                uint8_t* data = new uint8_t[dataSize];
+                memcpy(data, ptr + headerSize, dataSize);
+                packet->setData(data, dataSize, true);
+            }
+
+            mStart += headerSize + dataSize;
+            if(mStart == mEnd)
+                mStart = mEnd = 0;
+            return true;
+        }
+
+        uint32_t CPacketParser::getVersion(const uint8_t* buf)
+        {
+            uint32_t magic = getUInt32(buf);
+            return magic == Magic3 ? 3 : (magic == Magic ? 2 : 1);
+        }
+
+        size_t CPacketParser::getHeaderSize(uint32_t version)
+        {
+            return version >= 3 ? V3HeaderSize : (version == 2 ? V2HeaderSize : V1HeaderSize);
+        }
+
+        size_t CPacketParser::encodeHeader(CPacket* packet, uint32_t version, uint8_t* out)
+        {
+            uint32_t dataSize = packet->mData ? packet->mDataSize : 0;
+            size_t headerSize = writeHeader(packet, version, dataSize, out);
+            if(version >= 2)
+            {
+                uint32_t crc = storage::crc32c(packet->mData, dataSize, storage::crc32c(out, headerSize));
+                putUInt32(out + CrcOffset, crc);
+            }
+            return headerSize;
+        }
+
+        size_t CPacketParser::encodeHeader(CPacket* packet, uint32_t version, uint8_t* out, uint32_t dataCrc)
+        {
+            size_t headerSize = writeHeader(packet, version, packet->mDataSize, out);
+            if(version >= 2)
+            {
+                uint32_t crc = storage::crc32cCombine(storage::crc32c(out, headerSize), dataCrc, packet->mDataSize);
+                putUInt32(out + CrcOffset, crc);
+            }
+            return headerSize;
+        }
+
+        size_t CPacketParser::writeHeader(CPacket* packet, uint32_t version, uint32_t dataSize, uint8_t* out)
+        {
+            if(version < 2)
+            {
+                writeUInt(out, packet->mVersion);
+                writeUInt(out + 4, packet->mMessageType);
+                writeUInt(out + 8, packet->mNonce);
+                writeUInt(out + 12, (uint32_t)packet->mCreatedTS);
+                memcpy(out + 16, packet->mHash, SHA256_DIGEST_LENGTH);
+                memcpy(out + 16 + SHA256_DIGEST_LENGTH, packet->mPrevHash, SHA256_DIGEST_LENGTH);
+                writeUInt(out + 16 + SHA256_DIGEST_LENGTH * 2, dataSize);
+                return V1HeaderSize;
+            }
+
+            size_t headerSize = getHeaderSize(version);
+            putUInt32(out, version >= 3 ? Magic3 : Magic);
+            putUInt32(out + 4, dataSize);
+            putUInt32(out + 8, 0);
+            putUInt16(out + 12, (uint16_t)packet->mMessageType);
+            putUInt16(out + 14, packet->mFlags);
+            putUInt32(out + 16, packet->mNonce);
+            putUInt64(out + 20, (uint64_t)packet->mCreatedTS);
+            memcpy(out + 28, packet->mHash, SHA256_DIGEST_LENGTH);
+            memcpy(out + 28 + SHA256_DIGEST_LENGTH, packet->mPrevHash, SHA256_DIGEST_LENGTH);
+            if(version >= 3)
+                putUInt32(out + V2HeaderSize, packet->mRequestId);
+            return headerSize;
+        }
+
+        uint32_t CPacketParser::decodeHeader(const uint8_t* header, uint32_t version, CPacket* packet)
+        {
+            uint32_t dataSize = 0;
+            packet->reset();
+            if(version < 2)
+            {
+                packet->mVersion = readUInt(header);
+                packet->mMessageType = (EMessageType)readUInt(header + 4);
+                packet->mNonce = readUInt(header + 8);
+                packet->mCreatedTS = (time_t)readUInt(header + 12);
+                memcpy(packet->mHash, header + 16, SHA256_DIGEST_LENGTH);
+                memcpy(packet->mPrevHash, header + 16 + SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+                dataSize = readUInt(header + 16 + SHA256_DIGEST_LENGTH * 2);
+            }
+            else
+            {
+                dataSize = getUInt32(header + 4);
+                packet->mMessageType = (EMessageType)getUInt16(header + 12);
+                packet->mFlags = getUInt16(header + 14);
+                packet->mNonce = getUInt32(header + 16);
+                packet->mCreatedTS = (time_t)getUInt64(header + 20);
+                memcpy(packet->mHash, header + 28, SHA256_DIGEST_LENGTH);
+                memcpy(packet->mPrevHash, header + 28 + SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+                if(version >= 3)
+                    packet->mRequestId = getUInt32(header + V2HeaderSize);
+                packet->mVersion = version;
+            }
+            if(dataSize > MaxDataSize)
+                throw std::runtime_error("Packet data size is too large: " + std::to_string(dataSize));
+            packet->mDataSize = dataSize;
+            return dataSize;
+        }
+
+        bool CPacketParser::checkData(const uint8_t* header, uint32_t version, const uint8_t* data, uint32_t size)
+        {
+            if(version < 2)
+                return true;    // version 1 has no checksum
+            uint32_t crc = getUInt32(header + CrcOffset);
+            return crc == storage::crc32c(data, size, headerCrc(header, getHeaderSize(version)));
+        }
+
+        void CPacketParser::encode(CPacket* packet, uint32_t version, std::vector<uint8_t>* out)
+        {
+            uint8_t header[MaxHeaderSize];
+            size_t headerSize = encodeHeader(packet, version, header);
+            out->insert(out->end(), header, header + headerSize);
+            if(packet->mData && packet->mDataSize != 0)
+                out->insert(out->end(), packet->mData, packet->mData + packet->mDataSize);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_PACKET_PARSER_INCLUDED__
+#define __C_PACKET_PARSER_INCLUDED__
+#include "CPacket.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Wire framing of a CPacket, and an incremental decoder for sockets read as bytes arrive.
+        //
+        // Version 1: version, type, nonce, createdTS, hash[32], prevHash[32], dataSize, data
+        //            every integer a big endian uint32
+        // Version 2: magic, length, crc, type (16), flags (16), nonce, createdTS (64), hash[32], prevHash[32], data
+        //            little endian, crc is CRC32C over the header with crc zeroed followed by the data as sent,
+        //            flags tell how the data was packed (see CWireCompression)
+        // Version 3: version 2 with its own magic and a request id after prevHash, so a peer can keep
+        //            several requests outstanding and match the answers
+        //
+        // A version 1 packet starts with its version number and later versions with their magic,
+        // so the framing of every packet is known from its first four bytes.
+        //
+        // Headers and small packets are staged in a receive buffer that is read in large chunks.
+        // Payloads of DirectSize or more skip it: once the header is known the rest of the payload
+        // is read straight into its own allocation, which the packet then owns and can pass on.
+        class CPacketParser
+        {
+        public:
+            static const uint32_t Magic = 0x32504342;   // "BCP2"
+            static const uint32_t Magic3 = 0x33504342;  // "BCP3"
+            static const uint32_t MaxVersion = 3;
+            static const uint32_t V1HeaderSize = 4 * sizeof(uint32_t) + SHA256_DIGEST_LENGTH * 2 + sizeof(uint32_t);
+            static const uint32_t V2HeaderSize = 3 * sizeof(uint32_t) + 2 * sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint64_t) + SHA256_DIGEST_LENGTH * 2;
+            static const uint32_t V3HeaderSize = V2HeaderSize + sizeof(uint32_t);
+            static const uint32_t MaxHeaderSize = V3HeaderSize;
+            static const uint32_t MaxDataSize = 256 * 1024 * 1024;
+            static const uint32_t ReadSize = 16384;     // Free space offered to each read
+            static const uint32_t DirectSize = ReadSize;    // Payloads this large are read in place
+
+        private:
+            std::vector<uint8_t> mBuffer;
+            size_t mStart;                              // First unparsed byte
+            size_t mEnd;                                // End of received bytes
+            CPacket mPending;                           // Header of the payload being read in place
+            uint8_t mPendingHeader[MaxHeaderSize];      // Kept for the checksum
+            uint32_t mPendingVersion;
+            uint8_t* mPayload;                          // Payload being read in place, 0 when staging
+            uint32_t mPayloadFill;
+
+            bool finishPayload(CPacket* packet);
+            static size_t writeHeader(CPacket* packet, uint32_t version, uint32_t dataSize, uint8_t* out);   // Crc left zero
+
+            CPacketParser(const CPacketParser&);
+            CPacketParser& operator=(const CPacketParser&);
+        public:
+            CPacketParser();
+            ~CPacketParser();
+
+            uint8_t* reserve(size_t* size);             // Space for the next read, the rest of a direct payload or at least ReadSize bytes
+            void commit(size_t size);                   // Bytes written into the reserved space
+            bool next(CPacket* packet);                 // Take the next complete packet, throws on a malformed one
+            size_t getBuffered() { return mEnd - mStart + mPayloadFill; }
+
+            static uint32_t getVersion(const uint8_t* buf);                                 // Framing from the first four bytes
+            static size_t getHeaderSize(uint32_t version);
+            static size_t encodeHeader(CPacket* packet, uint32_t version, uint8_t* out);    // Returns the header size
+            static size_t encodeHeader(CPacket* packet, uint32_t version, uint8_t* out, uint32_t dataCrc);  // Payload of mDataSize bytes sent apart, dataCrc is its checksum
+            static uint32_t decodeHeader(const uint8_t* header, uint32_t version, CPacket* packet);     // Returns the data size, throws when malformed
+            static bool checkData(const uint8_t* header, uint32_t version, const uint8_t* data, uint32_t size);   // Checksum of a whole packet
+            static void encode(CPacket* packet, uint32_t version, std::vector<uint8_t>* out);     // Append the wire form
+        };
+    }
+}
+
+#endif
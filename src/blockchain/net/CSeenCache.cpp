@@ -0,0 +1,69 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+ */
+#include "CSeenCache.h"
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        CSeenCache::CSeenCache(uint32_t lifetime, size_t capacity)
+        {
+            mLifetime = lifetime;
+            mCapacity = capacity;
+            pthread_mutex_init(&mLock, 0);
+        }
+
+        CSeenCache::~CSeenCache()
+        {
+            pthread_mutex_destroy(&mLock);
+        }
+
+        void CSeenCache::expire(time_t now, size_t room)
+        {
+            while(!mOrder.empty() && (now - mOrder.front().first >= (time_t)mLifetime || mOrder.size() + room > mCapacity))
+            {
+                mHashes.erase(mOrder.front().second);
+                mOrder.pop_front();
+            }
+        }
+
+        bool CSeenCache::insert(const uint8_t* hash)
+        {
+            std::string key((const char*)hash, SHA256_DIGEST_LENGTH);
+            time_t now = time(0);
+            pthread_mutex_lock(&mLock);
+            expire(now, 1);
+            bool added = mHashes.insert(key).second;
+            if(added)
+                mOrder.push_back(std::make_pair(now, key));
+            pthread_mutex_unlock(&mLock);
+            return added;
+        }
+
+        bool CSeenCache::contains(const uint8_t* hash)
+        {
+            std::string key((const char*)hash, SHA256_DIGEST_LENGTH);
+            pthread_mutex_lock(&mLock);
+            expire(time(0), 0);
+            bool found = mHashes.find(key) != mHashes.end();
+            pthread_mutex_unlock(&mLock);
+            return found;
+        }
+
+        size_t CSeenCache::getSize()
+        {
+            pthread_mutex_lock(&mLock);
+            expire(time(0), 0);
+            size_t size = mOrder.size();
+            pthread_mutex_unlock(&mLock);
+            return size;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_SEEN_CACHE_INCLUDED__
+#define __C_SEEN_CACHE_INCLUDED__
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <set>
+#include <deque>
+#include <utility>
+#include <pthread.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Hashes seen in the last few minutes, used to pass each gossiped block on only once.
+        //
+        // A hash is remembered for mLifetime seconds, long enough for a block to cross the overlay,
+        // and at most mCapacity hashes are kept so a burst cannot grow it without bound.
+        class CSeenCache
+        {
+        private:
+            std::set<std::string> mHashes;
+            std::deque<std::pair<time_t, std::string> > mOrder;    // Oldest first
+            uint32_t mLifetime;
+            size_t mCapacity;
+            pthread_mutex_t mLock;
+
+            void expire(time_t now, size_t room);      // Forget old hashes, leaving room for more
+
+            CSeenCache(const CSeenCache&);
+            CSeenCache& operator=(const CSeenCache&);
+        public:
+            CSeenCache(uint32_t lifetime, size_t capacity);
+            ~CSeenCache();
+
+            bool insert(const uint8_t* hash);      // False when the hash was already seen
+            bool contains(const uint8_t* hash);
+            size_t getSize();
+        };
+    }
+}
+
+#endif
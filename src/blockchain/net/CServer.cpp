@@ -7,12 +7,22 @@
  * in the source distribution.
  */
 #include "CServer.h"
+#include "CBlockHeader.h"
+#include "CBlockBatch.h"
 #include "../CChain.h"
+#include "../storage/crc32c.h"
 #include <stdexcept>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <algorithm>
 #include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <poll.h>
 
 #define PCHAIN ((CChain *)mChain)
 
@@ -21,50 +31,139 @@ namespace blockchain
     namespace net
     {
 
+        uint32_t CServer::mDefaultIOThreads(0);
+        uint32_t CServer::mDefaultDegree(8);
+        std::string CServer::mDefaultLocalPath;
+
+        void CServer::setDefaultIOThreads(uint32_t threads)
+        {
+            mDefaultIOThreads = threads;
+        }
+
+        void CServer::setDefaultDegree(uint32_t degree)
+        {
+            mDefaultDegree = degree;
+        }
+
+        void CServer::setDefaultLocalPath(const std::string &path)
+        {
+            mDefaultLocalPath = path;
+        }
+
         CServer::CServer(void *chain, uint32_t listenPort) : mLog("Server")
         {
             mChain = chain;
             mListenPort = listenPort;
-            mBacklog = 5;
-            mListenerSocket = 0;
+            mBacklog = SOMAXCONN;
+            mAcceptWake = -1;
             mRunning = false;
             mStopped = false;
             mWorkerThread = 0;
+            mNextIOThread = 0;
+            mConnectionCount = 0;
+            mNodeCount = 0;
+            mNextConnectionId = 0;
+            mGossipThread = 0;
+            mBlockThread = 0;
+            mTaking = false;
+            mRandom.seed((uint32_t)time(0) ^ (uint32_t)getpid() ^ listenPort);
+            pthread_mutex_init(&mNodeLock, 0);
+            pthread_cond_init(&mGossipCond, 0);
+            pthread_mutex_init(&mBlockLock, 0);
+            pthread_cond_init(&mBlockCond, 0);
+            pthread_cond_init(&mBlockIdle, 0);
         }
 
         CServer::~CServer()
         {
             stop();
+            if (mWorkerThread)
+                pthread_join(mWorkerThread, 0);
+            if (mGossipThread)
+                pthread_join(mGossipThread, 0);
+            if (mBlockThread)
+                pthread_join(mBlockThread, 0);
+            for (std::deque<CBlockJob *>::iterator it = mBlockJobs.begin(); it != mBlockJobs.end(); ++it)
+                delete *it;
+            for (std::vector<CIOThread *>::iterator it = mIOThreads.begin(); it != mIOThreads.end(); ++it)
+            {
+                pthread_join((*it)->mThread, 0);
+                for (std::vector<CBlockJob *>::iterator job = (*it)->mAnswered.begin(); job != (*it)->mAnswered.end(); ++job)
+                    delete *job;
+                close((*it)->mWake);
+                close((*it)->mEpoll);
+                pthread_mutex_destroy(&(*it)->mLock);
+                delete *it;
+            }
+            if (mAcceptWake >= 0)
+                close(mAcceptWake);
+            pthread_cond_destroy(&mBlockIdle);
+            pthread_cond_destroy(&mBlockCond);
+            pthread_mutex_destroy(&mBlockLock);
+            pthread_cond_destroy(&mGossipCond);
+            pthread_mutex_destroy(&mNodeLock);
         }
 
         void CServer::start()
         {
             mRunning = true;
-            mSocket = mListenerSocket = socket(AF_INET, SOCK_STREAM, 0);
-            if (mListenerSocket < 0)
-                throw std::runtime_error("Could not open listener socket.");
-
-            struct timeval timeout;
-            timeout.tv_sec = 10;
-            timeout.tv_usec = 0;
-            if (setsockopt(mListenerSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeval)) < 0)
-                std::runtime_error("Could not setup socket send timeout.");
-            if (setsockopt(mListenerSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeval)) < 0)
-                std::runtime_error("Could not setup socket receive timeout.");
-
-            int val = true;
-            setsockopt(mListenerSocket, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(int));
-
-            memset((char *)&mServerAddr, 0, sizeof(mServerAddr));
-            mServerAddr.sin_family = AF_INET;
-            mServerAddr.sin_port = htons(mListenPort);                                           // htons (short) -> net (short)
-            mServerAddr.sin_addr.s_addr = INADDR_ANY;                                            // listen to any client
-            if (bind(mListenerSocket, (struct sockaddr *)&mServerAddr, sizeof(mServerAddr)) < 0) // bind function
-                throw std::runtime_error(std::string("Could not bind to port.") + std::to_string(mListenPort));
-
-            listen(mListenerSocket, mBacklog); // listen
 
+            // A node named by a path only listens there, a TCP node can also take local producers on a path
+            std::string hostName(PCHAIN->getHostName());
+            if (INet::isLocalAddress(hostName))
+                mLocalPaths.push_back(hostName);
+            else
+                mListeners.push_back(INet::listenOn(std::string(), mListenPort, mBacklog));
+            if (!mDefaultLocalPath.empty() && mDefaultLocalPath != hostName)
+                mLocalPaths.push_back(mDefaultLocalPath);
+            for (std::vector<std::string>::iterator it = mLocalPaths.begin(); it != mLocalPaths.end(); ++it)
+            {
+                mListeners.push_back(INet::listenOn(*it, 0, mBacklog));
+                mLog.writeLine("Listening on " + *it);
+            }
+            mSocket = mListeners.front();
+            mAcceptWake = eventfd(0, EFD_NONBLOCK);
+            if (mAcceptWake < 0)
+                throw std::runtime_error("Could not create accept wake descriptor.");
+
+            // Every connection is a descriptor, allow as many as the hard limit does
+            struct rlimit limit;
+            if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+            {
+                limit.rlim_cur = limit.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &limit);
+            }
+
+            uint32_t threads = mDefaultIOThreads;
+            if (threads == 0)
+            {
+                long cores = sysconf(_SC_NPROCESSORS_ONLN);
+                threads = cores < 1 ? 1 : (cores > 4 ? 4 : (uint32_t)cores);
+            }
+            for (uint32_t n = 0; n < threads; n++)
+            {
+                CIOThread *thread = new CIOThread();
+                thread->mServer = this;
+                thread->mEpoll = epoll_create1(0);
+                thread->mWake = eventfd(0, EFD_NONBLOCK);
+                pthread_mutex_init(&thread->mLock, 0);
+                if (thread->mEpoll < 0 || thread->mWake < 0)
+                    throw std::runtime_error("Could not create server event loop.");
+                struct epoll_event event;
+                event.events = EPOLLIN;
+                event.data.ptr = 0;     // wake descriptor
+                epoll_ctl(thread->mEpoll, EPOLL_CTL_ADD, thread->mWake, &event);
+                if (pthread_create(&thread->mThread, 0, &static_io, thread) != 0)
+                    throw std::runtime_error("Failed to start server I/O thread.");
+                mIOThreads.push_back(thread);
+            }
+            mLog.writeLine("Serving connections with " + std::to_string(threads) + " I/O threads.");
+
+            if (pthread_create(&mBlockThread, 0, &static_blocks, this) != 0)
+                throw std::runtime_error("Failed to start block thread.");
             startWorker();
+            if (pthread_create(&mGossipThread, 0, &static_gossip, this) != 0)
+                throw std::runtime_error("Failed to start gossip thread.");
         }
 
         void CServer::stop()
@@ -73,25 +172,26 @@ namespace blockchain
             {
                 mRunning = false;
 
-                int stopSocket = socket(AF_INET, SOCK_STREAM, 0);
-                struct sockaddr_in addr;
-                memset((char *)&addr, 0, sizeof(addr));
-                addr.sin_family = AF_INET;
-                addr.sin_port = htons(mListenPort);
-                inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-                if (connect(stopSocket, (struct sockaddr *)&addr, sizeof(addr)) >= 0)
-                    close(stopSocket);
+                uint64_t one = 1;
+                if (mAcceptWake >= 0)
+                    write(mAcceptWake, &one, sizeof(uint64_t));
+                for (std::vector<CIOThread *>::iterator it = mIOThreads.begin(); it != mIOThreads.end(); ++it)
+                    write((*it)->mWake, &one, sizeof(uint64_t));
+
+                pthread_mutex_lock(&mNodeLock);
+                pthread_cond_broadcast(&mGossipCond);
+                pthread_mutex_unlock(&mNodeLock);
+
+                pthread_mutex_lock(&mBlockLock);
+                pthread_cond_broadcast(&mBlockCond);
+                pthread_mutex_unlock(&mBlockLock);
             }   
         }
 
         void CServer::startWorker()
         {
-            pthread_attr_t tattr;
-            pthread_attr_init(&tattr);
-            pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
-            if (pthread_create(&mWorkerThread, &tattr, &static_worker, this) != 0)
+            if (pthread_create(&mWorkerThread, 0, &static_worker, this) != 0)
                 throw std::runtime_error("Failed to start worker thread.");
-            pthread_attr_destroy(&tattr);
         }
 
         void *CServer::static_worker(void *param)
@@ -105,142 +205,415 @@ namespace blockchain
         {
             try
             {
+                // Every listener and the stop wake
+                std::vector<struct pollfd> fds(mListeners.size() + 1);
+                fds[0].fd = mAcceptWake;
+                fds[0].events = POLLIN;
+                for (size_t n = 0; n < mListeners.size(); n++)
+                {
+                    fds[n + 1].fd = mListeners[n];
+                    fds[n + 1].events = POLLIN;
+                }
                 while (mRunning)
                 {
-                    struct sockaddr clientAddr;
-                    socklen_t clientAddrLen = sizeof(clientAddr);
-                    int clientSocket = accept(mListenerSocket, (struct sockaddr *)&clientAddr, &clientAddrLen);
-                    if (clientSocket < 0)
-                    {
-                        // mLog.writeLine("Failed to accept client socket. Continue...");
+                    if (poll(fds.data(), fds.size(), -1) < 0 || !mRunning)
                         continue;
-                    }
-                    if (!mRunning)
+                    for (size_t n = 1; n < fds.size(); n++)
                     {
-                        close(clientSocket);
-                        break;
+                        if (!(fds[n].revents & POLLIN))
+                            continue;
+                        struct sockaddr_storage clientAddr;
+                        socklen_t clientAddrLen = sizeof(clientAddr);
+                        int clientSocket = accept4(fds[n].fd, (struct sockaddr *)&clientAddr, &clientAddrLen, SOCK_NONBLOCK);
+                        if (clientSocket < 0)
+                            continue;
+                        startClient(clientSocket, clientAddr.ss_family != AF_UNIX);
                     }
-                    startClient(clientSocket);
                 }
             }
             catch (std::runtime_error e)
             {
                 mLog.errorLine(std::string("Error: ") + e.what());
             }
-            close(mListenerSocket);
+            for (std::vector<int>::iterator it = mListeners.begin(); it != mListeners.end(); ++it)
+                close(*it);
+            for (std::vector<std::string>::iterator it = mLocalPaths.begin(); it != mLocalPaths.end(); ++it)
+                unlink(it->c_str());
             mLog.writeLine("Closed listener.");
             mStopped = true;
         }
 
-        void CServer::startClient(int socket)
+        void CServer::startClient(int socket, bool tcp)
         {
-            CSocketPackage *pkg = new CSocketPackage(this, socket);
-            mSocketPackages.push_back(pkg);
-            pthread_attr_t tattr;
-            pthread_attr_init(&tattr);
-            pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
-            if (pthread_create(&pkg->mThread, &tattr, &static_client, pkg) != 0)
-                throw std::runtime_error("Failed to start client node thread.");
-            pthread_attr_destroy(&tattr);
+            int val = 1;
+            if (tcp)
+                setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(int));   // small request and answer packets
+
+            CIOThread *thread = mIOThreads[mNextIOThread++ % mIOThreads.size()];
+            CConnection *conn = new CConnection(socket);
+            conn->mId = ++mNextConnectionId;
+            conn->mThread = thread;
+            pthread_mutex_lock(&thread->mLock);
+            thread->mIncoming.push_back(conn);
+            pthread_mutex_unlock(&thread->mLock);
+            uint64_t one = 1;
+            write(thread->mWake, &one, sizeof(uint64_t));
         }
 
-        void *CServer::static_client(void *param)
+        void *CServer::static_io(void *param)
         {
-            CSocketPackage *pkg = (CSocketPackage *)param;
-            pkg->mServer->client(pkg);
+            CIOThread *thread = (CIOThread *)param;
+            thread->mServer->io(thread);
             return 0;
         }
 
-        void CServer::client(CSocketPackage *pkg)
+        void CServer::io(CIOThread *thread)
         {
-            try
+            const int MaxEvents = 256;
+            struct epoll_event events[MaxEvents];
+            time_t lastSweep = time(0);
+            while (mRunning)
             {
-                struct timeval timeout;
-                timeout.tv_sec = 10;
-                timeout.tv_usec = 0;
-                if (setsockopt(pkg->mSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeval)) < 0)
-                    std::runtime_error("Could not setup socket send timeout.");
-                if (setsockopt(pkg->mSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeval)) < 0)
-                    std::runtime_error("Could not setup socket receive timeout.");
-
-                bool clientApproved = false;
-                bool pingConfirm = false;
-
-                while (mRunning && pkg->mRunning)
+                int count = epoll_wait(thread->mEpoll, events, MaxEvents, 1000);
+                for (int n = 0; n < count; n++)
                 {
-                    CPacket gotPacket = pkg->recvPacket();
-                    if (gotPacket.mMessageType == EMT_NODE_REGISTER)
+                    CConnection *conn = (CConnection *)events[n].data.ptr;
+                    if (!conn)
                     {
+                        uint64_t value = 0;
+                        read(thread->mWake, &value, sizeof(uint64_t));
+                        continue;
+                    }
+                    if (!service(conn, events[n].events))
+                        closeConnection(thread, conn);
+                }
 
-                        std::string clientHostName((char *)gotPacket.mData, gotPacket.mDataSize);
-                        gotPacket.reset();
-                        gotPacket.mMessageType = EMT_ACK;
-                        pkg->sendPacket(&gotPacket);
-                        mLog.writeLine("Got client hostname: " + clientHostName);
-
-                        gotPacket = pkg->recvPacket();
-                        if (gotPacket.mMessageType != EMT_NODE_REGISTER_PORT)
-                        {
-                            gotPacket.destroyData();
-                            throw std::runtime_error("Expecting EMT_NODE_REGISTER_PORT.");
-                        }
+                // Adopt connections handed over by the accept thread
+                std::vector<CConnection *> incoming;
+                pthread_mutex_lock(&thread->mLock);
+                incoming.swap(thread->mIncoming);
+                pthread_mutex_unlock(&thread->mLock);
+                for (std::vector<CConnection *>::iterator it = incoming.begin(); it != incoming.end(); ++it)
+                {
+                    struct epoll_event event;
+                    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    event.data.ptr = *it;
+                    if (epoll_ctl(thread->mEpoll, EPOLL_CTL_ADD, (*it)->mSocket, &event) != 0)
+                    {
+                        delete *it;
+                        continue;
+                    }
+                    thread->mConnections.insert(*it);
+                    __atomic_add_fetch(&mConnectionCount, 1, __ATOMIC_RELAXED);
+                }
+                answerBlocks(thread);
 
-                        if (gotPacket.mDataSize != sizeof(uint32_t))
-                        {
-                            gotPacket.destroyData();
-                            throw std::runtime_error("Expecting data size bigger than 0.");
-                        }
+                // Clients ping after KeepAliveInterval idle, silence past IdleTimeout means the peer is gone
+                time_t now = time(0);
+                if (now != lastSweep)
+                {
+                    lastSweep = now;
+                    std::vector<CConnection *> idle;
+                    for (std::set<CConnection *>::iterator it = thread->mConnections.begin(); it != thread->mConnections.end(); ++it)
+                    {
+                        if (!(*it)->mWaiting && now - (*it)->mLastActive > IdleTimeout)
+                            idle.push_back(*it);
+                    }
+                    for (std::vector<CConnection *>::iterator it = idle.begin(); it != idle.end(); ++it)
+                    {
+                        mLog.errorLine("Node Error: Connection timed out.");
+                        closeConnection(thread, *it);
+                    }
+                }
+            }
 
-                        uint32_t clientPort = *((uint32_t *)gotPacket.mData);
+            while (!thread->mConnections.empty())
+                closeConnection(thread, *thread->mConnections.begin());
+            pthread_mutex_lock(&thread->mLock);
+            for (std::vector<CConnection *>::iterator it = thread->mIncoming.begin(); it != thread->mIncoming.end(); ++it)
+                delete *it;
+            thread->mIncoming.clear();
+            pthread_mutex_unlock(&thread->mLock);
+        }
 
-                        gotPacket.reset();
-                        gotPacket.mMessageType = EMT_ACK;
-                        pkg->sendPacket(&gotPacket);
+        void CServer::answerBlocks(CIOThread *thread)
+        {
+            std::vector<CBlockJob *> answered;
+            pthread_mutex_lock(&thread->mLock);
+            answered.swap(thread->mAnswered);
+            pthread_mutex_unlock(&thread->mLock);
+            for (std::vector<CBlockJob *>::iterator it = answered.begin(); it != answered.end(); ++it)
+            {
+                CConnection *conn = (*it)->mConn;
+                if (thread->mConnections.count(conn) != 0 && conn->mId == (*it)->mConnId)
+                {
+                    CPacket respPacket;
+                    respPacket.mMessageType = (*it)->mAccepted ? EMT_ACK : EMT_ERR;
+                    conn->mRequestId = (*it)->mRequestId;
+                    conn->sendPacket(&respPacket);
+                    conn->mWaiting = false;
+                    conn->mLastActive = time(0);
+                    if (!service(conn, 0))
+                        closeConnection(thread, conn);
+                }
+                delete *it;
+            }
+        }
 
-                        addNodeToList(clientHostName, clientPort);
+        bool CServer::service(CConnection *conn, uint32_t events)
+        {
+            if (events & EPOLLERR)
+                return false;
+            if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+                conn->mReadable = true;
+            try
+            {
+                if (!conn->flush())
+                    return false;
+                while (true)
+                {
+                    // A chain being sent goes out as the output drains, before any later request is answered
+                    walkChain(conn);
 
-                        mLog.writeLine("Acknoledge client.");
-                        clientApproved = true;
-                    }
-                    else
+                    // Answer what is buffered, unless the peer is not reading its answers
+                    CPacket packet;
+                    bool parsed = false;     // every complete frame has been handled
+                    while (!conn->mWaiting && conn->mWalk == 0 && conn->getPending() < MaxPendingOutput)
                     {
-                        if (!clientApproved)
+                        if (!conn->mParser.next(&packet))
                         {
-                            gotPacket.destroyData();
-                            throw std::runtime_error("Client is not approved for anything except EMT_NODE_REGISTER.");
+                            parsed = true;
+                            break;
                         }
-
+                        conn->mLastActive = time(0);
                         try
                         {
-                            processPacket(pkg, &gotPacket, &pingConfirm);
+                            conn->mCompression.expand(&packet);
+                            handlePacket(conn, &packet);
                         }
                         catch (std::runtime_error ex)
                         {
-                            gotPacket.destroyData();
-                            throw std::runtime_error(std::string("Runtime error: ") + ex.what());
+                            packet.destroyData();
+                            throw;
                         }
+                        packet.destroyData();
+                    }
+                    if (!conn->flush())
+                        return false;
+                    if (conn->mWaiting || conn->getPending() >= MaxPendingOutput)
+                        return true;    // resumed by the EPOLLOUT edge or the block thread's answer
+                    if (conn->mWalk != 0)
+                    {
+                        if (conn->getPending() != 0)
+                            return true;    // socket is full, resumed by the EPOLLOUT edge
+                        continue;
                     }
-                    gotPacket.destroyData();
+                    if (!parsed)
+                        continue;       // output drained, frames are still buffered and no edge will come for them
+                    if (!conn->mReadable)
+                        return true;
+                    if (!conn->fill())
+                        return false;
                 }
             }
             catch (std::runtime_error e)
             {
                 mLog.errorLine(std::string("Node Error: ") + e.what());
+                return false;
+            }
+        }
+
+        void CServer::handlePacket(CConnection *conn, CPacket *packet)
+        {
+            conn->mRequestId = packet->mRequestId;
+            if (packet->mMessageType == EMT_NODE_REGISTER)
+            {
+                conn->mHostName = std::string((char *)packet->mData, packet->mDataSize);
+                CPacket respPacket;
+                respPacket.mMessageType = EMT_ACK;
+                respPacket.mVersion = packet->mVersion > CPacketParser::MaxVersion ? (uint32_t)CPacketParser::MaxVersion : (packet->mVersion < 1 ? 1 : packet->mVersion);
+                respPacket.mNonce = CWireCompression::FeatureLZ;    // what we read, older clients ignore it
+                conn->sendPacket(&respPacket);
+                conn->mWireVersion = respPacket.mVersion;      // the answer still goes out in the old framing
+                if (packet->mNonce & CWireCompression::FeatureLZ)
+                    conn->mCompression.enable(conn->mWireVersion);
+                mLog.writeLine("Got client hostname: " + conn->mHostName);
+                conn->mState = CConnection::ES_REGISTERING;
+            }
+            else if (conn->mState == CConnection::ES_REGISTERING)
+            {
+                if (packet->mMessageType != EMT_NODE_REGISTER_PORT)
+                    throw std::runtime_error("Expecting EMT_NODE_REGISTER_PORT.");
+                if (packet->mDataSize != sizeof(uint32_t))
+                    throw std::runtime_error("Expecting data size bigger than 0.");
+
+                uint32_t clientPort = 0;
+                memcpy(&clientPort, packet->mData, sizeof(uint32_t));
+
+                CPacket respPacket;
+                respPacket.mMessageType = EMT_ACK;
+                conn->sendPacket(&respPacket);
+
+                addNodeToList(conn->mHostName, clientPort);
+
+                mLog.writeLine("Acknoledge client.");
+                conn->mState = CConnection::ES_APPROVED;
+                __atomic_add_fetch(&mNodeCount, 1, __ATOMIC_RELAXED);
+            }
+            else if (conn->mState != CConnection::ES_APPROVED)
+                throw std::runtime_error("Client is not approved for anything except EMT_NODE_REGISTER.");
+            else
+            {
+                try
+                {
+                    processPacket(conn, packet, &conn->mPingConfirm);
+                }
+                catch (std::runtime_error ex)
+                {
+                    throw std::runtime_error(std::string("Runtime error: ") + ex.what());
+                }
             }
-            shutdown(pkg->mSocket, SHUT_RDWR);
-            close(pkg->mSocket);
+        }
+
+        void CServer::closeConnection(CIOThread *thread, CConnection *conn)
+        {
+            epoll_ctl(thread->mEpoll, EPOLL_CTL_DEL, conn->mSocket, 0);
+            thread->mConnections.erase(conn);
+            if (conn->mState == CConnection::ES_APPROVED)
+                __atomic_sub_fetch(&mNodeCount, 1, __ATOMIC_RELAXED);
+            if (conn->mCompression.hasTraffic())
+                mLog.writeLine("Compression with " + conn->mHostName + ": " + conn->mCompression.getReport());
+            delete conn;
             mLog.writeLine("Closed node.");
-            std::vector<CSocketPackage *>::iterator f = std::find(mSocketPackages.begin(), mSocketPackages.end(), pkg);
-            if (f != mSocketPackages.end())
-                mSocketPackages.erase(f);
-            delete pkg;
-            mLog.writeLine("There are currently " + std::to_string(mSocketPackages.size()) + " active nodes.");
+            uint32_t count = __atomic_sub_fetch(&mConnectionCount, 1, __ATOMIC_RELAXED);
+            mLog.writeLine("There are currently " + std::to_string(count) + " active nodes.");
+        }
+
+        CServer::CConnection::CConnection(int socket)
+        {
+            mSocket = socket;
+            mState = ES_NEW;
+            mPingConfirm = false;
+            mWireVersion = 1;
+            mRequestId = 0;
+            mReadable = true;
+            mWaiting = false;
+            mWalk = 0;
+            mLastActive = time(0);
+            mOutPos = 0;
+            mFileBytes = 0;
+        }
+
+        CServer::CConnection::~CConnection()
+        {
+            for (std::deque<CFileSpan>::iterator it = mFiles.begin(); it != mFiles.end(); ++it)
+                close(it->mFile);
+            shutdown(mSocket, SHUT_RDWR);
+            close(mSocket);
+        }
+
+        void CServer::CConnection::sendPacket(CPacket *packet)
+        {
+            packet->mRequestId = mRequestId;
+            CPacket framed(*packet);
+            mCompression.compress(&framed);
+            CPacketParser::encode(&framed, mWireVersion, &mOut);
+        }
+
+        void CServer::CConnection::sendHeader(CPacket *packet, uint32_t dataCrc)
+        {
+            uint8_t header[CPacketParser::MaxHeaderSize];
+            packet->mRequestId = mRequestId;
+            size_t headerSize = CPacketParser::encodeHeader(packet, mWireVersion, header, dataCrc);
+            mOut.insert(mOut.end(), header, header + headerSize);
+        }
+
+        void CServer::CConnection::sendData(const uint8_t *data, size_t size)
+        {
+            mOut.insert(mOut.end(), data, data + size);
+        }
+
+        void CServer::CConnection::sendFile(int file, uint64_t offset, uint32_t size)
+        {
+            CFileSpan span;
+            span.mPos = mOut.size();
+            span.mFile = file;
+            span.mOffset = offset;
+            span.mSize = size;
+            mFiles.push_back(span);
+            mFileBytes += size;
+        }
+
+        bool CServer::CConnection::flush()
+        {
+            while (true)
+            {
+                size_t end = mFiles.empty() ? mOut.size() : mFiles.front().mPos;
+                while (mOutPos < end)
+                {
+                    ssize_t r = send(mSocket, mOut.data() + mOutPos, end - mOutPos, MSG_NOSIGNAL);
+                    if (r < 0)
+                        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                    mOutPos += r;
+                }
+                if (mFiles.empty())
+                    break;
+
+                // Page cache to socket, the payload never enters user space
+                CFileSpan &span = mFiles.front();
+                while (span.mSize != 0)
+                {
+                    off_t offset = span.mOffset;
+                    ssize_t r = sendfile(mSocket, span.mFile, &offset, span.mSize);
+                    if (r < 0)
+                        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                    if (r == 0)
+                        return false;       // file shorter than its record said
+                    span.mOffset += r;
+                    span.mSize -= r;
+                    mFileBytes -= r;
+                }
+                close(span.mFile);
+                mFiles.pop_front();
+            }
+            mOut.clear();
+            mOutPos = 0;
+            return true;
+        }
+
+        bool CServer::CConnection::fill()
+        {
+            size_t size = 0;
+            uint8_t *buf = mParser.reserve(&size);
+            ssize_t r = recv(mSocket, buf, size, 0);
+            if (r < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    return false;
+                mReadable = errno == EINTR;
+                return true;
+            }
+            if (r == 0)
+                return false;   // peer closed
+            mParser.commit(r);
+            return true;
         }
 
-        void CServer::processPacket(CSocketPackage *pkg, CPacket *packet, bool *pingConfirm)
+        void CServer::processPacket(CConnection *pkg, CPacket *packet, bool *pingConfirm)
         {
+            // Blocks looked up below stay in place until the answer is queued
+            CChainReadLock reading(PCHAIN);
+
+            // The chain is being replaced by a sync, only pings are answered
+            if (PCHAIN->isSyncing() && packet->mMessageType != EMT_PING)
+            {
+                CPacket respPacket;
+                respPacket.mMessageType = EMT_ERR;
+                pkg->sendPacket(&respPacket);
+            }
+
             // Received a PING
-            if (packet->mMessageType == EMT_PING)
+            else if (packet->mMessageType == EMT_PING)
             {
                 if (!*pingConfirm)
                 {
@@ -276,56 +649,166 @@ namespace blockchain
                 }
                 else
                 {
-                    CBlock *block = PCHAIN->getCurrentBlock();
-                    CPacket respPacket;
-                    do
-                    {
-                        respPacket.mMessageType = EMT_WRITE_BLOCK;
-                        respPacket.mData = block->getData();
-                        respPacket.mDataSize = block->getDataSize();
-                        respPacket.mCreatedTS = block->getCreatedTS();
-                        respPacket.mNonce = block->getNonce();
-                        memcpy(respPacket.mHash, block->getHash(), SHA256_DIGEST_LENGTH);
-                        memcpy(respPacket.mPrevHash, block->getPrevHash(), SHA256_DIGEST_LENGTH);
-                        pkg->sendPacket(&respPacket);
-                    } while (block = block->getPrevBlock());
-                    respPacket.reset();
-                    respPacket.mMessageType = EMT_ACK;
-                    pkg->sendPacket(&respPacket);
+                    // Sent by service as the output drains, the whole chain is never queued at once
+                    pkg->mWalk = PCHAIN->getBlockCount();
+                    walkChain(pkg);
                 }
                 
             }
             
 
-            // Distribute new block
+            // New or relayed blocks, taken by the block thread
             else if (packet->mMessageType == EMT_WRITE_BLOCK)
             {
-                if(PCHAIN->hasHash(packet->mHash, 0))
+                // Writers that are not nodes leave the hash empty, they wait for their block to be taken
+                static const uint8_t noHash[SHA256_DIGEST_LENGTH] = { 0 };
+                bool producer = memcmp(packet->mHash, noHash, SHA256_DIGEST_LENGTH) == 0;
+                bool queued = queueBlocks(pkg, packet, producer);
+                if (!producer || !queued)
                 {
-                    mLog.writeLine("Block has been already mined.");
                     CPacket respPacket;
-                    respPacket.mMessageType = EMT_ERR;
+                    respPacket.mMessageType = queued ? EMT_ACK : EMT_ERR;
                     pkg->sendPacket(&respPacket);
                 }
-                else if(memcmp(packet->mPrevHash,PCHAIN->getCurrentBlock()->getHash(),SHA256_DIGEST_LENGTH) != 0)
+            }
+
+            // Announced blocks, answered with the ones we have not seen yet. A block announced by several
+            // peers is only asked from the first, and asked again elsewhere if it has not come in a few seconds.
+            else if (packet->mMessageType == EMT_INV)
+            {
+                std::vector<uint8_t> wanted;
+                for (uint32_t n = 0; n + SHA256_DIGEST_LENGTH <= packet->mDataSize; n += SHA256_DIGEST_LENGTH)
                 {
-                    mLog.writeLine("Data size: " + std::to_string(packet->mDataSize));
-                    PCHAIN->appendToCurrentBlock(packet->mData, packet->mDataSize);
-                    PCHAIN->nextBlock();
-                    packet->destroyData();
-                    CPacket respPacket;
-                    respPacket.mMessageType = EMT_ACK;
-                    pkg->sendPacket(&respPacket);
-                    mLog.writeLine("Received block: " + PCHAIN->getCurrentBlock()->getHashStr());
+                    if (!PCHAIN->hasHash(packet->mData + n, 0) && PCHAIN->requestRelay(packet->mData + n))
+                        wanted.insert(wanted.end(), packet->mData + n, packet->mData + n + SHA256_DIGEST_LENGTH);
                 }
+                CPacket respPacket;
+                respPacket.mMessageType = EMT_GET_BLOCKS;
+                respPacket.setData(wanted.data(), wanted.size());
+                pkg->sendPacket(&respPacket);
+            }
+
+            // Relayed blocks we asked for, acknowledged once queued for the block thread
+            else if (packet->mMessageType == EMT_BLOCKS)
+            {
+                std::vector<CBlockHeader> headers;
+                std::vector<const uint8_t *> payloads;
+                if (!CBlockBatch::decode(packet->mData, packet->mDataSize, &headers, &payloads))
+                    throw std::runtime_error("Malformed block batch.");
+                CPacket respPacket;
+                respPacket.mMessageType = queueBlocks(pkg, packet, false) ? EMT_ACK : EMT_ERR;
+                pkg->sendPacket(&respPacket);
+            }
+
+            // Send one stored block back, used to repair damaged copies
+            else if (packet->mMessageType == EMT_GET_BLOCK)
+            {
+                CBlock *block = PCHAIN->findBlock(packet->mHash);
+                if (block && block != PCHAIN->getCurrentBlock())
+                    sendBlock(pkg, block);
                 else
                 {
-                    mLog.writeLine("Block previous hash mismatch.");
                     CPacket respPacket;
                     respPacket.mMessageType = EMT_ERR;
                     pkg->sendPacket(&respPacket);
                 }
+            }
+
+            // Headers after the first locator hash we hold, a new node gets them from genesis
+            else if (packet->mMessageType == EMT_GET_HEADERS)
+            {
+                CBlock *fork = 0;
+                for (uint32_t n = 0; n + SHA256_DIGEST_LENGTH <= packet->mDataSize && !fork; n += SHA256_DIGEST_LENGTH)
+                    fork = PCHAIN->findBlock(packet->mData + n);
 
+                std::vector<CBlock *> blocks;
+                for (CBlock *block = PCHAIN->getCurrentBlock()->getPrevBlock(); block && block != fork && fork != PCHAIN->getCurrentBlock(); block = block->getPrevBlock())
+                    blocks.push_back(block);
+
+                std::vector<uint8_t> headers;
+                std::vector<CBlock *>::reverse_iterator last = blocks.size() > CBlockHeader::MaxCount ? blocks.rbegin() + CBlockHeader::MaxCount : blocks.rend();
+                for (std::vector<CBlock *>::reverse_iterator it = blocks.rbegin(); it != last; ++it)
+                    CBlockHeader::append(*it, &headers);
+
+                CPacket respPacket;
+                respPacket.mMessageType = EMT_HEADERS;
+                respPacket.setData(headers.data(), headers.size());
+                pkg->sendPacket(&respPacket);
+            }
+
+            // Sealed blocks by hash in one frame, the ones we do not hold are left out
+            else if (packet->mMessageType == EMT_GET_BLOCKS)
+            {
+                // A compressing connection packs the whole frame, so the payloads are read into it
+                CBlockBatch batch;
+                std::vector<CPayloadSource> sources;
+                bool packed = pkg->mCompression.isEnabled();
+                for (uint32_t n = 0; n + SHA256_DIGEST_LENGTH <= packet->mDataSize && !batch.isFull(); n += SHA256_DIGEST_LENGTH)
+                {
+                    CBlock *block = PCHAIN->findBlock(packet->mData + n);
+                    if (!block || block == PCHAIN->getCurrentBlock())
+                        continue;
+                    if (packed)
+                        batch.add(block);
+                    else
+                    {
+                        batch.addHeader(block);
+                        sources.push_back(CPayloadSource());
+                        openPayload(pkg, block, &sources.back());
+                    }
+                }
+                std::vector<uint8_t> table;
+                batch.encode(&table);
+                CPacket respPacket;
+                respPacket.mMessageType = EMT_BLOCKS;
+                if (packed)
+                {
+                    respPacket.setData(table.data(), table.size());
+                    pkg->sendPacket(&respPacket);
+                }
+                else
+                {
+                    uint32_t crc = storage::crc32c(table.data(), table.size());
+                    respPacket.mDataSize = table.size();
+                    for (std::vector<CPayloadSource>::iterator it = sources.begin(); it != sources.end(); ++it)
+                    {
+                        crc = storage::crc32cCombine(crc, it->mCrc, it->mBlock->getDataSize());
+                        respPacket.mDataSize += it->mBlock->getDataSize();
+                    }
+                    pkg->sendHeader(&respPacket, crc);
+                    pkg->sendData(table.data(), table.size());
+                    for (std::vector<CPayloadSource>::iterator it = sources.begin(); it != sources.end(); ++it)
+                        sendPayload(pkg, &*it);
+                }
+            }
+
+            // Some of the nodes we know, so the peer can pick its own
+            else if (packet->mMessageType == EMT_GET_PEERS)
+            {
+                std::vector<CNodeInfo> nodes;
+                std::vector<CClient *> clients(PCHAIN->getClients());
+                for (std::vector<CClient *>::iterator it = clients.begin(); it != clients.end(); ++it)
+                {
+                    if (!(*it)->isStopped())
+                        nodes.push_back(CNodeInfo((*it)->getHost(), (*it)->getPort()));
+                }
+                CChain::releaseClients(&clients);
+                pthread_mutex_lock(&mNodeLock);
+                nodes.insert(nodes.end(), mNodeList.begin(), mNodeList.end());
+                std::shuffle(nodes.begin(), nodes.end(), mRandom);
+                pthread_mutex_unlock(&mNodeLock);
+
+                std::vector<uint8_t> data;
+                std::set<std::string> listed;
+                for (std::vector<CNodeInfo>::iterator it = nodes.begin(); it != nodes.end() && listed.size() < MaxPeersSent; ++it)
+                {
+                    if (listed.insert(it->mHostName + ":" + std::to_string(it->mPort)).second)
+                        it->append(&data);
+                }
+                CPacket respPacket;
+                respPacket.mMessageType = EMT_PEERS;
+                respPacket.setData(data.data(), data.size());
+                pkg->sendPacket(&respPacket);
             }
 
             // Error unknown packet
@@ -335,37 +818,454 @@ namespace blockchain
             }
         }
 
-        void CServer::addNodeToList(const std::string &hostname, uint32_t port)
+        bool CServer::queueBlocks(CConnection *conn, CPacket *packet, bool producer)
+        {
+            pthread_mutex_lock(&mBlockLock);
+            if (!producer && mBlockJobs.size() >= MaxBlockJobs)
+            {
+                pthread_mutex_unlock(&mBlockLock);
+                mLog.errorLine("Block queue is full, refusing relayed blocks from " + conn->mHostName + ".");
+                return false;
+            }
+            CBlockJob *job = new CBlockJob();
+            job->mPacket = *packet;
+            packet->releaseData();
+            if (producer)
+            {
+                // One write in flight per producer, its input waits for the answer
+                job->mThread = conn->mThread;
+                job->mConn = conn;
+                job->mConnId = conn->mId;
+                job->mRequestId = conn->mRequestId;
+                conn->mWaiting = true;
+            }
+            mBlockJobs.push_back(job);
+            pthread_cond_signal(&mBlockCond);
+            pthread_mutex_unlock(&mBlockLock);
+            return true;
+        }
+
+        void *CServer::static_blocks(void *param)
+        {
+            ((CServer *)param)->blocks();
+            return 0;
+        }
+
+        void CServer::blocks()
+        {
+            while (true)
+            {
+                pthread_mutex_lock(&mBlockLock);
+                while (mRunning && mBlockJobs.empty())
+                    pthread_cond_wait(&mBlockCond, &mBlockLock);
+                if (!mRunning)
+                {
+                    pthread_mutex_unlock(&mBlockLock);
+                    break;
+                }
+                CBlockJob *job = mBlockJobs.front();
+                mBlockJobs.pop_front();
+                mTaking = true;
+                pthread_mutex_unlock(&mBlockLock);
+
+                try
+                {
+                    job->mAccepted = takeBlocks(&job->mPacket);
+                }
+                catch (std::exception &e)
+                {
+                    mLog.errorLine(std::string("Could not take block: ") + e.what());
+                }
+                job->mPacket.destroyData();
+                pthread_mutex_lock(&mBlockLock);
+                mTaking = false;
+                pthread_cond_broadcast(&mBlockIdle);
+                pthread_mutex_unlock(&mBlockLock);
+                if (!job->mConn)
+                {
+                    delete job;
+                    continue;
+                }
+                CIOThread *thread = job->mThread;
+                pthread_mutex_lock(&thread->mLock);
+                thread->mAnswered.push_back(job);
+                pthread_mutex_unlock(&thread->mLock);
+                uint64_t one = 1;
+                write(thread->mWake, &one, sizeof(uint64_t));
+            }
+        }
+
+        void CServer::drainBlocks()
+        {
+            // A job taken before the chain started refusing may still be adding its blocks
+            pthread_mutex_lock(&mBlockLock);
+            while (mTaking)
+                pthread_cond_wait(&mBlockIdle, &mBlockLock);
+            pthread_mutex_unlock(&mBlockLock);
+        }
+
+        bool CServer::takeBlocks(CPacket *packet)
+        {
+            // The chain is being replaced by a sync
+            if (PCHAIN->isSyncing())
+                return false;
+            if (packet->mMessageType == EMT_WRITE_BLOCK)
+            {
+                static const uint8_t noHash[SHA256_DIGEST_LENGTH] = { 0 };
+                const uint8_t *relayId = memcmp(packet->mHash, noHash, SHA256_DIGEST_LENGTH) != 0 ? packet->mHash : 0;
+                if (relayId && PCHAIN->isRelayed(relayId))
+                {
+                    mLog.writeLine("Block has been already relayed.");
+                    return false;
+                }
+                return receiveBlock(relayId, packet->mPrevHash, packet->mData, packet->mDataSize);
+            }
+
+            std::vector<CBlockHeader> headers;
+            std::vector<const uint8_t *> payloads;
+            CBlockBatch::decode(packet->mData, packet->mDataSize, &headers, &payloads);    // checked when queued
+            bool accepted = false;
+            for (size_t n = 0; n < headers.size(); n++)
+            {
+                if (!PCHAIN->isRelayed(headers[n].mHash))     // taken from another peer meanwhile
+                    accepted |= receiveBlock(headers[n].mHash, headers[n].mPrevHash, (uint8_t *)payloads[n], headers[n].mDataSize);
+            }
+            return accepted;
+        }
+
+        bool CServer::receiveBlock(const uint8_t *relayId, const uint8_t *prevHash, uint8_t *data, uint32_t size)
+        {
+            if (relayId && PCHAIN->hasHash(relayId, 0))
+            {
+                mLog.writeLine("Block has been already mined.");
+                return false;
+            }
+            if (memcmp(prevHash, PCHAIN->getCurrentBlock()->getHash(), SHA256_DIGEST_LENGTH) == 0)
+            {
+                mLog.writeLine("Block previous hash mismatch.");
+                return false;
+            }
+            mLog.writeLine("Data size: " + std::to_string(size));
+            PCHAIN->appendToCurrentBlock(data, size);
+            PCHAIN->nextBlock(true, false);
+            PCHAIN->distributeBlock(PCHAIN->getCurrentBlock()->getPrevBlock(), relayId);    // passed on under the id it came with, if any
+            mLog.writeLine("Received block: " + PCHAIN->getCurrentBlock()->getHashStr());
+            return true;
+        }
+
+        void CServer::openPayload(CConnection *conn, CBlock *block, CPayloadSource *source)
+        {
+            source->mBlock = block;
+            source->mFile = -1;
+            source->mOffset = 0;
+            uint32_t size = 0;
+            if (!block->isResident() && conn->canSendFile() && !conn->mCompression.isEnabled())
+            {
+                // Reading it back would also push a recent block out of the payload cache
+                source->mFile = PCHAIN->getStorage()->openPayload(block->getHash(), &source->mOffset, &size, &source->mCrc);
+                if (source->mFile >= 0 && size != block->getDataSize())
+                {
+                    close(source->mFile);
+                    source->mFile = -1;
+                }
+            }
+            if (source->mFile < 0)
+            {
+                CBlockData payload(block);
+                source->mCrc = storage::crc32c(payload.get(), block->getDataSize());
+            }
+        }
+
+        void CServer::sendPayload(CConnection *conn, CPayloadSource *source)
+        {
+            if (source->mFile >= 0)
+                conn->sendFile(source->mFile, source->mOffset, source->mBlock->getDataSize());
+            else if (source->mBlock->getDataSize() != 0)
+            {
+                CBlockData payload(source->mBlock);
+                conn->sendData(payload.get(), source->mBlock->getDataSize());
+            }
+            source->mFile = -1;
+        }
+
+        void CServer::sendBlock(CConnection *conn, CBlock *block)
         {
-            for (std::vector<CClient *>::iterator it = PCHAIN->getClientsPtr()->begin(); it != PCHAIN->getClientsPtr()->end(); ++it)
+            CPacket packet;
+            packet.mMessageType = EMT_WRITE_BLOCK;
+            packet.mCreatedTS = block->getCreatedTS();
+            packet.mNonce = block->getNonce();
+            memcpy(packet.mHash, block->getHash(), SHA256_DIGEST_LENGTH);
+            memcpy(packet.mPrevHash, block->getPrevHash(), SHA256_DIGEST_LENGTH);
+            if (conn->mCompression.isEnabled())
             {
-                if ((*it)->getHost() == hostname && (*it)->getPort() == port)
+                // Evicted payloads are read from their file, paging them back would push recent blocks out of the cache
+                std::vector<uint8_t> stored;
+                if (!block->isResident() && readPayload(block, &stored))
                 {
-                    mLog.writeLine("Already connected to this node (avoiding double-connect): " + hostname);
+                    packet.setData(stored.data(), stored.size());
+                    conn->sendPacket(&packet);
                     return;
                 }
+                CBlockData payload(block);
+                packet.setData(payload.get(), block->getDataSize());
+                conn->sendPacket(&packet);
+                return;
             }
+            CPayloadSource source;
+            openPayload(conn, block, &source);
+            packet.mDataSize = block->getDataSize();
+            conn->sendHeader(&packet, source.mCrc);
+            sendPayload(conn, &source);
+        }
 
-            for (std::vector<CNodeInfo>::iterator it = mNodeList.begin(); it != mNodeList.end(); ++it)
+        bool CServer::readPayload(CBlock *block, std::vector<uint8_t> *out)
+        {
+            uint64_t offset = 0;
+            uint32_t size = 0, crc = 0;
+            int file = PCHAIN->getStorage()->openPayload(block->getHash(), &offset, &size, &crc);
+            if (file < 0)
+                return false;
+            out->resize(size);
+            size_t done = 0;
+            while (done < size)
             {
-                if ((*it).mHostName == hostname && (*it).mPort == port)
+                ssize_t r = pread(file, out->data() + done, size - done, offset + done);
+                if (r <= 0)
+                    break;
+                done += r;
+            }
+            close(file);
+            return done == size && size == block->getDataSize() && storage::crc32c(out->data(), size) == crc;
+        }
+
+        void CServer::walkChain(CConnection *conn)
+        {
+            if (conn->mWalk == 0)
+                return;
+            CChainReadLock reading(PCHAIN);
+            while (conn->mWalk != 0 && conn->getPending() < MaxPendingOutput && conn->canSendFile())
+            {
+                CPacket respPacket;
+                CBlock *block = PCHAIN->isSyncing() ? 0 : PCHAIN->getBlock(conn->mWalk - 1);
+                if (!block)
                 {
-                    (*it).seen();
-                    mLog.writeLine("Found node in list: " + hostname);
-                    if ((*it).mPort != port)
-                    {
-                        (*it).mPort = port;
-                        mLog.writeLine("Port was updated to: " + std::to_string(port));
-                    }
+                    // A sync is replacing the blocks the walk has not reached
+                    conn->mWalk = 0;
+                    respPacket.mMessageType = EMT_ERR;
+                    conn->sendPacket(&respPacket);
                     return;
                 }
+                sendBlock(conn, block);
+                if (--conn->mWalk == 0)
+                {
+                    respPacket.mMessageType = EMT_ACK;
+                    conn->sendPacket(&respPacket);
+                }
+            }
+        }
+
+        void CServer::addNodeToList(const std::string &hostname, uint32_t port)
+        {
+            pthread_mutex_lock(&mNodeLock);
+            std::vector<CNodeInfo>::iterator it = mNodeList.begin();
+            while (it != mNodeList.end() && ((*it).mHostName != hostname || (*it).mPort != port))
+                ++it;
+            bool found = it != mNodeList.end();
+            if (found)
+                (*it).seen();
+            else
+                mNodeList.push_back(CNodeInfo(hostname, port));
+            if (!isSelf(hostname, port))    // avoid connecting eternally to itself
+            {
+                mConnectBack.push_back(CNodeInfo(hostname, port));
+                pthread_cond_broadcast(&mGossipCond);
+            }
+            pthread_mutex_unlock(&mNodeLock);
+            mLog.writeLine(found ? "Found node in list: " + hostname : "Added new node to list: " + INet::formatAddress(hostname, port));
+        }
+
+        void CServer::connectBack(const CNodeInfo &node)
+        {
+            if (PCHAIN->isConnected(node.mHostName, node.mPort))
+                mLog.writeLine("Already connected to this node (avoiding double-connect): " + node.mHostName);
+            else if (mDefaultDegree == 0 || PCHAIN->getClientCount() < mDefaultDegree || dropWorstPeer())
+            {
+                // blocks only flow towards a node we connect to, a full node makes room
+                try
+                {
+                    PCHAIN->connectNewClient(node.mHostName, node.mPort, true)->drop();
+                }
+                catch (std::runtime_error e)
+                {
+                    mLog.errorLine("Could not connect back to " + INet::formatAddress(node.mHostName, node.mPort) + ": " + e.what());
+                }
+            }
+        }
+
+        void CServer::learnNodes(const std::vector<CNodeInfo> &nodes)
+        {
+            size_t added = 0;
+            pthread_mutex_lock(&mNodeLock);
+            for (std::vector<CNodeInfo>::const_iterator node = nodes.begin(); node != nodes.end(); ++node)
+            {
+                if (isSelf(node->mHostName, node->mPort))
+                    continue;
+                std::vector<CNodeInfo>::iterator it = mNodeList.begin();
+                while (it != mNodeList.end() && ((*it).mHostName != node->mHostName || (*it).mPort != node->mPort))
+                    ++it;
+                if (it == mNodeList.end())
+                {
+                    mNodeList.push_back(CNodeInfo(node->mHostName, node->mPort));
+                    added++;
+                }
             }
-            mNodeList.push_back(CNodeInfo(hostname, port));
+            if (added != 0)
+                pthread_cond_broadcast(&mGossipCond);
+            pthread_mutex_unlock(&mNodeLock);
+            if (added != 0)
+                mLog.writeLine("Learned " + std::to_string(added) + " nodes from a peer.");
+        }
+
+        void CServer::rememberNode(const CNodeInfo &node)
+        {
+            pthread_mutex_lock(&mNodeLock);
+            std::vector<CNodeInfo>::iterator it = mNodeList.begin();
+            while (it != mNodeList.end() && ((*it).mHostName != node.mHostName || (*it).mPort != node.mPort))
+                ++it;
+            if (it != mNodeList.end())
+                (*it).takeMeasurements(node);
+            pthread_mutex_unlock(&mNodeLock);
+        }
 
-            mLog.writeLine("Added new node to list: " + hostname + ":" + std::to_string(port));
+        bool CServer::recallNode(CNodeInfo *node)
+        {
+            pthread_mutex_lock(&mNodeLock);
+            std::vector<CNodeInfo>::iterator it = mNodeList.begin();
+            while (it != mNodeList.end() && ((*it).mHostName != node->mHostName || (*it).mPort != node->mPort))
+                ++it;
+            bool found = it != mNodeList.end();
+            if (found)
+                node->takeMeasurements(*it);
+            pthread_mutex_unlock(&mNodeLock);
+            return found;
+        }
 
-            if (hostname != PCHAIN->getHostName() || port != PCHAIN->getNetPort()) // avoid connecting eternally to itself
-                PCHAIN->connectNewClient(hostname, port, true);
+        bool CServer::dropWorstPeer()
+        {
+            std::vector<CClient *> clients(PCHAIN->getClients());
+            CClient *worst = 0;
+            double worstScore = 0;
+            for (std::vector<CClient *>::iterator it = clients.begin(); it != clients.end(); ++it)
+            {
+                if (!(*it)->isChild() || !(*it)->isReady() || (*it)->isStopped())
+                    continue;
+                double score = (*it)->getScore();
+                if (!worst || score < worstScore)
+                {
+                    worst = *it;
+                    worstScore = score;
+                }
+            }
+            if (worst)
+            {
+                mLog.writeLine("Dropping peer " + worst->getHost() + ":" + std::to_string(worst->getPort()) + " (score " + std::to_string(worstScore) + ") to make room.");
+                worst->stop();
+            }
+            CChain::releaseClients(&clients);
+            return worst != 0;
+        }
+
+        bool CServer::isSelf(const std::string &hostname, uint32_t port)
+        {
+            return hostname == PCHAIN->getHostName() && port == PCHAIN->getNetPort();
+        }
+
+        void *CServer::static_gossip(void *param)
+        {
+            ((CServer *)param)->gossip();
+            return 0;
+        }
+
+        void CServer::gossip()
+        {
+            while (mRunning)
+            {
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_sec += GossipInterval;
+                std::deque<CNodeInfo> registered;
+                pthread_mutex_lock(&mNodeLock);
+                if (mRunning && mConnectBack.empty())
+                    pthread_cond_timedwait(&mGossipCond, &mNodeLock, &until);
+                registered.swap(mConnectBack);
+                pthread_mutex_unlock(&mNodeLock);
+                if (!mRunning)
+                    break;
+                for (std::deque<CNodeInfo>::iterator it = registered.begin(); it != registered.end() && mRunning; ++it)
+                    connectBack(*it);
+                if (registered.empty() && PCHAIN->isReady())
+                    fillPeers();    // on the interval or learned nodes, not on every registration
+            }
+        }
+
+        void CServer::fillPeers()
+        {
+            // Forget nodes nobody mentioned for a while, then connect to the best scored ones until the degree is met
+            std::vector<CNodeInfo> candidates;
+            time_t now = time(0);
+            pthread_mutex_lock(&mNodeLock);
+            for (std::vector<CNodeInfo>::iterator it = mNodeList.begin(); it != mNodeList.end();)
+            {
+                if (now - (*it).mLastSeen > NodeExpiry && !PCHAIN->isConnected((*it).mHostName, (*it).mPort))
+                    it = mNodeList.erase(it);
+                else
+                {
+                    candidates.push_back(*it);
+                    ++it;
+                }
+            }
+            std::shuffle(candidates.begin(), candidates.end(), mRandom);
+            pthread_mutex_unlock(&mNodeLock);
+
+            // Best first, scored once so the order holds still while sorting
+            std::vector<std::pair<double, size_t> > order;
+            for (size_t n = 0; n < candidates.size(); n++)
+                order.push_back(std::make_pair(-candidates[n].getScore(), n));
+            std::stable_sort(order.begin(), order.end());
+            std::vector<CNodeInfo> ranked;
+            for (size_t n = 0; n < order.size(); n++)
+                ranked.push_back(candidates[order[n].second]);
+            candidates.swap(ranked);
+            if (mDefaultDegree == 0)
+                return;
+
+            // Few nodes connect to us, free a slot so the next node we connect to links back
+            if (__atomic_load_n(&mNodeCount, __ATOMIC_RELAXED) < (mDefaultDegree + 1) / 2 && PCHAIN->getClientCount() >= mDefaultDegree)
+                dropWorstPeer();
+
+            for (std::vector<CNodeInfo>::iterator it = candidates.begin(); it != candidates.end() && mRunning && PCHAIN->getClientCount() < mDefaultDegree; ++it)
+            {
+                if (isSelf(it->mHostName, it->mPort) || PCHAIN->isConnected(it->mHostName, it->mPort))
+                    continue;
+                try
+                {
+                    PCHAIN->connectNewClient(it->mHostName, it->mPort, true)->drop();
+                }
+                catch (std::runtime_error e)
+                {
+                    mLog.errorLine("Could not reach " + it->mHostName + ":" + std::to_string(it->mPort) + ", forgetting it.");
+                    pthread_mutex_lock(&mNodeLock);
+                    for (std::vector<CNodeInfo>::iterator node = mNodeList.begin(); node != mNodeList.end(); ++node)
+                    {
+                        if ((*node).mHostName == it->mHostName && (*node).mPort == it->mPort)
+                        {
+                            mNodeList.erase(node);
+                            break;
+                        }
+                    }
+                    pthread_mutex_unlock(&mNodeLock);
+                }
+            }
         }
     }
 }
\ No newline at end of file
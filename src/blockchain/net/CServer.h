@@ -10,6 +10,8 @@
 #define __C_SERVER_INCLUDED__
 #include "INet.h"
 #include "CNodeInfo.h"
+#include "CPacketParser.h"
+#include "CBlockBatch.h"
 #include "../CLog.h"
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -18,6 +20,11 @@
 #include <pthread.h>
 #include <string.h>
 #include <vector>
+#include <set>
+#include <deque>
+#include <string>
+#include <time.h>
+#include <random>
 
 namespace blockchain
 {
@@ -26,56 +33,201 @@ namespace blockchain
         class CServer : protected INet
         {
         private:
+            static uint32_t mDefaultIOThreads;
+            static uint32_t mDefaultDegree;
+            static std::string mDefaultLocalPath;
+            static const uint32_t GossipInterval = 5;          // Seconds between overlay checks
+            static const uint32_t NodeExpiry = 600;             // Seconds a node stays listed without being seen
+            static const uint32_t MaxPeersSent = 32;            // Nodes per EMT_PEERS
+            static const uint32_t IdleTimeout = 10;             // Seconds without traffic before a connection is dropped
+            static const size_t MaxPendingOutput = 4 * 1024 * 1024;     // Stop parsing input while this much output waits
+            static const uint32_t MaxBlockJobs = 1024;          // Relays queued for the block thread before more are refused
+
             void* mChain;
             std::vector<CNodeInfo> mNodeList;
+            pthread_mutex_t mNodeLock;                          // Guards mNodeList and mRandom
+            pthread_cond_t mGossipCond;                         // stopping, nodes learned or a node to connect back to
+            std::deque<CNodeInfo> mConnectBack;                 // Registered nodes the gossip thread connects to, guarded by mNodeLock
+            pthread_t mGossipThread;
+            std::mt19937 mRandom;
             uint32_t mListenPort;
-            int mListenerSocket;
+            std::vector<int> mListeners;                        // TCP port and Unix socket paths
+            std::vector<std::string> mLocalPaths;               // Removed when the listeners close
+            int mAcceptWake;                                    // eventfd, stop
             int mBacklog;
-            struct sockaddr_in mServerAddr;
             bool mRunning;
             bool mStopped;
             pthread_t mWorkerThread;
+            uint32_t mNextIOThread;                             // Round robin for accepted sockets
+            uint32_t mConnectionCount;
+            uint32_t mNodeCount;                                // Connections from registered nodes
+            uint64_t mNextConnectionId;                         // Only the accept thread counts
 
             CLog mLog;
         protected:
-            class CSocketPackage : public INet
+            class CIOThread;
+
+            // One peer connection, owned and only touched by the I/O thread serving it
+            class CConnection
             {
             public:
-                CServer* mServer;
-                pthread_t mThread;
-                bool mRunning;
+                enum E_STATE
+                {
+                    ES_NEW,                                     // expecting EMT_NODE_REGISTER
+                    ES_REGISTERING,                             // expecting EMT_NODE_REGISTER_PORT
+                    ES_APPROVED
+                };
+
+                static const size_t MaxFileSpans = CBlockBatch::MaxCount;  // Open payload files queued at once
 
-                CSocketPackage(CServer* server, int socket)
+                // Stored payload sent with sendfile once mOut has been written up to mPos
+                class CFileSpan
                 {
-                    mServer = server;
-                    mSocket = socket;
-                    mThread = 0;
-                    mRunning = true;
-                }
+                public:
+                    size_t mPos;
+                    int mFile;                                  // Owned, closed once sent
+                    uint64_t mOffset;
+                    uint32_t mSize;
+                };
+
+                int mSocket;
+                uint64_t mId;                                   // Tells a connection from a later one at the same address
+                CIOThread* mThread;
+                E_STATE mState;
+                std::string mHostName;
+                bool mPingConfirm;
+                uint32_t mWireVersion;                          // Framing for packets sent to this peer
+                uint32_t mRequestId;                            // Request being answered, echoed on every answer
+                bool mReadable;                                 // Socket may hold unread bytes
+                bool mWaiting;                                  // A written block is with the block thread, input waits for its answer
+                size_t mWalk;                                   // Blocks of an EMT_INIT_CHAIN answer still to send, tip first, input waits for them
+                time_t mLastActive;
+                CPacketParser mParser;
+                CWireCompression mCompression;
+                std::vector<uint8_t> mOut;
+                size_t mOutPos;                                 // First unsent byte of mOut
+                std::deque<CFileSpan> mFiles;
+                size_t mFileBytes;                              // Unsent bytes in mFiles
+
+                CConnection(int socket);
+                ~CConnection();
 
-                ~CSocketPackage() {}
+                void sendPacket(CPacket* packet);               // Queue for sending, flushed by the I/O thread
+                void sendHeader(CPacket* packet, uint32_t dataCrc);     // Header only, the mDataSize payload bytes follow with sendData and sendFile
+                void sendData(const uint8_t* data, size_t size);
+                void sendFile(int file, uint64_t offset, uint32_t size);   // Takes the file
+                bool canSendFile() { return mFiles.size() < MaxFileSpans; }
+                bool flush();                                   // Write until done or the socket is full, false on error
+                bool fill();                                    // One read into the parser, false on error or close
+                size_t getPending() { return mOut.size() - mOutPos + mFileBytes; }
             };
 
-            std::vector<CSocketPackage*> mSocketPackages;
+            // Where a block payload is sent from, its stored file when the payload is not in memory
+            class CPayloadSource
+            {
+            public:
+                CBlock* mBlock;
+                int mFile;                                      // -1 sends from memory
+                uint64_t mOffset;
+                uint32_t mCrc;
+            };
+
+            // Written and relayed blocks are mined, stored and passed on by the block thread, so an I/O
+            // thread never waits on mining, the disk or a peer's outbound queue. A producer's write is
+            // answered once its block is taken, which paces the producer. Relays are answered when queued,
+            // two nodes relaying to each other must not wait on each other's block thread.
+            class CBlockJob
+            {
+            public:
+                CPacket mPacket;                                // EMT_WRITE_BLOCK or EMT_BLOCKS, owns its data
+                CIOThread* mThread;                             // Answers through it when mConn is set
+                CConnection* mConn;                             // Only touched by mThread, and only while it still has mConnId
+                uint64_t mConnId;
+                uint32_t mRequestId;
+                bool mAccepted;
+
+                CBlockJob() { mThread = 0; mConn = 0; mConnId = 0; mRequestId = 0; mAccepted = false; }
+                ~CBlockJob() { mPacket.destroyData(); }
+            };
+
+            class CIOThread
+            {
+            public:
+                CServer* mServer;
+                pthread_t mThread;
+                int mEpoll;
+                int mWake;                                      // eventfd, new connections, answers or stop
+                pthread_mutex_t mLock;                          // Guards mIncoming and mAnswered
+                std::vector<CConnection*> mIncoming;
+                std::vector<CBlockJob*> mAnswered;              // Producer writes the block thread is done with
+                std::set<CConnection*> mConnections;
+            };
+
+            std::vector<CIOThread*> mIOThreads;
+            pthread_t mBlockThread;
+            pthread_mutex_t mBlockLock;                         // Guards mBlockJobs and mTaking
+            pthread_cond_t mBlockCond;                          // job queued or stopping
+            pthread_cond_t mBlockIdle;                          // mTaking cleared
+            std::deque<CBlockJob*> mBlockJobs;
+            bool mTaking;                                       // The block thread is working on a job
 
             void startWorker();
             static void* static_worker(void* param);
             void worker();
 
-            void startClient(int socket);
-            static void* static_client(void* param);
-            void client(CSocketPackage* pkg);
+            void startClient(int socket, bool tcp);
+            static void* static_io(void* param);
+            void io(CIOThread* thread);
+            bool service(CConnection* conn, uint32_t events);  // Read, parse, answer and write, false closes
+            void handlePacket(CConnection* conn, CPacket* packet);
+            void closeConnection(CIOThread* thread, CConnection* conn);
+            void answerBlocks(CIOThread* thread);               // Answer finished producer writes and resume their input
+
+            static void* static_blocks(void* param);
+            void blocks();
+            bool queueBlocks(CConnection* conn, CPacket* packet, bool producer);    // Takes the packet data, false when the queue is full
+            bool takeBlocks(CPacket* packet);                   // Block thread, false when nothing was accepted
+
+            void addNodeToList(const std::string& hostname, uint32_t port);    // The gossip thread connects back
+
+            // Keep mDefaultDegree clients connected to random listed nodes and forget stale ones
+            static void* static_gossip(void* param);
+            void gossip();
+            void fillPeers();
+            void connectBack(const CNodeInfo& node);
+            bool dropWorstPeer();                               // Stop the lowest scored client gossip connected
+            bool isSelf(const std::string& hostname, uint32_t port);
 
-            void addNodeToList(const std::string& hostname, uint32_t port);
+            // Append a relayed block to the chain and pass it on, false when it is refused. A null relayId
+            // is a block written by a client that is not a node, it is passed on under its new hash.
+            bool receiveBlock(const uint8_t* relayId, const uint8_t* prevHash, uint8_t* data, uint32_t size);
+
+            // Stored blocks go from their files to the socket when the payload is not in memory, with the
+            // frame checksum combined from the stored payload checksums
+            void openPayload(CConnection* conn, CBlock* block, CPayloadSource* source);
+            void sendPayload(CConnection* conn, CPayloadSource* source);
+            void sendBlock(CConnection* conn, CBlock* block);              // As EMT_WRITE_BLOCK
+            bool readPayload(CBlock* block, std::vector<uint8_t>* out);    // Stored payload read past the payload cache, false when it cannot be
+            void walkChain(CConnection* conn);                             // Send the next mWalk blocks the pending output has room for
 
             // Process a Packet Received from another node
-            void processPacket(CSocketPackage* pkg, CPacket* packet, bool* pingConfirm);
+            void processPacket(CConnection* pkg, CPacket* packet, bool* pingConfirm);
 
         public:
+            static void setDefaultIOThreads(uint32_t threads);  // 0 picks from the core count
+            static void setDefaultDegree(uint32_t degree);      // Clients kept connected, 0 connects to every node
+            static uint32_t getDefaultDegree() { return mDefaultDegree; }
+            static void setDefaultLocalPath(const std::string& path);   // Unix socket taking local producers next to the TCP port
+
+            void learnNodes(const std::vector<CNodeInfo>& nodes);    // Nodes listed by a peer
+            void rememberNode(const CNodeInfo& node);           // Keep the measurements of a client that went away
+            bool recallNode(CNodeInfo* node);                   // Measurements kept for the node, false when there are none
+
             CServer(void* chain, uint32_t listenPort);
             ~CServer();
             void start();
             void stop();
+            void drainBlocks();                                 // Wait for the job being taken, called once the chain refuses new ones
             
             
         };
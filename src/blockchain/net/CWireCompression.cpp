@@ -0,0 +1,117 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+ */
+#include "CWireCompression.h"
+#include "CPacketParser.h"
+#include "wire.h"
+#include "../storage/codec.h"
+#include <stdexcept>
+#include <time.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        uint32_t CWireCompression::mDefaultMinSize = 0;
+
+        void CWireCompression::setDefaultMinSize(uint32_t size)
+        {
+            mDefaultMinSize = size;
+        }
+
+        CWireCompression::CWireCompression()
+        {
+            mMinSize = 0;
+            mFramesOut = 0;
+            mRawOut = 0;
+            mWireOut = 0;
+            mCompressTime = 0;
+            mFramesIn = 0;
+            mRawIn = 0;
+            mWireIn = 0;
+            mExpandTime = 0;
+        }
+
+        double CWireCompression::getCpuTime()
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+            return now.tv_sec + now.tv_nsec / 1e9;
+        }
+
+        void CWireCompression::enable(uint32_t wireVersion)
+        {
+            if(wireVersion >= 2)
+                mMinSize = mDefaultMinSize;
+        }
+
+        bool CWireCompression::compress(CPacket* packet)
+        {
+            packet->mTrackDataAlloc = false;
+            if(mMinSize == 0 || !packet->mData || packet->mDataSize < mMinSize)
+                return false;
+
+            double start = getCpuTime();
+            std::vector<uint8_t> packed;
+            bool smaller = storage::compressData(storage::ECT_LZ, packet->mData, packet->mDataSize, &packed) && packed.size() + sizeof(uint32_t) < packet->mDataSize;
+            if(smaller)
+            {
+                mBuffer.resize(sizeof(uint32_t) + packed.size());
+                putUInt32(mBuffer.data(), packet->mDataSize);
+                memcpy(mBuffer.data() + sizeof(uint32_t), packed.data(), packed.size());
+                mFramesOut++;
+                mRawOut += packet->mDataSize;
+                mWireOut += mBuffer.size();
+                packet->setData(mBuffer.data(), mBuffer.size());
+                packet->mFlags |= FlagLZ;
+            }
+            mCompressTime += getCpuTime() - start;
+            return smaller;
+        }
+
+        void CWireCompression::expand(CPacket* packet)
+        {
+            if(!(packet->mFlags & FlagLZ))
+                return;
+            if(packet->mDataSize < sizeof(uint32_t))
+                throw std::runtime_error("Compressed frame is too short.");
+            uint32_t rawSize = getUInt32(packet->mData);
+            if(rawSize > CPacketParser::MaxDataSize)
+                throw std::runtime_error("Compressed frame expands too far: " + std::to_string(rawSize));
+
+            double start = getCpuTime();
+            uint8_t* raw = new uint8_t[rawSize];
+            if(!storage::decompressData(storage::ECT_LZ, packet->mData + sizeof(uint32_t), packet->mDataSize - sizeof(uint32_t), raw, rawSize))
+            {
+                delete[] raw;
+                throw std::runtime_error("Compressed frame is corrupt.");
+            }
+            mExpandTime += getCpuTime() - start;
+            mFramesIn++;
+            mRawIn += rawSize;
+            mWireIn += packet->mDataSize;
+            packet->destroyData();
+            packet->setData(raw, rawSize, true);
+            packet->mFlags &= ~FlagLZ;
+        }
+
+        static std::string percent(uint64_t part, uint64_t whole)
+        {
+            uint64_t tenths = whole ? part * 1000 / whole : 1000;
+            return std::to_string(tenths / 10) + "." + std::to_string(tenths % 10) + "%";
+        }
+
+        std::string CWireCompression::getReport()
+        {
+            return "sent " + std::to_string(mFramesOut) + " compressed frames, " + std::to_string(mRawOut) + " bytes as " + std::to_string(mWireOut)
+                + " (" + percent(mWireOut, mRawOut) + ") in " + std::to_string((uint64_t)(mCompressTime * 1000)) + " ms CPU, received "
+                + std::to_string(mFramesIn) + ", " + std::to_string(mWireIn) + " bytes for " + std::to_string(mRawIn)
+                + " (" + percent(mWireIn, mRawIn) + ") in " + std::to_string((uint64_t)(mExpandTime * 1000)) + " ms CPU";
+        }
+    }
+}
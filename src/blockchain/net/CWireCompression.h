@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_WIRE_COMPRESSION_INCLUDED__
+#define __C_WIRE_COMPRESSION_INCLUDED__
+#include "CPacket.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Per frame LZ compression of one connection, with what it saved and what it cost.
+        //
+        // Both ends put FeatureLZ in the nonce of EMT_NODE_REGISTER and its answer when they can read
+        // compressed frames, and a side only compresses towards a peer that did. A compressed frame has
+        // FlagLZ set in the version 2 flags and carries the raw size (little endian) followed by the
+        // LZ block. Frames under mMinSize, or that do not shrink, go out raw.
+        class CWireCompression
+        {
+        public:
+            static const uint32_t FeatureLZ = 0x1;      // Register nonce, the node reads compressed frames
+            static const uint16_t FlagLZ = 0x1;         // Frame flags, the payload is compressed
+
+        private:
+            static uint32_t mDefaultMinSize;
+            uint32_t mMinSize;                          // 0 sends raw
+            std::vector<uint8_t> mBuffer;               // Payload of the last compressed frame
+            uint64_t mFramesOut;                        // Compressed frames and their sizes
+            uint64_t mRawOut;
+            uint64_t mWireOut;
+            double mCompressTime;                       // Thread CPU seconds, including frames that stayed raw
+            uint64_t mFramesIn;
+            uint64_t mRawIn;
+            uint64_t mWireIn;
+            double mExpandTime;
+
+            static double getCpuTime();
+        public:
+            static void setDefaultMinSize(uint32_t size);   // Smallest payload compressed, 0 disables
+            static uint32_t getDefaultMinSize() { return mDefaultMinSize; }
+
+            CWireCompression();
+
+            void enable(uint32_t wireVersion);          // Peer reads compressed frames, needs the version 2 flags
+            bool isEnabled() { return mMinSize != 0; }
+
+            // Point a copy of the packet at its compressed payload when it pays off, valid until the next call.
+            // The copy never owns the payload, so it can be dropped without touching the original.
+            bool compress(CPacket* packet);
+            void expand(CPacket* packet);               // Raw payload of a received compressed frame, throws when corrupt
+
+            bool hasTraffic() { return mFramesOut != 0 || mFramesIn != 0; }
+            std::string getReport();                    // Ratio and CPU time both ways
+        };
+    }
+}
+
+#endif
@@ -25,6 +25,14 @@ namespace blockchain
             EMT_WRITE_BLOCK,
             EMT_CHAIN_NEW,
             EMT_CHAIN_INFO,
+            EMT_GET_BLOCK,              // mHash names the block, answered with EMT_WRITE_BLOCK or EMT_ERR
+            EMT_GET_HEADERS,            // data is a locator, hashes from the tip back, answered with EMT_HEADERS
+            EMT_HEADERS,                // data is the sealed headers after the first locator hash held, oldest first
+            EMT_GET_BLOCKS,             // data is a list of hashes, answered with EMT_BLOCKS holding the ones we have
+            EMT_BLOCKS,                 // data is a CBlockBatch, relayed blocks or the answer to EMT_GET_BLOCKS
+            EMT_INV,                    // data is a list of relay ids, answered with EMT_GET_BLOCKS naming the ones to send
+            EMT_GET_PEERS,              // answered with EMT_PEERS
+            EMT_PEERS,                  // data is a list of CNodeInfo, nodes the answering node knows
             EMT_COUNT
         };
     }
@@ -0,0 +1,27 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __E_QUEUE_POLICY_INCLUDED__
+#define __E_QUEUE_POLICY_INCLUDED__
+
+namespace blockchain
+{
+    namespace net
+    {
+        // What a sender does when a peer's outbound queue is full
+        enum E_QUEUE_POLICY
+        {
+            EQP_BLOCK = 0,      // wait for the peer to catch up
+            EQP_DROP_OLDEST,    // make room by dropping the oldest queued message
+            EQP_DISCONNECT,     // give up on the peer
+            EQP_COUNT
+        };
+    }
+}
+
+#endif
@@ -10,6 +10,13 @@
 #include <stdexcept>
 #include <netinet/in.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
 namespace blockchain
 {
@@ -18,131 +25,150 @@ namespace blockchain
         INet::INet()
         {
             mSocket = 0;
+            mWireVersion = 1;
         }
 
-        CPacket INet::recvPacket()
+        bool INet::isLocalAddress(const std::string& host)
         {
-            if(mSocket == 0)
-                throw std::runtime_error("INet: Socket is null.");
-            CPacket packet;
-            packet.mVersion = recvUInt();
-            packet.mMessageType = (EMessageType)recvUInt();
-            packet.mNonce = recvUInt();
-            packet.mCreatedTS = (time_t)recvUInt();
-            // Hash
-            uint8_t* hashData = recvDataAlloc(SHA256_DIGEST_LENGTH);
-            memcpy(packet.mHash, hashData, SHA256_DIGEST_LENGTH);
-            delete[] hashData;
-            // Prev hash
-            hashData = recvDataAlloc(SHA256_DIGEST_LENGTH);
-            memcpy(packet.mPrevHash, hashData, SHA256_DIGEST_LENGTH);
-            delete[] hashData;
-            packet.mDataSize = recvUInt();
-            if(packet.mDataSize != 0)
-            {
-                packet.mData = recvDataAlloc(packet.mDataSize);
-                packet.mTrackDataAlloc = true;
-            }
-            return packet;
+            return !host.empty() && (host[0] == '/' || host[0] == '.');
         }
 
-        void INet::sendPacket(CPacket* packet)
+        std::string INet::formatAddress(const std::string& host, uint32_t port)
         {
-            if(mSocket == 0)
-                throw std::runtime_error("INet: Socket is null.");
-            sendUInt(packet->mVersion);
-            sendUInt(packet->mMessageType);
-            sendUInt(packet->mNonce);
-            sendUInt(packet->mCreatedTS);
-            sendData(packet->mHash, SHA256_DIGEST_LENGTH);
-            sendData(packet->mPrevHash, SHA256_DIGEST_LENGTH);
-            sendUInt(packet->mDataSize);
-            if(packet->mDataSize != 0 && packet->mData)
-                sendData(packet->mData, packet->mDataSize);
+            return isLocalAddress(host) ? host : host + ":" + std::to_string(port);
         }
 
-        uint32_t INet::recvUInt()
+        socklen_t INet::resolveAddress(const std::string& host, uint32_t port, struct sockaddr_storage* addr)
         {
-            uint32_t netNum = 0;
-            if(recv(mSocket, (void*)&netNum, sizeof(uint32_t), 0) < 0)
-                throw std::runtime_error("Failed to receive UINT32.");
-            return ntohl(netNum);
-        }
-
-        void INet::sendUInt(uint32_t num)
-        {
-            uint32_t netNum = htonl(num);
-            if(send(mSocket, (void*)&netNum, sizeof(uint32_t), 0) < 0)
-                throw std::runtime_error("Failed to send UINT32.");
-        }
-
-        int32_t INet::recvInt()
-        {
-            uint32_t netNum = 0;
-            if(recv(mSocket, (void*)&netNum, sizeof(uint32_t), 0) < 0)
-                throw std::runtime_error("Failed to receive INT32.");
-            return ntohl(netNum);
-        }
-
-        void INet::sendInt(int32_t num)
-        {
-            uint32_t netNum = htonl((uint32_t)num);
-            if(send(mSocket, (void*)&netNum, sizeof(uint32_t), 0) < 0)
-                throw std::runtime_error("Failed to send INT32.");
-        }
-
-        uint64_t INet::recvUInt64()
-        {
-            uint32_t netHigh = 0;
-            uint32_t netLow = 0;
-            if(recv(mSocket, (void*)&netHigh, sizeof(uint32_t), 0) < 0)
-                throw std::runtime_error("Failed to receive UINT64 (H).");
-            if(recv(mSocket, (void*)&netLow, sizeof(uint32_t), 0) < 0)
-                throw std::runtime_error("Failed to receive UINT64 (L).");
-
-            return (((uint64_t)ntohl(netHigh) & 0xFFFFFFFFLL) << 32) | ((uint64_t)ntohl(netLow) >> 32);
+            memset(addr, 0, sizeof(struct sockaddr_storage));
+            if(isLocalAddress(host))
+            {
+                struct sockaddr_un* local = (struct sockaddr_un*)addr;
+                if(host.size() >= sizeof(local->sun_path))
+                    throw std::runtime_error("Socket path is too long: " + host);
+                local->sun_family = AF_UNIX;
+                memcpy(local->sun_path, host.c_str(), host.size() + 1);
+                return sizeof(struct sockaddr_un);
+            }
+            struct sockaddr_in* inet = (struct sockaddr_in*)addr;
+            inet->sin_family = AF_INET;
+            inet->sin_port = htons(port);
+            if(host.empty())
+                inet->sin_addr.s_addr = INADDR_ANY;
+            else if(inet_pton(AF_INET, host.c_str(), &inet->sin_addr) <= 0)
+                throw std::runtime_error("Invalid host: " + host);
+            return sizeof(struct sockaddr_in);
         }
 
-        void INet::sendUInt64(uint64_t num)
+        int INet::listenOn(const std::string& host, uint32_t port, int backlog)
         {
-            uint32_t netHigh = htonl((uint32_t)(num >> 32));
-            uint32_t netLow = htonl((uint32_t)(num & 0xFFFFFFFFLL));
-            if(send(mSocket, (void*)&netHigh, sizeof(uint32_t), 0) < 0)
-                throw std::runtime_error("Failed to send UINT64 (H).");
-            if(send(mSocket, (void*)&netLow, sizeof(uint32_t), 0) < 0)
-                throw std::runtime_error("Failed to send UINT64 (L).");
+            struct sockaddr_storage addr;
+            socklen_t size = resolveAddress(host, port, &addr);
+            int listener = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if(listener < 0)
+                throw std::runtime_error("Could not open listener socket.");
+            if(addr.ss_family == AF_UNIX)
+            {
+                // Only a stale socket left by a node that did not stop cleanly is replaced, nobody answers on it
+                struct stat info;
+                if(lstat(host.c_str(), &info) == 0)
+                {
+                    int probe = S_ISSOCK(info.st_mode) ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+                    bool stale = probe >= 0 && connect(probe, (struct sockaddr*)&addr, size) < 0 && errno == ECONNREFUSED;
+                    if(probe >= 0)
+                        close(probe);
+                    if(!stale || unlink(host.c_str()) != 0)
+                    {
+                        close(listener);
+                        throw std::runtime_error("Could not listen on " + host + ", it is " + (S_ISSOCK(info.st_mode) ? "in use." : "not a socket."));
+                    }
+                }
+            }
+            else
+            {
+                int val = true;
+                setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(int));
+            }
+            if(bind(listener, (struct sockaddr*)&addr, size) < 0 || listen(listener, backlog) < 0)
+            {
+                close(listener);
+                throw std::runtime_error("Could not listen on " + (host.empty() ? "port " + std::to_string(port) : formatAddress(host, port)) + ".");
+            }
+            return listener;
         }
 
-        uint8_t* INet::recvDataAlloc(uint64_t size)
+        CPacket INet::recvPacket()
         {
-            uint32_t chunkSize = mChunkSize;
-            uint8_t* data = new uint8_t[size];
-            uint8_t* ptr = data;
-            while(ptr < (data + size))
+            if(mSocket == 0)
+                throw std::runtime_error("INet: Socket is null.");
+            CPacket packet;
+            while(!mParser.next(&packet))
             {
-                if((ptr + chunkSize) > (data + size))
-                    chunkSize = (data + size - ptr);
-                ssize_t r = recv(mSocket, (void*)ptr, sizeof(uint8_t) * chunkSize, 0);
+                // Large reads, short ones just loop
+                size_t size = 0;
+                uint8_t* buf = mParser.reserve(&size);
+                ssize_t r = recv(mSocket, (void*)buf, size, 0);
+                if(r < 0 && errno == EINTR)
+                    continue;
                 if(r < 0)
-                    throw std::runtime_error("Failed to receive data chunk.");                
-                ptr += r;
+                    throw std::runtime_error("Failed to receive data chunk.");
+                if(r == 0)
+                    throw std::runtime_error("Connection closed by peer.");
+                mParser.commit(r);
+            }
+            try
+            {
+                mCompression.expand(&packet);
             }
-            return data;
+            catch(std::runtime_error e)
+            {
+                packet.destroyData();
+                throw;
+            }
+            return packet;
         }
 
-        void INet::sendData(uint8_t* data, uint64_t size)
+        void INet::sendPacket(CPacket* packet)
         {
-            uint32_t chunkSize = mChunkSize;
-            uint8_t* ptr = data;
-            while(ptr < (data+size))
+            if(mSocket == 0)
+                throw std::runtime_error("INet: Socket is null.");
+
+            // Header and payload leave in one call
+            CPacket framed(*packet);
+            mCompression.compress(&framed);
+            uint8_t header[CPacketParser::MaxHeaderSize];
+            struct iovec iov[2];
+            iov[0].iov_base = header;
+            iov[0].iov_len = CPacketParser::encodeHeader(&framed, mWireVersion, header);
+            iov[1].iov_base = framed.mData;
+            iov[1].iov_len = framed.mData ? framed.mDataSize : 0;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov[1].iov_len != 0 ? 2 : 1;
+            while(msg.msg_iovlen != 0)
             {
-                if((ptr + chunkSize) > (data + size))
-                    chunkSize = (data + size - ptr);
-                ssize_t r = send(mSocket, (void*)ptr, sizeof(uint8_t) * chunkSize, 0);
+                ssize_t r = sendmsg(mSocket, &msg, MSG_NOSIGNAL);
                 if(r < 0)
-                    throw std::runtime_error("Failed to send data chunk.");
-                ptr += r;
+                {
+                    if(errno == EINTR)
+                        continue;
+                    throw std::runtime_error("Failed to send packet.");
+                }
+                // Short write, skip what went out
+                while(msg.msg_iovlen != 0 && (size_t)r >= msg.msg_iov[0].iov_len)
+                {
+                    r -= msg.msg_iov[0].iov_len;
+                    msg.msg_iov++;
+                    msg.msg_iovlen--;
+                }
+                if(msg.msg_iovlen != 0)
+                {
+                    msg.msg_iov[0].iov_base = (uint8_t*)msg.msg_iov[0].iov_base + r;
+                    msg.msg_iov[0].iov_len -= r;
+                }
             }
         }
+
     }
 }
@@ -9,30 +9,34 @@
 #ifndef __I_NET_INCLUDED__
 #define __I_NET_INCLUDED__
 #include "CPacket.h"
+#include "CPacketParser.h"
+#include "CWireCompression.h"
+#include <string>
+#include <sys/socket.h>
 
 namespace blockchain
 {
     namespace net
     {
+        // Packets over a stream socket. A node address is a host and TCP port, or the path of a Unix
+        // domain socket (port 0) for nodes and producers on the same machine.
         class INet
         {
         public:
             int mSocket;    // socket handle
+            uint32_t mWireVersion;  // framing used for sent packets, received packets carry their own
+            CWireCompression mCompression;  // frames to and from the peer
             CPacket recvPacket();   // receive packet of data
             void sendPacket(CPacket* packet);   // send packet of data
+
+            static bool isLocalAddress(const std::string& host);   // path style, starts with / or .
+            static std::string formatAddress(const std::string& host, uint32_t port);   // host:port or the path
+            static socklen_t resolveAddress(const std::string& host, uint32_t port, struct sockaddr_storage* addr);   // empty host is any interface, throws when invalid
+            static int listenOn(const std::string& host, uint32_t port, int backlog);  // non blocking, replaces a stale socket file, throws on failure
         protected:
             INet();
         private:
-            const uint32_t mChunkSize = 2048;   // chunk data size
-
-            uint32_t recvUInt();
-            void sendUInt(uint32_t num);
-            int32_t recvInt();
-            void sendInt(int32_t num);
-            uint64_t recvUInt64();
-            void sendUInt64(uint64_t num);
-            uint8_t* recvDataAlloc(uint64_t size);
-            void sendData(uint8_t* data, uint64_t size);
+            CPacketParser mParser;  // receive buffer
         };
     }
 }
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __WIRE_INCLUDED__
+#define __WIRE_INCLUDED__
+#include <stdint.h>
+
+namespace blockchain
+{
+    namespace net
+    {
+        // Little endian integers as carried by version 2 framing and the payloads it introduced,
+        // byte by byte so the wire form does not depend on the host
+        inline void putUInt16(uint8_t* ptr, uint16_t num)
+        {
+            ptr[0] = (uint8_t)num;
+            ptr[1] = (uint8_t)(num >> 8);
+        }
+
+        inline void putUInt32(uint8_t* ptr, uint32_t num)
+        {
+            for(int n = 0; n < 4; n++)
+                ptr[n] = (uint8_t)(num >> (8 * n));
+        }
+
+        inline void putUInt64(uint8_t* ptr, uint64_t num)
+        {
+            for(int n = 0; n < 8; n++)
+                ptr[n] = (uint8_t)(num >> (8 * n));
+        }
+
+        inline uint16_t getUInt16(const uint8_t* ptr)
+        {
+            return (uint16_t)(ptr[0] | (ptr[1] << 8));
+        }
+
+        inline uint32_t getUInt32(const uint8_t* ptr)
+        {
+            uint32_t num = 0;
+            for(int n = 3; n >= 0; n--)
+                num = (num << 8) | ptr[n];
+            return num;
+        }
+
+        inline uint64_t getUInt64(const uint8_t* ptr)
+        {
+            uint64_t num = 0;
+            for(int n = 7; n >= 0; n--)
+                num = (num << 8) | ptr[n];
+            return num;
+        }
+    }
+}
+
+#endif
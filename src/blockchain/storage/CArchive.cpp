@@ -0,0 +1,198 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CArchive.h"
+#include "crc32c.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        bool CArchive::CEntry::operator<(const CEntry& other) const
+        {
+            return memcmp(mHash, other.mHash, SHA256_DIGEST_LENGTH) < 0;
+        }
+
+        CArchive::CArchive()
+        {
+            mFile = -1;
+            mFirstHeight = 0;
+            mLastHeight = 0;
+            mWriteOffset = 0;
+        }
+
+        CArchive::~CArchive()
+        {
+            if(mFile >= 0)
+                close(mFile);
+        }
+
+        bool CArchive::open(const std::string& path)
+        {
+            mPath = path;
+            mFile = ::open(path.c_str(), O_RDONLY);
+            if(mFile < 0)
+                return false;
+
+            struct stat info;
+            if(fstat(mFile, &info) != 0 || (uint64_t)info.st_size < FooterSize)
+                return false;
+
+            uint8_t footer[FooterSize];
+            if(pread(mFile, footer, FooterSize, info.st_size - FooterSize) != FooterSize)
+                return false;
+            uint8_t* ptr = footer;
+            uint32_t magic = 0, version = 0, indexCrc = 0;
+            uint64_t entryCount = 0, indexOffset = 0;
+            memcpy(&magic, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&version, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&mFirstHeight, ptr, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(&mLastHeight, ptr, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(&entryCount, ptr, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(&indexOffset, ptr, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(&indexCrc, ptr, sizeof(uint32_t));
+            if(magic != Magic || version != Version || indexOffset + entryCount * EntrySize + FooterSize != (uint64_t)info.st_size)
+                return false;
+
+            std::vector<uint8_t> index(entryCount * EntrySize);
+            if(pread(mFile, index.data(), index.size(), indexOffset) != (ssize_t)index.size() || crc32c(index.data(), index.size()) != indexCrc)
+                return false;
+
+            mIndex.resize(entryCount);
+            for(uint64_t n = 0; n < entryCount; n++)
+            {
+                uint8_t* entry = index.data() + n * EntrySize;
+                memcpy(mIndex[n].mHash, entry, SHA256_DIGEST_LENGTH);
+                memcpy(&mIndex[n].mOffset, entry + SHA256_DIGEST_LENGTH, sizeof(uint64_t));
+                memcpy(&mIndex[n].mSize, entry + SHA256_DIGEST_LENGTH + sizeof(uint64_t), sizeof(uint32_t));
+            }
+            return true;
+        }
+
+        bool CArchive::find(const uint8_t* hash, uint64_t* offset, uint32_t* size)
+        {
+            CEntry key;
+            memcpy(key.mHash, hash, SHA256_DIGEST_LENGTH);
+            std::vector<CEntry>::iterator it = std::lower_bound(mIndex.begin(), mIndex.end(), key);
+            if(it == mIndex.end() || memcmp(it->mHash, hash, SHA256_DIGEST_LENGTH) != 0)
+                return false;
+            *offset = it->mOffset;
+            *size = it->mSize;
+            return true;
+        }
+
+        bool CArchive::read(const uint8_t* hash, std::vector<uint8_t>* buf)
+        {
+            uint64_t offset = 0;
+            uint32_t size = 0;
+            if(!find(hash, &offset, &size))
+                return false;
+            buf->resize(size);
+            return pread(mFile, buf->data(), size, offset) == (ssize_t)size;
+        }
+
+        void CArchive::create(const std::string& path, uint64_t firstHeight, uint64_t lastHeight)
+        {
+            mPath = path;
+            mFile = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if(mFile < 0)
+                throw std::runtime_error("Could not create archive: " + path);
+            mFirstHeight = firstHeight;
+            mLastHeight = lastHeight;
+            mWriteOffset = 0;
+            mIndex.clear();
+        }
+
+        void CArchive::append(const uint8_t* hash, const uint8_t* record, uint32_t size)
+        {
+            if(pwrite(mFile, record, size, mWriteOffset) != (ssize_t)size)
+                throw std::runtime_error("Could not write archive record.");
+            CEntry entry;
+            memcpy(entry.mHash, hash, SHA256_DIGEST_LENGTH);
+            entry.mOffset = mWriteOffset;
+            entry.mSize = size;
+            mIndex.push_back(entry);
+            mWriteOffset += size;
+        }
+
+        void CArchive::finish(const std::string& finalPath)
+        {
+            std::sort(mIndex.begin(), mIndex.end());
+
+            std::vector<uint8_t> buf(mIndex.size() * EntrySize + FooterSize);
+            uint8_t* ptr = buf.data();
+            for(std::vector<CEntry>::iterator it = mIndex.begin(); it != mIndex.end(); ++it)
+            {
+                memcpy(ptr, it->mHash, SHA256_DIGEST_LENGTH);
+                ptr += SHA256_DIGEST_LENGTH;
+                memcpy(ptr, &it->mOffset, sizeof(uint64_t));
+                ptr += sizeof(uint64_t);
+                memcpy(ptr, &it->mSize, sizeof(uint32_t));
+                ptr += sizeof(uint32_t);
+            }
+            uint32_t magic = Magic, version = Version;
+            uint64_t entryCount = mIndex.size(), indexOffset = mWriteOffset;
+            uint32_t indexCrc = crc32c(buf.data(), entryCount * EntrySize);
+            memcpy(ptr, &magic, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &version, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &mFirstHeight, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(ptr, &mLastHeight, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(ptr, &entryCount, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(ptr, &indexOffset, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(ptr, &indexCrc, sizeof(uint32_t));
+
+            if(pwrite(mFile, buf.data(), buf.size(), mWriteOffset) != (ssize_t)buf.size())
+                throw std::runtime_error("Could not write archive index.");
+            if(fdatasync(mFile) != 0)
+                throw std::runtime_error("Could not sync archive.");
+            if(rename(mPath.c_str(), finalPath.c_str()) != 0)
+                throw std::runtime_error("Could not move archive into place: " + finalPath);
+            mPath = finalPath;
+
+            // The new name is durable before the caller removes the single files
+            std::string dirPath(finalPath.substr(0, finalPath.rfind('/') + 1));
+            int dir = ::open(dirPath.empty() ? "." : dirPath.c_str(), O_RDONLY | O_DIRECTORY);
+            bool synced = dir >= 0 && fsync(dir) == 0;
+            if(dir >= 0)
+                close(dir);
+            if(!synced)
+                throw std::runtime_error("Could not sync archive directory: " + dirPath);
+        }
+
+        std::string CArchive::getFileName(uint64_t firstHeight, uint64_t lastHeight)
+        {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "archive-%012llu-%012llu", (unsigned long long)firstHeight, (unsigned long long)lastHeight);
+            return std::string(buf);
+        }
+
+        bool CArchive::isArchiveName(const std::string& name)
+        {
+            return name.compare(0, 8, "archive-") == 0 && name.find('.') == std::string::npos;
+        }
+    }
+}
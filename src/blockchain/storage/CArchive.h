@@ -0,0 +1,72 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_ARCHIVE_INCLUDED__
+#define __C_ARCHIVE_INCLUDED__
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Immutable file holding a height range of block records.
+        //
+        // Layout: records in height order, index sorted by hash (hash, offset, size),
+        // footer (magic, version, first height, last height, entry count, index offset, index crc32c).
+        class CArchive
+        {
+        private:
+            static const uint32_t Magic = 0x48435241;   // "ARCH"
+            static const uint32_t Version = 1;
+            static const uint32_t EntrySize = SHA256_DIGEST_LENGTH + sizeof(uint64_t) + sizeof(uint32_t);
+            static const uint32_t FooterSize = sizeof(uint32_t) * 3 + sizeof(uint64_t) * 4;
+
+            class CEntry
+            {
+            public:
+                uint8_t mHash[SHA256_DIGEST_LENGTH];
+                uint64_t mOffset;
+                uint32_t mSize;
+
+                bool operator<(const CEntry& other) const;
+            };
+
+            std::string mPath;
+            int mFile;
+            uint64_t mFirstHeight;
+            uint64_t mLastHeight;
+            uint64_t mWriteOffset;
+            std::vector<CEntry> mIndex;
+        public:
+            CArchive();
+            ~CArchive();
+
+            bool open(const std::string& path);                                 // Load the index, false when the file is not a complete archive
+            bool find(const uint8_t* hash, uint64_t* offset, uint32_t* size);  // Locate a record by block hash
+            bool read(const uint8_t* hash, std::vector<uint8_t>* buf);         // Read a record by block hash
+
+            void create(const std::string& path, uint64_t firstHeight, uint64_t lastHeight);  // Start writing a new archive at path
+            void append(const uint8_t* hash, const uint8_t* record, uint32_t size);
+            void finish(const std::string& finalPath);                          // Write index and footer, sync and rename into place
+
+            int getFile() { return mFile; }
+            std::string getPath() { return mPath; }
+            uint64_t getFirstHeight() { return mFirstHeight; }
+            uint64_t getLastHeight() { return mLastHeight; }
+            size_t getBlockCount() { return mIndex.size(); }
+
+            static std::string getFileName(uint64_t firstHeight, uint64_t lastHeight);
+            static bool isArchiveName(const std::string& name);
+        };
+    }
+}
+
+#endif
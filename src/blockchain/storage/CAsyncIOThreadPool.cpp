@@ -0,0 +1,131 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CAsyncIOThreadPool.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        CAsyncIOThreadPool::CAsyncIOThreadPool(uint32_t threadCount)
+        {
+            pthread_mutex_init(&mLock, 0);
+            pthread_cond_init(&mCond, 0);
+            pthread_cond_init(&mIdleCond, 0);
+            mPending = 0;
+            mRunning = true;
+            for(uint32_t n = 0; n < threadCount; n++)
+            {
+                pthread_t thread;
+                if(pthread_create(&thread, 0, &static_worker, this) != 0)
+                    throw std::runtime_error("Failed to start I/O worker thread.");
+                mThreads.push_back(thread);
+            }
+        }
+
+        CAsyncIOThreadPool::~CAsyncIOThreadPool()
+        {
+            drain();
+            pthread_mutex_lock(&mLock);
+            mRunning = false;
+            pthread_cond_broadcast(&mCond);
+            pthread_mutex_unlock(&mLock);
+            for(std::vector<pthread_t>::iterator it = mThreads.begin(); it != mThreads.end(); ++it)
+                pthread_join(*it, 0);
+            pthread_cond_destroy(&mIdleCond);
+            pthread_cond_destroy(&mCond);
+            pthread_mutex_destroy(&mLock);
+        }
+
+        void CAsyncIOThreadPool::submit(CIORequest** requests, uint32_t count)
+        {
+            pthread_mutex_lock(&mLock);
+            for(uint32_t n = 0; n < count; n++)
+            {
+                requests[n]->grab();
+                requests[n]->mRemaining = requests[n]->mOps.size();
+                mQueue.push(requests[n]);
+            }
+            mPending += count;
+            pthread_cond_broadcast(&mCond);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        uint8_t* CAsyncIOThreadPool::allocBuffer(CIORequest* request, uint32_t size)
+        {
+            return request->allocHeapBuffer(size, BufferAlignment);
+        }
+
+        void CAsyncIOThreadPool::drain()
+        {
+            pthread_mutex_lock(&mLock);
+            while(mPending != 0)
+                pthread_cond_wait(&mIdleCond, &mLock);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        void* CAsyncIOThreadPool::static_worker(void* param)
+        {
+            ((CAsyncIOThreadPool*)param)->worker();
+            return 0;
+        }
+
+        void CAsyncIOThreadPool::worker()
+        {
+            pthread_mutex_lock(&mLock);
+            while(true)
+            {
+                while(mRunning && mQueue.empty())
+                    pthread_cond_wait(&mCond, &mLock);
+                if(mQueue.empty())
+                    break;
+                CIORequest* request = mQueue.front();
+                mQueue.pop();
+                pthread_mutex_unlock(&mLock);
+
+                request->complete(execute(request));
+                request->drop();
+
+                pthread_mutex_lock(&mLock);
+                if(--mPending == 0)
+                    pthread_cond_broadcast(&mIdleCond);
+            }
+            pthread_mutex_unlock(&mLock);
+        }
+
+        int CAsyncIOThreadPool::execute(CIORequest* request)
+        {
+            for(std::vector<CIOOp>::iterator it = request->mOps.begin(); it != request->mOps.end(); ++it)
+            {
+                uint32_t done = 0;
+                while(it->mOp != EIO_SYNC && done < it->mSize)
+                {
+                    ssize_t r;
+                    if(it->mOp == EIO_READ)
+                        r = pread(it->mFd, it->mBuf + done, it->mSize - done, it->mOffset + done);
+                    else
+                        r = pwrite(it->mFd, it->mBuf + done, it->mSize - done, it->mOffset + done);
+                    if(r < 0 && errno == EINTR)
+                        continue;
+                    if(r < 0)
+                        return -errno;
+                    if(r == 0)
+                        return -EIO;    // short read past the end of the file
+                    done += r;
+                }
+                if(it->mOp == EIO_SYNC && fdatasync(it->mFd) != 0)
+                    return -errno;
+                request->mRemaining--;
+            }
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_ASYNC_IO_THREAD_POOL_INCLUDED__
+#define __C_ASYNC_IO_THREAD_POOL_INCLUDED__
+#include "IAsyncIO.h"
+#include <pthread.h>
+#include <queue>
+#include <vector>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Blocking pread/pwrite on a small pool of worker threads, used where io_uring is unavailable
+        class CAsyncIOThreadPool : public IAsyncIO
+        {
+        private:
+            std::vector<pthread_t> mThreads;
+            std::queue<CIORequest*> mQueue;
+            pthread_mutex_t mLock;
+            pthread_cond_t mCond;           // signals workers about new requests
+            pthread_cond_t mIdleCond;       // signals drain() when nothing is pending
+            uint32_t mPending;              // submitted and not complete
+            bool mRunning;
+
+            static void* static_worker(void* param);
+            void worker();
+            int execute(CIORequest* request);
+        public:
+            CAsyncIOThreadPool(uint32_t threadCount = 4);
+            ~CAsyncIOThreadPool();
+
+            virtual void submit(CIORequest** requests, uint32_t count);
+            virtual uint8_t* allocBuffer(CIORequest* request, uint32_t size);
+            virtual void releaseBuffer(int index) {}
+            virtual void drain();
+            virtual const char* getName() { return "thread pool"; }
+
+            virtual void dispose() { delete this; }
+        };
+    }
+}
+
+#endif
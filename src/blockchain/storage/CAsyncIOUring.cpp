@@ -0,0 +1,373 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CAsyncIOUring.h"
+
+#ifdef __BLOCKCHAIN_IO_URING__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+        {
+            return (int)syscall(__NR_io_uring_setup, entries, params);
+        }
+
+        static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+        {
+            return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, 0, 0);
+        }
+
+        static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned count)
+        {
+            return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+        }
+
+        bool CAsyncIOUring::isSupported()
+        {
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            int fd = io_uring_setup(1, &params);
+            if(fd < 0)
+                return false;
+
+            // Kernels older than the probe are older than the plain read and write opcodes too
+            const unsigned count = 256;
+            struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, sizeof(struct io_uring_probe) + count * sizeof(struct io_uring_probe_op));
+            bool supported = probe && io_uring_register(fd, IORING_REGISTER_PROBE, probe, count) == 0;
+            unsigned ops[] = { IORING_OP_READ, IORING_OP_WRITE };
+            for(unsigned n = 0; supported && n < sizeof(ops) / sizeof(ops[0]); n++)
+                supported = ops[n] <= probe->last_op && (probe->ops[ops[n]].flags & IO_URING_OP_SUPPORTED);
+            free(probe);
+            close(fd);
+            return supported;
+        }
+
+        CAsyncIOUring::CAsyncIOUring(uint32_t entries, uint32_t bufferCount, uint32_t bufferSize)
+        {
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            mRingFd = io_uring_setup(entries, &params);
+            if(mRingFd < 0)
+                throw std::runtime_error("io_uring is not available.");
+
+            mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if(singleMmap && mCqRingSize > mSqRingSize)
+                mSqRingSize = mCqRingSize;
+
+            mSqRing = mmap(0, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+            mCqRing = singleMmap ? mSqRing : mmap(0, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_CQ_RING);
+            mSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+            mSqes = (struct io_uring_sqe*)mmap(0, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+            if(mSqRing == MAP_FAILED || mCqRing == MAP_FAILED || mSqes == MAP_FAILED)
+            {
+                unmapRings();
+                throw std::runtime_error("Could not map io_uring rings.");
+            }
+
+            uint8_t* sq = (uint8_t*)mSqRing;
+            mSqHead = (unsigned*)(sq + params.sq_off.head);
+            mSqTail = (unsigned*)(sq + params.sq_off.tail);
+            mSqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+            mSqArray = (unsigned*)(sq + params.sq_off.array);
+            mSqEntries = params.sq_entries;
+            uint8_t* cq = (uint8_t*)mCqRing;
+            mCqHead = (unsigned*)(cq + params.cq_off.head);
+            mCqTail = (unsigned*)(cq + params.cq_off.tail);
+            mCqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+            mCqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+            mCqEntries = params.cq_entries;
+            mUnsubmitted = 0;
+
+            // Registered buffers skip the per-I/O page pinning, optional since it needs locked memory
+            mRegisteredBufferSize = bufferSize;
+            std::vector<struct iovec> iovecs;
+            for(uint32_t n = 0; n < bufferCount; n++)
+            {
+                void* buf = 0;
+                if(posix_memalign(&buf, BufferAlignment, bufferSize) != 0)
+                    break;
+                mBuffers.push_back((uint8_t*)buf);
+                struct iovec iov;
+                iov.iov_base = buf;
+                iov.iov_len = bufferSize;
+                iovecs.push_back(iov);
+            }
+            if(iovecs.empty() || io_uring_register(mRingFd, IORING_REGISTER_BUFFERS, iovecs.data(), iovecs.size()) != 0)
+            {
+                for(std::vector<uint8_t*>::iterator it = mBuffers.begin(); it != mBuffers.end(); ++it)
+                    free(*it);
+                mBuffers.clear();
+            }
+            for(uint32_t n = 0; n < mBuffers.size(); n++)
+                mFreeBuffers.push_back(n);
+
+            pthread_mutex_init(&mLock, 0);
+            pthread_cond_init(&mCond, 0);
+            mInFlight = 0;
+            mPending = 0;
+            mRunning = true;
+            if(pthread_create(&mReaperThread, 0, &static_reaper, this) != 0)
+            {
+                releaseBuffers();
+                unmapRings();
+                pthread_cond_destroy(&mCond);
+                pthread_mutex_destroy(&mLock);
+                throw std::runtime_error("Failed to start io_uring reaper thread.");
+            }
+        }
+
+        CAsyncIOUring::~CAsyncIOUring()
+        {
+            drain();
+
+            // Wake the reaper with a NOP carrying no request
+            pthread_mutex_lock(&mLock);
+            mRunning = false;
+            unsigned tail = *mSqTail;
+            unsigned index = tail & *mSqMask;
+            struct io_uring_sqe* sqe = &mSqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = 0;
+            mSqArray[index] = index;
+            __atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+            mUnsubmitted++;
+            flush();
+            pthread_mutex_unlock(&mLock);
+            pthread_join(mReaperThread, 0);
+
+            releaseBuffers();
+            unmapRings();
+            pthread_cond_destroy(&mCond);
+            pthread_mutex_destroy(&mLock);
+        }
+
+        void CAsyncIOUring::releaseBuffers()
+        {
+            if(!mBuffers.empty())
+                io_uring_register(mRingFd, IORING_UNREGISTER_BUFFERS, 0, 0);
+            for(std::vector<uint8_t*>::iterator it = mBuffers.begin(); it != mBuffers.end(); ++it)
+                free(*it);
+            mBuffers.clear();
+        }
+
+        void CAsyncIOUring::unmapRings()
+        {
+            if(mSqes != MAP_FAILED)
+                munmap(mSqes, mSqesSize);
+            if(mCqRing != mSqRing && mCqRing != MAP_FAILED)
+                munmap(mCqRing, mCqRingSize);
+            if(mSqRing != MAP_FAILED)
+                munmap(mSqRing, mSqRingSize);
+            close(mRingFd);
+        }
+
+        void CAsyncIOUring::flush()
+        {
+            while(mUnsubmitted != 0)
+            {
+                int r = io_uring_enter(mRingFd, mUnsubmitted, 0, 0);
+                if(r < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+                    continue;
+                if(r < 0)
+                    throw std::runtime_error("io_uring_enter failed.");
+                mUnsubmitted -= r;
+            }
+        }
+
+        void CAsyncIOUring::pushOp(CIOOp* op, bool link)
+        {
+            unsigned tail = *mSqTail;
+            if(tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mSqEntries)
+            {
+                flush();
+                tail = *mSqTail;
+            }
+            unsigned index = tail & *mSqMask;
+            struct io_uring_sqe* sqe = &mSqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+
+            CIORequest* request = op->mRequest;
+            bool fixed = request->mBufferIndex >= 0 && op->mBuf >= request->mBuffer && op->mBuf + op->mSize <= request->mBuffer + mRegisteredBufferSize;
+            if(op->mOp == EIO_READ)
+                sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            else if(op->mOp == EIO_WRITE)
+                sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            else
+            {
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            }
+            if(fixed)
+                sqe->buf_index = request->mBufferIndex;
+            sqe->fd = op->mFd;
+            sqe->addr = (uint64_t)(uintptr_t)op->mBuf;
+            sqe->len = op->mSize;
+            sqe->off = op->mOffset;
+            sqe->user_data = (uint64_t)(uintptr_t)op;
+            if(link)
+                sqe->flags = IOSQE_IO_LINK;
+
+            mSqArray[index] = index;
+            __atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+            mUnsubmitted++;
+        }
+
+        void CAsyncIOUring::submit(CIORequest** requests, uint32_t count)
+        {
+            std::vector<CIORequest*> empty;
+            pthread_mutex_lock(&mLock);
+            for(uint32_t n = 0; n < count; n++)
+            {
+                CIORequest* request = requests[n];
+                uint32_t ops = request->mOps.size();
+                request->grab();
+                request->mRemaining = ops;
+                mPending++;
+                if(ops == 0)
+                {
+                    empty.push_back(request);
+                    continue;
+                }
+
+                // Never have more operations in flight than the completion queue holds
+                while(mInFlight + ops > mCqEntries && mInFlight != 0)
+                {
+                    flush();
+                    pthread_cond_wait(&mCond, &mLock);
+                }
+                mInFlight += ops;
+                for(uint32_t k = 0; k < ops; k++)
+                {
+                    request->mOps[k].mRequest = request;
+                    pushOp(&request->mOps[k], k + 1 < ops);
+                }
+            }
+            flush();
+            pthread_mutex_unlock(&mLock);
+
+            for(std::vector<CIORequest*>::iterator it = empty.begin(); it != empty.end(); ++it)
+            {
+                (*it)->complete(0);
+                (*it)->drop();
+                pthread_mutex_lock(&mLock);
+                mPending--;
+                pthread_cond_broadcast(&mCond);
+                pthread_mutex_unlock(&mLock);
+            }
+        }
+
+        uint8_t* CAsyncIOUring::allocBuffer(CIORequest* request, uint32_t size)
+        {
+            if(size <= mRegisteredBufferSize)
+            {
+                pthread_mutex_lock(&mLock);
+                if(!mFreeBuffers.empty())
+                {
+                    int index = mFreeBuffers.back();
+                    mFreeBuffers.pop_back();
+                    pthread_mutex_unlock(&mLock);
+                    memset(mBuffers[index], 0, size);
+                    request->mBuffer = mBuffers[index];
+                    request->mBufferSize = size;
+                    request->mBufferIndex = index;
+                    request->mBufferOwner = this;
+                    return request->mBuffer;
+                }
+                pthread_mutex_unlock(&mLock);
+            }
+            return request->allocHeapBuffer(size, BufferAlignment);
+        }
+
+        void CAsyncIOUring::releaseBuffer(int index)
+        {
+            pthread_mutex_lock(&mLock);
+            mFreeBuffers.push_back(index);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        void CAsyncIOUring::drain()
+        {
+            pthread_mutex_lock(&mLock);
+            while(mPending != 0)
+                pthread_cond_wait(&mCond, &mLock);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        void* CAsyncIOUring::static_reaper(void* param)
+        {
+            ((CAsyncIOUring*)param)->reaper();
+            return 0;
+        }
+
+        void CAsyncIOUring::completeOp(CIOOp* op, int res)
+        {
+            CIORequest* request = op->mRequest;
+            if(request->mResult == 0)
+            {
+                if(res < 0)
+                    request->mResult = res;
+                else if(op->mOp != EIO_SYNC && (uint32_t)res != op->mSize)
+                    request->mResult = -EIO;    // short transfer, links after it are not cancelled by the kernel
+            }
+
+            bool finished = --request->mRemaining == 0;
+            if(finished)
+            {
+                request->complete(request->mResult);
+                request->drop();
+            }
+
+            pthread_mutex_lock(&mLock);
+            mInFlight--;
+            if(finished)
+                mPending--;
+            pthread_cond_broadcast(&mCond);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        void CAsyncIOUring::reaper()
+        {
+            bool running = true;
+            while(running)
+            {
+                int r = io_uring_enter(mRingFd, 0, 1, IORING_ENTER_GETEVENTS);
+                if(r < 0 && errno != EINTR)
+                    usleep(1000);
+
+                unsigned head = *mCqHead;
+                while(head != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE))
+                {
+                    struct io_uring_cqe* cqe = &mCqes[head & *mCqMask];
+                    uint64_t userData = cqe->user_data;
+                    int res = cqe->res;
+                    head++;
+                    __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+                    if(userData == 0)
+                        running = false;    // shutdown NOP
+                    else
+                        completeOp((CIOOp*)(uintptr_t)userData, res);
+                }
+            }
+        }
+    }
+}
+#endif
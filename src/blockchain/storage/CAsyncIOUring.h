@@ -0,0 +1,91 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_ASYNC_IO_URING_INCLUDED__
+#define __C_ASYNC_IO_URING_INCLUDED__
+#include "IAsyncIO.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define __BLOCKCHAIN_IO_URING__
+#endif
+#endif
+
+#ifdef __BLOCKCHAIN_IO_URING__
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // io_uring engine on raw syscalls. Operations of one request are linked so they run
+        // in order, a batch of requests is submitted with one io_uring_enter and a reaper
+        // thread completes requests from the completion queue.
+        class CAsyncIOUring : public IAsyncIO
+        {
+        private:
+            int mRingFd;
+            void* mSqRing;
+            size_t mSqRingSize;
+            void* mCqRing;
+            size_t mCqRingSize;
+            struct io_uring_sqe* mSqes;
+            size_t mSqesSize;
+            unsigned* mSqHead;
+            unsigned* mSqTail;
+            unsigned* mSqMask;
+            unsigned* mSqArray;
+            unsigned mSqEntries;
+            unsigned* mCqHead;
+            unsigned* mCqTail;
+            unsigned* mCqMask;
+            struct io_uring_cqe* mCqes;
+            unsigned mCqEntries;
+            uint32_t mUnsubmitted;          // SQEs queued but not yet entered
+
+            pthread_mutex_t mLock;
+            pthread_cond_t mCond;           // in-flight space freed or all requests complete
+            uint32_t mInFlight;             // operations submitted and not completed
+            uint32_t mPending;              // requests submitted and not completed
+            bool mRunning;
+            pthread_t mReaperThread;
+
+            std::vector<uint8_t*> mBuffers; // registered buffers
+            std::vector<int> mFreeBuffers;
+            uint32_t mRegisteredBufferSize;
+
+            void flush();                   // enter every queued SQE, mLock held
+            void releaseBuffers();
+            void unmapRings();              // also closes the ring
+            void pushOp(CIOOp* op, bool link);
+            void completeOp(CIOOp* op, int res);
+            static void* static_reaper(void* param);
+            void reaper();
+        public:
+            CAsyncIOUring(uint32_t entries = 256, uint32_t bufferCount = 16, uint32_t bufferSize = 256 * 1024);    // throws when io_uring is unavailable
+            ~CAsyncIOUring();
+
+            static bool isSupported();      // kernel has IORING_OP_READ and IORING_OP_WRITE (Linux 5.6)
+
+            virtual void submit(CIORequest** requests, uint32_t count);
+            virtual uint8_t* allocBuffer(CIORequest* request, uint32_t size);
+            virtual void releaseBuffer(int index);
+            virtual void drain();
+            virtual const char* getName() { return "io_uring"; }
+
+            virtual void dispose() { delete this; }
+        };
+    }
+}
+#endif
+
+#endif
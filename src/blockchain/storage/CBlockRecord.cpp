@@ -0,0 +1,221 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CBlockRecord.h"
+#include "crc32c.h"
+#include "codec.h"
+#include <string.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        CBlockRecord::CBlockRecord()
+        {
+            mVersion = Version;
+            memset(mHash, 0, SHA256_DIGEST_LENGTH);
+            memset(mPrevHash, 0, SHA256_DIGEST_LENGTH);
+            mCreatedTS = 0;
+            mNonce = 0;
+            mDataSize = 0;
+            mCodec = ECT_NONE;
+            mStoredSize = 0;
+            mPayloadCrc = 0;
+            mPayload = 0;
+            mPinned = 0;
+        }
+
+        CBlockRecord::~CBlockRecord()
+        {
+            if(mPinned)
+                mPinned->unpinData();
+        }
+
+        size_t CBlockRecord::getHeaderSize(uint32_t version)
+        {
+            size_t sz = sizeof(uint32_t) + SHA256_DIGEST_LENGTH * 2 + sizeof(time_t) + sizeof(uint32_t) * 2;
+            if(version >= 2)
+                sz += sizeof(uint32_t) * 2;
+            if(version >= 3)
+                sz += sizeof(uint32_t) * 2;
+            return sz;
+        }
+
+        size_t CBlockRecord::getTrailerSize(uint32_t version)
+        {
+            return version >= 2 ? sizeof(uint32_t) : 0;
+        }
+
+        void CBlockRecord::fromBlock(CBlock* block, E_CODEC_TYPE codec)
+        {
+            mVersion = Version;
+            memcpy(mHash, block->getHash(), SHA256_DIGEST_LENGTH);
+            memcpy(mPrevHash, block->getPrevHash(), SHA256_DIGEST_LENGTH);
+            mCreatedTS = block->getCreatedTS();
+            mNonce = block->getNonce();
+            mDataSize = block->getDataSize();
+            if(mPinned)
+                mPinned->unpinData();
+            mPinned = 0;
+            mPayload = block->pinData();
+            mPinned = block;
+            mCodec = ECT_NONE;
+            mStoredSize = mDataSize;
+            if(codec != ECT_NONE && mDataSize != 0 && compressData(codec, mPayload, mDataSize, &mPacked) && mPacked.size() < mDataSize)
+            {
+                mCodec = codec;
+                mStoredSize = mPacked.size();
+                mPayload = mPacked.data();
+            }
+            mPayloadCrc = crc32c(mPayload, mStoredSize);
+        }
+
+        void CBlockRecord::toBlock(CBlock* block)
+        {
+            block->setPrevHash(mPrevHash);
+            block->setCreatedTS(mCreatedTS);
+            block->setNonce(mNonce);
+            uint8_t* data = new uint8_t[mStoredSize];
+            if(mStoredSize != 0)
+                memcpy(data, mPayload, mStoredSize);
+            if(mCodec == ECT_NONE)
+                block->setAllocatedData(data, mDataSize);
+            else
+                block->setPackedData(data, mStoredSize, mCodec, mDataSize);
+        }
+
+        bool CBlockRecord::compress(E_CODEC_TYPE codec)
+        {
+            if(mCodec != ECT_NONE || codec == ECT_NONE || mDataSize == 0)
+                return false;
+            std::vector<uint8_t> packed;
+            if(!compressData(codec, mPayload, mDataSize, &packed) || packed.size() >= mDataSize)
+                return false;
+            mPacked.swap(packed);
+            mCodec = codec;
+            mStoredSize = mPacked.size();
+            mPayload = mPacked.data();
+            mPayloadCrc = crc32c(mPayload, mStoredSize);
+            return true;
+        }
+
+        size_t CBlockRecord::getEncodedSize()
+        {
+            return getHeaderSize(Version) + mStoredSize + getTrailerSize(Version);
+        }
+
+        void CBlockRecord::encode(std::vector<uint8_t>* out)
+        {
+            size_t start = out->size();
+            out->resize(start + getEncodedSize());
+            encode(out->data() + start);
+        }
+
+        void CBlockRecord::encode(uint8_t* out)
+        {
+            uint8_t* ptr = out;
+
+            uint32_t version = Version;
+            memcpy(ptr, &version, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, mHash, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            memcpy(ptr, mPrevHash, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            memcpy(ptr, &mCreatedTS, sizeof(time_t));
+            ptr += sizeof(time_t);
+            memcpy(ptr, &mNonce, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &mDataSize, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            uint32_t codec = mCodec;
+            memcpy(ptr, &codec, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &mStoredSize, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &mPayloadCrc, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            uint32_t headerCrc = crc32c(out, ptr - out);
+            memcpy(ptr, &headerCrc, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            if(mStoredSize != 0)
+            {
+                memcpy(ptr, mPayload, mStoredSize);
+                ptr += mStoredSize;
+            }
+            uint32_t endMarker = EndMarker;
+            memcpy(ptr, &endMarker, sizeof(uint32_t));
+        }
+
+        bool CBlockRecord::decode(const uint8_t* buf, size_t size)
+        {
+            if(!decodeHeader(buf, size))
+                return false;
+            if(size < getHeaderSize(mVersion) + (size_t)mStoredSize + getTrailerSize(mVersion))
+                return false;
+            mPayload = buf + getHeaderSize(mVersion);
+
+            if(mVersion >= 2)
+            {
+                uint32_t endMarker = 0;
+                memcpy(&endMarker, mPayload + mStoredSize, sizeof(uint32_t));
+                if(endMarker != EndMarker || mPayloadCrc != crc32c(mPayload, mStoredSize))
+                    return false;
+            }
+            else
+                mPayloadCrc = crc32c(mPayload, mDataSize);
+            return true;
+        }
+
+        bool CBlockRecord::decodeHeader(const uint8_t* buf, size_t size)
+        {
+            mPayload = 0;
+            if(size < sizeof(uint32_t))
+                return false;
+            const uint8_t* ptr = buf;
+            memcpy(&mVersion, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            if(mVersion < 1 || mVersion > Version || size < getHeaderSize(mVersion))
+                return false;
+
+            memcpy(mHash, ptr, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            memcpy(mPrevHash, ptr, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            memcpy(&mCreatedTS, ptr, sizeof(time_t));
+            ptr += sizeof(time_t);
+            memcpy(&mNonce, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&mDataSize, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            mCodec = ECT_NONE;
+            mStoredSize = mDataSize;
+            if(mVersion >= 3)
+            {
+                uint32_t codec = 0;
+                memcpy(&codec, ptr, sizeof(uint32_t));
+                ptr += sizeof(uint32_t);
+                memcpy(&mStoredSize, ptr, sizeof(uint32_t));
+                ptr += sizeof(uint32_t);
+                if(codec >= ECT_COUNT)
+                    return false;
+                mCodec = (E_CODEC_TYPE)codec;
+            }
+            if(mVersion >= 2)
+            {
+                memcpy(&mPayloadCrc, ptr, sizeof(uint32_t));
+                ptr += sizeof(uint32_t);
+                uint32_t headerCrc = 0;
+                memcpy(&headerCrc, ptr, sizeof(uint32_t));
+                if(headerCrc != crc32c(buf, ptr - buf))
+                    return false;
+            }
+            return true;
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_BLOCK_RECORD_INCLUDED__
+#define __C_BLOCK_RECORD_INCLUDED__
+#include "../CBlock.h"
+#include "ECodecType.h"
+#include <stdint.h>
+#include <vector>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // On-disk form of one block.
+        //
+        // Version 1: version, hash, prevHash, createdTS, nonce, dataSize, payload
+        // Version 2: version, hash, prevHash, createdTS, nonce, dataSize, payloadCrc, headerCrc, payload, end marker
+        // Version 3: version, hash, prevHash, createdTS, nonce, dataSize, codec, storedSize, payloadCrc, headerCrc, payload, end marker
+        //
+        // Both checksums are CRC32C, headerCrc covers every field before it and payloadCrc
+        // covers the payload as stored (compressed when codec is not ECT_NONE).
+        class CBlockRecord
+        {
+        public:
+            static const uint32_t Version = 3;
+            static const uint32_t EndMarker = 0x444E4542;   // "BEND"
+
+            uint32_t mVersion;
+            uint8_t mHash[SHA256_DIGEST_LENGTH];
+            uint8_t mPrevHash[SHA256_DIGEST_LENGTH];
+            time_t mCreatedTS;
+            uint32_t mNonce;
+            uint32_t mDataSize;                             // Uncompressed payload size
+            E_CODEC_TYPE mCodec;
+            uint32_t mStoredSize;                           // Payload size as stored
+            uint32_t mPayloadCrc;
+            const uint8_t* mPayload;                        // Points into the encoded buffer, the block or mPacked
+            CBlock* mPinned;                                // Block mPayload points into, pinned until the record goes away
+            std::vector<uint8_t> mPacked;                   // Compressed payload owned by the record
+
+        private:
+            CBlockRecord(const CBlockRecord&);
+            CBlockRecord& operator=(const CBlockRecord&);
+        public:
+
+            CBlockRecord();
+            ~CBlockRecord();
+
+            void fromBlock(CBlock* block, E_CODEC_TYPE codec = ECT_NONE);  // Take header and payload, compressed when it pays off
+            void toBlock(CBlock* block);                    // Copy header and payload into a block, compressed payloads stay packed
+            bool compress(E_CODEC_TYPE codec);              // Compress a raw payload in place, false when it stays raw
+
+            size_t getEncodedSize();                        // Bytes written by encode
+            void encode(uint8_t* out);                      // Write the current version encoding
+            void encode(std::vector<uint8_t>* out);         // Append the current version encoding
+            bool decode(const uint8_t* buf, size_t size);   // False when short, torn or checksum mismatch
+            bool decodeHeader(const uint8_t* buf, size_t size);     // Fields before the payload only, version 1 has no payload checksum
+
+            static size_t getHeaderSize(uint32_t version);
+            static size_t getTrailerSize(uint32_t version);
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,401 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CChunkStore.h"
+#include "CStorageLocal.h"
+#include "crc32c.h"
+#include "codec.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        static bool syncDirectory(const std::string& path)
+        {
+            int dir = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+            if(dir < 0)
+                return false;
+            bool ok = fsync(dir) == 0;
+            close(dir);
+            return ok;
+        }
+
+        uint64_t CChunkStore::mGear[256];
+        pthread_once_t CChunkStore::mGearOnce = PTHREAD_ONCE_INIT;
+
+        void CChunkStore::initGear()
+        {
+            // Fixed table so every node cuts the same payload at the same places
+            uint64_t seed = 0x9E3779B97F4A7C15ULL;
+            for(uint32_t n = 0; n < 256; n++)
+            {
+                uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                mGear[n] = z ^ (z >> 31);
+            }
+        }
+
+        CChunkStore::CChunkStore(const std::string& path, E_CODEC_TYPE codec) : mPath(path), mLog("Chunks")
+        {
+            pthread_once(&mGearOnce, &initGear);
+            mCodec = codec;
+            mChunksWritten = 0;
+            mChunksReused = 0;
+            mBytesWritten = 0;
+            mBytesReused = 0;
+            pthread_mutex_init(&mLock, 0);
+            pthread_cond_init(&mWritten, 0);
+            mkdir(mPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+        }
+
+        CChunkStore::~CChunkStore()
+        {
+            pthread_cond_destroy(&mWritten);
+            pthread_mutex_destroy(&mLock);
+        }
+
+        void CChunkStore::split(const uint8_t* data, uint32_t size, std::vector<uint32_t>* lengths)
+        {
+            pthread_once(&mGearOnce, &initGear);
+            lengths->clear();
+            uint32_t start = 0;
+            while(start < size)
+            {
+                uint32_t len = size - start;
+                if(len > MinChunkSize)
+                {
+                    uint32_t limit = len < MaxChunkSize ? len : MaxChunkSize;
+                    const uint8_t* ptr = data + start;
+                    uint64_t h = 0;
+                    len = limit;
+                    for(uint32_t n = MinChunkSize; n < limit; n++)
+                    {
+                        h = (h << 1) + mGear[ptr[n]];
+                        if((h & BoundaryMask) == 0)
+                        {
+                            len = n + 1;
+                            break;
+                        }
+                    }
+                }
+                lengths->push_back(len);
+                start += len;
+            }
+        }
+
+        void CChunkStore::setCodec(E_CODEC_TYPE codec)
+        {
+            pthread_mutex_lock(&mLock);
+            mCodec = codec;
+            pthread_mutex_unlock(&mLock);
+        }
+
+        std::string CChunkStore::getChunkPath(const uint8_t* digest)
+        {
+            // Two hex digit fan out keeps directories small
+            std::string name(CStorageLocal::hashToStr(digest));
+            return mPath + name.substr(0, 2) + "/" + name;
+        }
+
+        bool CChunkStore::store(CBlockRecord* record, bool verify, CWrites* writes)
+        {
+            if(record->mCodec != ECT_NONE || record->mDataSize < MinChunkSize * 2)
+                return false;       // too small to share anything
+
+            std::vector<uint32_t> lengths;
+            split(record->mPayload, record->mDataSize, &lengths);
+
+            std::vector<uint8_t> list(sizeof(uint32_t) + lengths.size() * EntrySize);
+            uint32_t count = lengths.size();
+            memcpy(list.data(), &count, sizeof(uint32_t));
+            uint8_t* entry = list.data() + sizeof(uint32_t);
+            const uint8_t* chunk = record->mPayload;
+            for(std::vector<uint32_t>::iterator it = lengths.begin(); it != lengths.end(); ++it)
+            {
+                uint32_t len = *it;
+                SHA256(chunk, len, entry);
+                if(!put(entry, chunk, len, verify, writes))
+                    return false;
+                memcpy(entry + SHA256_DIGEST_LENGTH, &len, sizeof(uint32_t));
+                entry += EntrySize;
+                chunk += len;
+            }
+
+            record->mPacked.swap(list);
+            record->mCodec = ECT_CHUNKS;
+            record->mStoredSize = record->mPacked.size();
+            record->mPayload = record->mPacked.data();
+            record->mPayloadCrc = crc32c(record->mPayload, record->mStoredSize);
+            return true;
+        }
+
+        bool CChunkStore::expand(CBlockRecord* record)
+        {
+            if(record->mCodec != ECT_CHUNKS)
+                return true;
+            uint32_t count = 0;
+            if(record->mStoredSize < sizeof(uint32_t))
+                return false;
+            memcpy(&count, record->mPayload, sizeof(uint32_t));
+            if(record->mStoredSize != sizeof(uint32_t) + (uint64_t)count * EntrySize)
+                return false;
+
+            std::vector<uint8_t> raw(record->mDataSize);
+            const uint8_t* entry = record->mPayload + sizeof(uint32_t);
+            uint64_t pos = 0;
+            for(uint32_t n = 0; n < count; n++, entry += EntrySize)
+            {
+                uint32_t len = 0;
+                memcpy(&len, entry + SHA256_DIGEST_LENGTH, sizeof(uint32_t));
+                if(pos + len > raw.size() || !get(entry, raw.data() + pos, len))
+                    return false;
+                pos += len;
+            }
+            if(pos != raw.size())
+                return false;
+
+            record->mPacked.swap(raw);
+            record->mCodec = ECT_NONE;
+            record->mStoredSize = record->mDataSize;
+            record->mPayload = record->mPacked.data();
+            record->mPayloadCrc = crc32c(record->mPayload, record->mStoredSize);
+            return true;
+        }
+
+        bool CChunkStore::put(const uint8_t* digest, const uint8_t* data, uint32_t size, bool verify, CWrites* writes)
+        {
+            // Only the same chunk waits for another writer, different chunks are written side by side
+            std::string path(getChunkPath(digest));
+            bool repeated = writes && writes->has(path);   // earlier in the same payload, already queued
+            pthread_mutex_lock(&mLock);
+            while(!repeated && mWriting.count(path) != 0)
+                pthread_cond_wait(&mWritten, &mLock);
+            mWriting.insert(path);
+            pthread_mutex_unlock(&mLock);
+
+            bool reused = repeated || (access(path.c_str(), F_OK) == 0 && (!verify || check(path, size)));
+            bool queued = !reused && writes && !writes->isFull();
+            bool ok = reused || (queued ? prepare(path, data, size, writes) : write(path, data, size));
+
+            pthread_mutex_lock(&mLock);
+            if(!repeated && !(queued && ok))
+            {
+                mWriting.erase(path);       // a queued chunk is held until commit
+                pthread_cond_broadcast(&mWritten);
+            }
+            if(reused)
+            {
+                mChunksReused++;
+                mBytesReused += size;
+            }
+            else if(ok && !queued)
+            {
+                mChunksWritten++;
+                mBytesWritten += size;
+            }
+            pthread_mutex_unlock(&mLock);
+            return ok;
+        }
+
+        void CChunkStore::encode(const uint8_t* data, uint32_t size, std::vector<uint8_t>* out)
+        {
+            pthread_mutex_lock(&mLock);
+            E_CODEC_TYPE codec = mCodec;
+            pthread_mutex_unlock(&mLock);
+            std::vector<uint8_t> packed;
+            if(codec != ECT_NONE && !(compressData(codec, data, size, &packed) && packed.size() < size))
+                codec = ECT_NONE;
+            const uint8_t* payload = codec == ECT_NONE ? data : packed.data();
+            uint32_t storedSize = codec == ECT_NONE ? size : packed.size();
+
+            uint32_t header[HeaderSize / sizeof(uint32_t)] = { Magic, (uint32_t)codec, size, storedSize, crc32c(payload, storedSize) };
+            out->resize(HeaderSize + storedSize);
+            memcpy(out->data(), header, HeaderSize);
+            memcpy(out->data() + HeaderSize, payload, storedSize);
+        }
+
+        bool CChunkStore::write(const std::string& path, const uint8_t* data, uint32_t size)
+        {
+            std::vector<uint8_t> contents;
+            encode(data, size, &contents);
+            std::string dir(path.substr(0, path.rfind('/')));
+            bool created = mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0;
+
+            // Chunk and its directory entry are durable before any record refers to it
+            std::string tmpPath(path + ".tmp");
+            int file = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            bool ok = file >= 0 && ::write(file, contents.data(), contents.size()) == (ssize_t)contents.size() && fdatasync(file) == 0;
+            if(file >= 0)
+                close(file);
+            ok = ok && rename(tmpPath.c_str(), path.c_str()) == 0 && syncDirectory(dir) && (!created || syncDirectory(mPath));
+            if(!ok)
+            {
+                unlink(tmpPath.c_str());
+                mLog.errorLine("Could not write chunk: " + path);
+            }
+            return ok;
+        }
+
+        bool CChunkStore::prepare(const std::string& path, const uint8_t* data, uint32_t size, CWrites* writes)
+        {
+            std::string dir(path.substr(0, path.rfind('/')));
+            if(mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0)
+                writes->mCreatedDir = true;
+            int file = open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if(file < 0)
+            {
+                mLog.errorLine("Could not write chunk: " + path);
+                return false;
+            }
+            writes->mChunks.push_back(CWrites::CChunk());
+            CWrites::CChunk& chunk = writes->mChunks.back();
+            chunk.mPath = path;
+            chunk.mFile = file;
+            chunk.mSize = size;
+            encode(data, size, &chunk.mData);
+            return true;
+        }
+
+        bool CChunkStore::commit(CWrites* writes, bool ok)
+        {
+            // Runs on the I/O completion thread once the queued writes and syncs are done, the
+            // renames and one sync per directory make the chunks durable before the record counts
+            bool written = ok;
+            std::set<std::string> dirs;
+            for(std::deque<CWrites::CChunk>::iterator it = writes->mChunks.begin(); it != writes->mChunks.end(); ++it)
+            {
+                std::string tmpPath(it->mPath + ".tmp");
+                close(it->mFile);
+                if(ok && rename(tmpPath.c_str(), it->mPath.c_str()) == 0)
+                    dirs.insert(it->mPath.substr(0, it->mPath.rfind('/')));
+                else
+                {
+                    ok = false;
+                    unlink(tmpPath.c_str());
+                }
+            }
+            for(std::set<std::string>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+                ok = syncDirectory(*it) && ok;
+            if(writes->mCreatedDir)
+                ok = syncDirectory(mPath) && ok;
+
+            pthread_mutex_lock(&mLock);
+            for(std::deque<CWrites::CChunk>::iterator it = writes->mChunks.begin(); it != writes->mChunks.end(); ++it)
+            {
+                mWriting.erase(it->mPath);
+                if(ok)
+                {
+                    mChunksWritten++;
+                    mBytesWritten += it->mSize;
+                }
+            }
+            pthread_cond_broadcast(&mWritten);
+            pthread_mutex_unlock(&mLock);
+            if(written && !ok)
+                mLog.errorLine("Could not write the chunks of a record.");
+            writes->mChunks.clear();
+            writes->mCreatedDir = false;
+            return ok;
+        }
+
+        bool CChunkStore::CWrites::has(const std::string& path)
+        {
+            for(std::deque<CChunk>::iterator it = mChunks.begin(); it != mChunks.end(); ++it)
+            {
+                if(it->mPath == path)
+                    return true;
+            }
+            return false;
+        }
+
+        void CChunkStore::CWrites::queue(CIORequest* request)
+        {
+            for(std::deque<CChunk>::iterator it = mChunks.begin(); it != mChunks.end(); ++it)
+            {
+                request->addWrite(it->mFile, it->mData.data(), it->mData.size(), 0);
+                request->addSync(it->mFile);
+            }
+        }
+
+        bool CChunkStore::check(const std::string& path, uint32_t size)
+        {
+            int file = open(path.c_str(), O_RDONLY);
+            if(file < 0)
+                return false;
+            uint32_t header[HeaderSize / sizeof(uint32_t)];
+            bool ok = read(file, header, HeaderSize) == HeaderSize && header[0] == Magic && header[1] < ECT_CHUNKS && header[2] == size;
+            if(ok)
+            {
+                std::vector<uint8_t> payload(header[3]);
+                ok = read(file, payload.data(), payload.size()) == (ssize_t)payload.size() && crc32c(payload.data(), payload.size()) == header[4];
+            }
+            close(file);
+            if(!ok)
+                mLog.writeLine("Rewriting damaged chunk: " + path);
+            return ok;
+        }
+
+        bool CChunkStore::get(const uint8_t* digest, uint8_t* out, uint32_t size)
+        {
+            std::string path(getChunkPath(digest));
+            int file = open(path.c_str(), O_RDONLY);
+            if(file < 0)
+                return false;
+            uint32_t header[HeaderSize / sizeof(uint32_t)];
+            bool ok = read(file, header, HeaderSize) == HeaderSize && header[0] == Magic && header[1] < ECT_CHUNKS && header[2] == size;
+            std::vector<uint8_t> payload;
+            if(ok)
+            {
+                payload.resize(header[3]);
+                ok = read(file, payload.data(), payload.size()) == (ssize_t)payload.size() && crc32c(payload.data(), payload.size()) == header[4]
+                    && decompressData((E_CODEC_TYPE)header[1], payload.data(), payload.size(), out, size);
+            }
+            close(file);
+            return ok;
+        }
+
+        uint64_t CChunkStore::getChunksWritten()
+        {
+            pthread_mutex_lock(&mLock);
+            uint64_t r = mChunksWritten;
+            pthread_mutex_unlock(&mLock);
+            return r;
+        }
+
+        uint64_t CChunkStore::getChunksReused()
+        {
+            pthread_mutex_lock(&mLock);
+            uint64_t r = mChunksReused;
+            pthread_mutex_unlock(&mLock);
+            return r;
+        }
+
+        uint64_t CChunkStore::getBytesReused()
+        {
+            pthread_mutex_lock(&mLock);
+            uint64_t r = mBytesReused;
+            pthread_mutex_unlock(&mLock);
+            return r;
+        }
+
+        void CChunkStore::logStats()
+        {
+            pthread_mutex_lock(&mLock);
+            if(mChunksWritten + mChunksReused != 0)
+                mLog.writeLine("Chunks written " + std::to_string(mChunksWritten) + " (" + std::to_string(mBytesWritten) + " bytes), reused " + std::to_string(mChunksReused) + " (" + std::to_string(mBytesReused) + " bytes not written).");
+            pthread_mutex_unlock(&mLock);
+        }
+    }
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_CHUNK_STORE_INCLUDED__
+#define __C_CHUNK_STORE_INCLUDED__
+#include "CBlockRecord.h"
+#include "CIORequest.h"
+#include "ECodecType.h"
+#include "../CLog.h"
+#include <stdint.h>
+#include <set>
+#include <deque>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Content addressed store for payload chunks shared between blocks.
+        //
+        // Payloads are cut where a gear rolling hash hits a boundary pattern, so an insert or
+        // edit only moves the chunks around it. Each chunk is kept once under its SHA-256 and
+        // a deduplicated record stores the list of chunks instead of the payload (ECT_CHUNKS).
+        //
+        // Chunk list: count, then count x (digest[32], size)
+        // Chunk file: magic, codec, dataSize, storedSize, crc, payload
+        class CChunkStore
+        {
+        public:
+            // New chunks of one record. Their writes and syncs are queued ahead of the record's own
+            // in its save request, commit publishes them once that request completes. Past MaxQueued
+            // chunks are written and synced by store itself, a request stays within the I/O queue depth.
+            class CWrites
+            {
+            public:
+                static const uint32_t MaxQueued = 64;
+
+                class CChunk
+                {
+                public:
+                    std::string mPath;
+                    int mFile;                              // Temporary file the queued ops write
+                    uint32_t mSize;                         // Payload bytes, before compression
+                    std::vector<uint8_t> mData;             // Header and stored payload
+                };
+
+                std::deque<CChunk> mChunks;                 // Deque, queued ops point into mData
+                bool mCreatedDir;                           // A fan out directory was made, the store directory needs a sync
+
+                CWrites() { mCreatedDir = false; }
+                bool has(const std::string& path);
+                bool isFull() { return mChunks.size() >= MaxQueued; }
+                void queue(CIORequest* request);            // Write and sync each chunk, in order before anything added later
+            };
+
+        private:
+            static const uint32_t Magic = 0x4B4E4843;       // "CHNK"
+            static const uint32_t HeaderSize = 20;
+            static const uint32_t EntrySize = SHA256_DIGEST_LENGTH + sizeof(uint32_t);
+            static const uint32_t MinChunkSize = 2048;
+            static const uint32_t MaxChunkSize = 65536;
+            static const uint64_t BoundaryMask = 0xFFF8000000000000ULL;    // 13 bits, ~8 KiB average past the minimum
+
+            static uint64_t mGear[256];
+            static pthread_once_t mGearOnce;
+
+            const std::string mPath;
+            E_CODEC_TYPE mCodec;                            // Applied to each new chunk
+            pthread_mutex_t mLock;                          // Guards mWriting and the counters, not held while writing
+            pthread_cond_t mWritten;                        // A chunk left mWriting
+            std::set<std::string> mWriting;                 // Chunk paths being written by some thread
+            uint64_t mChunksWritten;
+            uint64_t mChunksReused;
+            uint64_t mBytesWritten;                         // Payload bytes, before compression
+            uint64_t mBytesReused;
+
+            CLog mLog;
+
+            static void initGear();
+            std::string getChunkPath(const uint8_t* digest);
+            bool put(const uint8_t* digest, const uint8_t* data, uint32_t size, bool verify, CWrites* writes);
+            void encode(const uint8_t* data, uint32_t size, std::vector<uint8_t>* out);   // Chunk file contents
+            bool write(const std::string& path, const uint8_t* data, uint32_t size);
+            bool prepare(const std::string& path, const uint8_t* data, uint32_t size, CWrites* writes);   // Temporary file left to the queued ops
+            bool check(const std::string& path, uint32_t size);     // Header and CRC intact, the payload is not decoded
+            bool get(const uint8_t* digest, uint8_t* out, uint32_t size);
+        public:
+            CChunkStore(const std::string& path, E_CODEC_TYPE codec = ECT_NONE);
+            ~CChunkStore();
+
+            static void split(const uint8_t* data, uint32_t size, std::vector<uint32_t>* lengths);   // Chunk lengths covering data
+
+            void setCodec(E_CODEC_TYPE codec);
+            bool store(CBlockRecord* record, bool verify = false, CWrites* writes = 0);  // Replace a raw payload with its chunk list, false keeps it inline. verify rewrites damaged chunks
+            bool commit(CWrites* writes, bool ok);          // Rename queued chunks into place once written, drop them when not. False unless all are durable
+            bool expand(CBlockRecord* record);              // Chunk list back to the raw payload, false when a chunk is missing or damaged
+
+            uint64_t getChunksWritten();
+            uint64_t getChunksReused();
+            uint64_t getBytesReused();
+            void logStats();
+        };
+    }
+}
+
+#endif
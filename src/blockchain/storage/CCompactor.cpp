@@ -0,0 +1,90 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CCompactor.h"
+#include "CStorageLocal.h"
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        CCompactor::CCompactor(CStorageLocal* storage, uint32_t age, uint32_t span, uint64_t rate, uint64_t nextHeight) : mThrottle(rate), mLog("Compactor")
+        {
+            mStorage = storage;
+            mAge = age;
+            mSpan = span == 0 ? 1 : span;
+            mNextHeight = nextHeight;
+            pthread_mutex_init(&mLock, 0);
+            pthread_cond_init(&mCond, 0);
+            mRunning = true;
+            if(pthread_create(&mThread, 0, &static_worker, this) != 0)
+                throw std::runtime_error("Failed to start compactor thread.");
+        }
+
+        CCompactor::~CCompactor()
+        {
+            pthread_mutex_lock(&mLock);
+            mRunning = false;
+            pthread_cond_broadcast(&mCond);
+            pthread_mutex_unlock(&mLock);
+            pthread_join(mThread, 0);
+            pthread_cond_destroy(&mCond);
+            pthread_mutex_destroy(&mLock);
+        }
+
+        bool CCompactor::isRunning()
+        {
+            pthread_mutex_lock(&mLock);
+            bool running = mRunning;
+            pthread_mutex_unlock(&mLock);
+            return running;
+        }
+
+        void CCompactor::throttle(size_t bytes)
+        {
+            uint64_t usec = mThrottle.account(bytes);
+            if(usec != 0)
+                wait(usec);
+        }
+
+        void* CCompactor::static_worker(void* param)
+        {
+            ((CCompactor*)param)->worker();
+            return 0;
+        }
+
+        void CCompactor::worker()
+        {
+            while(wait(5000000))
+            {
+                uint64_t height = mStorage->getDurableHeight();
+                while(isRunning() && mNextHeight + mSpan + mAge <= height)
+                {
+                    try
+                    {
+                        mThrottle.restart();
+                        if(!mStorage->compact(mNextHeight, mNextHeight + mSpan - 1, this))
+                            break;
+                        mNextHeight += mSpan;
+                    }
+                    catch(std::exception& e)
+                    {
+                        mLog.errorLine(std::string("Compaction failed: ") + e.what());
+                        break;
+                    }
+                }
+            }
+        }
+
+        void CCompactor::dispose()
+        {
+            delete this;
+        }
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_COMPACTOR_INCLUDED__
+#define __C_COMPACTOR_INCLUDED__
+#include "CThrottle.h"
+#include "../CLog.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        class CStorageLocal;
+
+        // Background thread that merges blocks older than the hot window into archives.
+        // Reads and writes are limited to a byte rate so it does not compete with block saves.
+        class CCompactor
+        {
+        private:
+            CStorageLocal* mStorage;
+            uint32_t mAge;                  // Blocks this close to the tip stay as single files
+            uint32_t mSpan;                 // Blocks per archive
+            CThrottle mThrottle;
+            uint64_t mNextHeight;           // First height not archived yet
+            bool mRunning;
+            pthread_t mThread;
+            pthread_mutex_t mLock;
+            pthread_cond_t mCond;           // stop requested
+
+            CLog mLog;
+
+            static void* static_worker(void* param);
+            void worker();
+            bool wait(uint64_t usec) { return CThrottle::sleep(&mLock, &mCond, &mRunning, usec); }     // false when stopping
+        public:
+            CCompactor(CStorageLocal* storage, uint32_t age, uint32_t span, uint64_t rate, uint64_t nextHeight);
+            ~CCompactor();
+
+            bool isRunning();
+            void throttle(size_t bytes);    // Account bytes moved, sleeps while over the rate
+
+            void dispose();
+        };
+    }
+}
+
+#endif
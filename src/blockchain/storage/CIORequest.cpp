@@ -0,0 +1,117 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CIORequest.h"
+#include "IAsyncIO.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        CIORequest::CIORequest()
+        {
+            pthread_mutex_init(&mLock, 0);
+            pthread_cond_init(&mCond, 0);
+            mDone = false;
+            mResult = 0;
+            mBuffer = 0;
+            mBufferSize = 0;
+            mBufferIndex = -1;
+            mBufferOwner = 0;
+            mRemaining = 0;
+        }
+
+        CIORequest::~CIORequest()
+        {
+            if(mBuffer && mBufferIndex >= 0)
+                mBufferOwner->releaseBuffer(mBufferIndex);
+            else if(mBuffer)
+                free(mBuffer);
+            pthread_cond_destroy(&mCond);
+            pthread_mutex_destroy(&mLock);
+        }
+
+        void CIORequest::addRead(int fd, uint8_t* buf, uint32_t size, uint64_t offset)
+        {
+            CIOOp op;
+            op.mOp = EIO_READ;
+            op.mFd = fd;
+            op.mBuf = buf;
+            op.mSize = size;
+            op.mOffset = offset;
+            op.mRequest = this;
+            mOps.push_back(op);
+        }
+
+        void CIORequest::addWrite(int fd, const uint8_t* buf, uint32_t size, uint64_t offset)
+        {
+            CIOOp op;
+            op.mOp = EIO_WRITE;
+            op.mFd = fd;
+            op.mBuf = (uint8_t*)buf;
+            op.mSize = size;
+            op.mOffset = offset;
+            op.mRequest = this;
+            mOps.push_back(op);
+        }
+
+        void CIORequest::addSync(int fd)
+        {
+            CIOOp op;
+            op.mOp = EIO_SYNC;
+            op.mFd = fd;
+            op.mBuf = 0;
+            op.mSize = 0;
+            op.mOffset = 0;
+            op.mRequest = this;
+            mOps.push_back(op);
+        }
+
+        uint8_t* CIORequest::allocHeapBuffer(uint32_t size, uint32_t alignment)
+        {
+            void* buf = 0;
+            if(posix_memalign(&buf, alignment, size == 0 ? alignment : size) != 0)
+                throw std::runtime_error("Could not allocate I/O buffer.");
+            memset(buf, 0, size);
+            mBuffer = (uint8_t*)buf;
+            mBufferSize = size;
+            mBufferIndex = -1;
+            return mBuffer;
+        }
+
+        void CIORequest::complete(int result)
+        {
+            mResult = result;
+            onComplete();
+            pthread_mutex_lock(&mLock);
+            mDone = true;
+            pthread_cond_broadcast(&mCond);
+            pthread_mutex_unlock(&mLock);
+        }
+
+        int CIORequest::wait()
+        {
+            pthread_mutex_lock(&mLock);
+            while(!mDone)
+                pthread_cond_wait(&mCond, &mLock);
+            pthread_mutex_unlock(&mLock);
+            return mResult;
+        }
+
+        bool CIORequest::isDone()
+        {
+            pthread_mutex_lock(&mLock);
+            bool done = mDone;
+            pthread_mutex_unlock(&mLock);
+            return done;
+        }
+    }
+}
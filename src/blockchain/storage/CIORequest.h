@@ -0,0 +1,76 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_IO_REQUEST_INCLUDED__
+#define __C_IO_REQUEST_INCLUDED__
+#include "../IReferenceCounted.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        class IAsyncIO;
+        class CIORequest;
+
+        enum E_IO_OP
+        {
+            EIO_READ = 0,
+            EIO_WRITE,
+            EIO_SYNC,           // fdatasync
+            EIO_COUNT
+        };
+
+        class CIOOp
+        {
+        public:
+            E_IO_OP mOp;
+            int mFd;
+            uint8_t* mBuf;
+            uint32_t mSize;
+            uint64_t mOffset;
+            CIORequest* mRequest;       // Set by the engine on submit
+        };
+
+        // Awaitable group of I/O operations executed in order, later operations are
+        // cancelled once one fails. Subclasses override onComplete() which runs on the
+        // I/O engine's completion thread before waiters are released.
+        class CIORequest : public IReferenceCounted
+        {
+        private:
+            pthread_mutex_t mLock;
+            pthread_cond_t mCond;
+            bool mDone;
+        public:
+            std::vector<CIOOp> mOps;
+            int mResult;                // 0 or the first negative errno
+            uint8_t* mBuffer;           // Buffer owned by the request, see IAsyncIO::allocBuffer
+            uint32_t mBufferSize;
+            int mBufferIndex;           // Registered buffer index or -1
+            IAsyncIO* mBufferOwner;     // Engine the registered buffer goes back to
+            uint32_t mRemaining;        // Operations not completed yet, used by the engines
+
+            CIORequest();
+            virtual ~CIORequest();
+
+            void addRead(int fd, uint8_t* buf, uint32_t size, uint64_t offset);
+            void addWrite(int fd, const uint8_t* buf, uint32_t size, uint64_t offset);
+            void addSync(int fd);
+            uint8_t* allocHeapBuffer(uint32_t size, uint32_t alignment);   // Zeroed, aligned for O_DIRECT
+
+            virtual void onComplete() {}
+            void complete(int result);  // Called once by the engine
+            int wait();                 // Blocks until complete, returns mResult
+            bool isDone();
+        };
+    }
+}
+
+#endif
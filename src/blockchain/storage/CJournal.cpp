@@ -0,0 +1,94 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CJournal.h"
+#include "crc32c.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        CJournal::CJournal()
+        {
+            mFile = -1;
+        }
+
+        CJournal::~CJournal()
+        {
+            close();
+        }
+
+        void CJournal::open(const std::string& path)
+        {
+            close();
+            mFile = ::open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if(mFile < 0)
+                throw std::runtime_error("Could not open journal.");
+        }
+
+        void CJournal::close()
+        {
+            if(mFile >= 0)
+            {
+                ::close(mFile);
+                mFile = -1;
+            }
+        }
+
+        void CJournal::write(uint64_t height, const uint8_t* hash)
+        {
+            uint8_t buf[EntrySize];
+            memcpy(buf, &height, sizeof(uint64_t));
+            memcpy(buf + sizeof(uint64_t), hash, SHA256_DIGEST_LENGTH);
+            uint32_t crc = crc32c(buf, sizeof(uint64_t) + SHA256_DIGEST_LENGTH);
+            memcpy(buf + sizeof(uint64_t) + SHA256_DIGEST_LENGTH, &crc, sizeof(uint32_t));
+            if(pwrite(mFile, buf, EntrySize, (off_t)height * EntrySize) != EntrySize)
+                throw std::runtime_error("Could not write journal entry.");
+        }
+
+        bool CJournal::read(uint64_t height, uint8_t* hash)
+        {
+            uint8_t buf[EntrySize];
+            if(pread(mFile, buf, EntrySize, (off_t)height * EntrySize) != EntrySize)
+                return false;
+            uint64_t entryHeight = 0;
+            uint32_t crc = 0;
+            memcpy(&entryHeight, buf, sizeof(uint64_t));
+            memcpy(&crc, buf + sizeof(uint64_t) + SHA256_DIGEST_LENGTH, sizeof(uint32_t));
+            if(entryHeight != height || crc != crc32c(buf, sizeof(uint64_t) + SHA256_DIGEST_LENGTH))
+                return false;
+            memcpy(hash, buf + sizeof(uint64_t), SHA256_DIGEST_LENGTH);
+            return true;
+        }
+
+        void CJournal::truncate(uint64_t count)
+        {
+            if(ftruncate(mFile, (off_t)count * EntrySize) != 0)
+                throw std::runtime_error("Could not truncate journal.");
+        }
+
+        void CJournal::sync()
+        {
+            if(fdatasync(mFile) != 0)
+                throw std::runtime_error("Could not sync journal.");
+        }
+
+        uint64_t CJournal::getCount()
+        {
+            struct stat info;
+            if(fstat(mFile, &info) != 0)
+                return 0;
+            return (uint64_t)info.st_size / EntrySize;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_JOURNAL_INCLUDED__
+#define __C_JOURNAL_INCLUDED__
+#include <stdint.h>
+#include <string>
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Height indexed log of saved block hashes, one fixed size entry per height.
+        // Entries past the superblock tip are the unflushed tail replayed by recovery.
+        class CJournal
+        {
+        private:
+            static const uint32_t EntrySize = sizeof(uint64_t) + SHA256_DIGEST_LENGTH + sizeof(uint32_t);
+
+            int mFile;
+        public:
+            CJournal();
+            ~CJournal();
+
+            void open(const std::string& path);
+            void close();
+
+            void write(uint64_t height, const uint8_t* hash);     // Positioned write of the entry for height
+            bool read(uint64_t height, uint8_t* hash);            // False when missing or torn
+            void truncate(uint64_t count);                        // Drop every entry from height count on
+            void sync();                                          // Entries written so far survive a power loss
+            uint64_t getCount();                                  // Number of entry slots in the file
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CScrubber.h"
+#include "CStorageLocal.h"
+#include "CBlockRecord.h"
+#include <string.h>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        CScrubber::CScrubber(CStorageLocal* storage, uint64_t rate, bool repair, uint32_t interval) : mThrottle(rate), mLog("Scrubber")
+        {
+            mStorage = storage;
+            mRepair = repair;
+            mInterval = interval;
+            mScrubbedBlocks = 0;
+            mScrubbedBytes = 0;
+            mCorruptBlocks = 0;
+            mRepairedBlocks = 0;
+            mPasses = 0;
+            pthread_mutex_init(&mLock, 0);
+            pthread_cond_init(&mCond, 0);
+            mRunning = true;
+            if(pthread_create(&mThread, 0, &static_worker, this) != 0)
+                throw std::runtime_error("Failed to start scrubber thread.");
+        }
+
+        CScrubber::~CScrubber()
+        {
+            pthread_mutex_lock(&mLock);
+            mRunning = false;
+            pthread_cond_broadcast(&mCond);
+            pthread_mutex_unlock(&mLock);
+            pthread_join(mThread, 0);
+            pthread_cond_destroy(&mCond);
+            pthread_mutex_destroy(&mLock);
+        }
+
+        void* CScrubber::static_worker(void* param)
+        {
+            ((CScrubber*)param)->worker();
+            return 0;
+        }
+
+        void CScrubber::worker()
+        {
+            if(!wait(5000000))
+                return;
+            do
+            {
+                try
+                {
+                    scrub();
+                }
+                catch(std::exception& e)
+                {
+                    mLog.errorLine(std::string("Scrub failed: ") + e.what());
+                }
+            } while(wait((uint64_t)mInterval * 1000000));
+        }
+
+        void CScrubber::scrub()
+        {
+            uint64_t height = mStorage->getDurableHeight();
+            uint64_t corrupt = 0, repaired = 0, bytes = 0;
+            uint8_t prevHash[SHA256_DIGEST_LENGTH];
+            memset(prevHash, 0, SHA256_DIGEST_LENGTH);
+            mThrottle.restart();
+
+            uint64_t n = 0;
+            for(; n < height; n++)
+            {
+                uint8_t hash[SHA256_DIGEST_LENGTH];
+                if(!wait(0))
+                    return;     // stopping
+                if(!mStorage->getBlockHash(n, hash))
+                {
+                    mLog.errorLine("No journal entry for height " + std::to_string(n) + ", stopping pass.");
+                    break;
+                }
+
+                std::string reason;
+                bool ok = check(hash, prevHash, &reason);
+                pthread_mutex_lock(&mLock);
+                mScrubbedBlocks++;
+                if(ok)
+                    mCorruptHeights.erase(n);
+                else
+                {
+                    mCorruptBlocks++;
+                    mCorruptHeights.insert(n);
+                }
+                pthread_mutex_unlock(&mLock);
+
+                if(!ok)
+                {
+                    corrupt++;
+                    mLog.errorLine("Corrupt block at height " + std::to_string(n) + " " + CStorageLocal::hashToStr(hash) + ": " + reason);
+                    if(mRepair && repair(hash, prevHash))
+                    {
+                        repaired++;
+                        pthread_mutex_lock(&mLock);
+                        mRepairedBlocks++;
+                        mCorruptHeights.erase(n);
+                        pthread_mutex_unlock(&mLock);
+                        mLog.writeLine("Repaired block at height " + std::to_string(n) + " from a peer.");
+                    }
+                }
+                memcpy(prevHash, hash, SHA256_DIGEST_LENGTH);
+            }
+
+            pthread_mutex_lock(&mLock);
+            mPasses++;
+            bytes = mScrubbedBytes;
+            pthread_mutex_unlock(&mLock);
+            mLog.writeLine("Scrub pass complete: " + std::to_string(n) + " blocks, " + std::to_string(corrupt) + " corrupt, " + std::to_string(repaired) + " repaired, " + std::to_string(bytes) + " bytes read in total.");
+        }
+
+        bool CScrubber::check(const uint8_t* hash, const uint8_t* prevHash, std::string* reason)
+        {
+            std::vector<uint8_t> buf;
+            if(!mStorage->readRecord(hash, &buf))
+            {
+                *reason = "record is missing";
+                return false;
+            }
+            pthread_mutex_lock(&mLock);
+            mScrubbedBytes += buf.size();
+            pthread_mutex_unlock(&mLock);
+            wait(mThrottle.account(buf.size()));
+
+            CBlockRecord record;
+            if(!record.decode(buf.data(), buf.size()))
+            {
+                *reason = "record checksum mismatch";
+                return false;
+            }
+            if(memcmp(record.mHash, hash, SHA256_DIGEST_LENGTH) != 0)
+            {
+                *reason = "record holds another block";
+                return false;
+            }
+            if(memcmp(record.mPrevHash, prevHash, SHA256_DIGEST_LENGTH) != 0)
+            {
+                *reason = "does not link to the block below it";
+                return false;
+            }
+            if(!mStorage->expandRecord(&record))
+            {
+                *reason = "payload chunk is missing or damaged";
+                return false;
+            }
+            try
+            {
+                CBlock block(0, hash);
+                record.toBlock(&block);
+                if(!block.isValid())
+                {
+                    *reason = "block hash mismatch";
+                    return false;
+                }
+            }
+            catch(std::exception& e)
+            {
+                *reason = "payload does not decompress";
+                return false;
+            }
+            return true;
+        }
+
+        bool CScrubber::repair(const uint8_t* hash, const uint8_t* prevHash)
+        {
+            IBlockSource* source = mStorage->getBlockSource();
+            if(!source)
+                return false;
+            CBlock block(0, hash);
+            if(!source->fetchBlock(hash, &block))
+            {
+                mLog.errorLine("No peer could provide block " + CStorageLocal::hashToStr(hash));
+                return false;
+            }
+            if(memcmp(block.getPrevHash(), prevHash, SHA256_DIGEST_LENGTH) != 0 || !block.isValid())
+            {
+                mLog.errorLine("Peer sent an invalid copy of block " + CStorageLocal::hashToStr(hash));
+                return false;
+            }
+            return mStorage->rewrite(&block);
+        }
+
+        uint64_t CScrubber::getScrubbedBlocks()
+        {
+            pthread_mutex_lock(&mLock);
+            uint64_t r = mScrubbedBlocks;
+            pthread_mutex_unlock(&mLock);
+            return r;
+        }
+
+        uint64_t CScrubber::getScrubbedBytes()
+        {
+            pthread_mutex_lock(&mLock);
+            uint64_t r = mScrubbedBytes;
+            pthread_mutex_unlock(&mLock);
+            return r;
+        }
+
+        uint64_t CScrubber::getCorruptBlocks()
+        {
+            pthread_mutex_lock(&mLock);
+            uint64_t r = mCorruptBlocks;
+            pthread_mutex_unlock(&mLock);
+            return r;
+        }
+
+        uint64_t CScrubber::getRepairedBlocks()
+        {
+            pthread_mutex_lock(&mLock);
+            uint64_t r = mRepairedBlocks;
+            pthread_mutex_unlock(&mLock);
+            return r;
+        }
+
+        uint64_t CScrubber::getPasses()
+        {
+            pthread_mutex_lock(&mLock);
+            uint64_t r = mPasses;
+            pthread_mutex_unlock(&mLock);
+            return r;
+        }
+
+        std::vector<uint64_t> CScrubber::getCorruptHeights()
+        {
+            pthread_mutex_lock(&mLock);
+            std::vector<uint64_t> heights(mCorruptHeights.begin(), mCorruptHeights.end());
+            pthread_mutex_unlock(&mLock);
+            return heights;
+        }
+
+        void CScrubber::dispose()
+        {
+            delete this;
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_SCRUBBER_INCLUDED__
+#define __C_SCRUBBER_INCLUDED__
+#include "CThrottle.h"
+#include "../CLog.h"
+#include <stdint.h>
+#include <string>
+#include <set>
+#include <vector>
+#include <pthread.h>
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        class CStorageLocal;
+
+        // Background thread that re-reads every stored block at a limited rate and checks its
+        // record checksums, its hash and the link to its parent. Damaged blocks are logged,
+        // counted and, when repair is on, fetched again from the storage block source.
+        class CScrubber
+        {
+        private:
+            CStorageLocal* mStorage;
+            CThrottle mThrottle;
+            bool mRepair;
+            uint32_t mInterval;             // Seconds between passes
+            bool mRunning;
+            pthread_t mThread;
+            pthread_mutex_t mLock;          // Guards the counters and mCorruptHeights
+            pthread_cond_t mCond;           // stop requested
+            uint64_t mScrubbedBlocks;
+            uint64_t mScrubbedBytes;
+            uint64_t mCorruptBlocks;
+            uint64_t mRepairedBlocks;
+            uint64_t mPasses;
+            std::set<uint64_t> mCorruptHeights; // Found damaged and not repaired yet
+
+            CLog mLog;
+
+            static void* static_worker(void* param);
+            void worker();
+            bool wait(uint64_t usec) { return CThrottle::sleep(&mLock, &mCond, &mRunning, usec); }     // false when stopping
+            void scrub();                   // One pass over the durable chain
+            bool check(const uint8_t* hash, const uint8_t* prevHash, std::string* reason);
+            bool repair(const uint8_t* hash, const uint8_t* prevHash);
+        public:
+            CScrubber(CStorageLocal* storage, uint64_t rate, bool repair, uint32_t interval = 3600);
+            ~CScrubber();
+
+            uint64_t getScrubbedBlocks();
+            uint64_t getScrubbedBytes();
+            uint64_t getCorruptBlocks();
+            uint64_t getRepairedBlocks();
+            uint64_t getPasses();
+            std::vector<uint64_t> getCorruptHeights();
+
+            void dispose();
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CSnapshot.h"
+#include "crc32c.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        CSnapshot::CSnapshot()
+        {
+            mFile = 0;
+            mBlockCount = 0;
+            memset(mTipHash, 0, SHA256_DIGEST_LENGTH);
+            mCursor = 0;
+            mPayloadOffset = 0;
+        }
+
+        CSnapshot::~CSnapshot()
+        {
+            if(mFile && mFile != stdin)
+                fclose(mFile);
+        }
+
+        void CSnapshot::create(const std::string& path, uint64_t blockCount, const uint8_t* tipHash)
+        {
+            mPath = path;
+            mFile = fopen((path + ".tmp").c_str(), "wb");
+            if(!mFile)
+                throw std::runtime_error("Could not create snapshot: " + path);
+            mBlockCount = blockCount;
+            memcpy(mTipHash, tipHash, SHA256_DIGEST_LENGTH);
+            mEntries.assign(blockCount * EntrySize, 0);
+            mCursor = 0;
+            mPayloadOffset = 0;
+
+            // Payloads are streamed first, header and entries are filled in by finish
+            if(fseek(mFile, HeaderSize + mEntries.size() + sizeof(uint32_t), SEEK_SET) != 0)
+                throw std::runtime_error("Could not write snapshot: " + path);
+        }
+
+        void CSnapshot::append(CBlockRecord* record)
+        {
+            if(mCursor >= mBlockCount)
+                throw std::runtime_error("Snapshot holds more blocks than announced.");
+            uint8_t* ptr = getEntry(mCursor++);
+            uint64_t createdTS = record->mCreatedTS;
+            uint32_t codec = record->mCodec;
+            memcpy(ptr, record->mHash, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            memcpy(ptr, record->mPrevHash, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            memcpy(ptr, &createdTS, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(ptr, &record->mNonce, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &record->mDataSize, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &codec, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &record->mStoredSize, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &record->mPayloadCrc, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &mPayloadOffset, sizeof(uint64_t));
+
+            if(record->mStoredSize != 0 && fwrite(record->mPayload, sizeof(uint8_t), record->mStoredSize, mFile) != record->mStoredSize)
+                throw std::runtime_error("Could not write snapshot payload.");
+            mPayloadOffset += record->mStoredSize;
+        }
+
+        void CSnapshot::finish()
+        {
+            if(mCursor != mBlockCount)
+                throw std::runtime_error("Snapshot is missing blocks.");
+            uint32_t endMarker = EndMarker;
+            if(fwrite(&endMarker, sizeof(uint32_t), 1, mFile) != 1)
+                throw std::runtime_error("Could not write snapshot end marker.");
+
+            std::vector<uint8_t> head(HeaderSize + mEntries.size() + sizeof(uint32_t));
+            uint8_t* ptr = head.data();
+            uint32_t magic = Magic, version = Version;
+            memcpy(ptr, &magic, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &version, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &mBlockCount, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(ptr, mTipHash, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            if(!mEntries.empty())
+                memcpy(ptr, mEntries.data(), mEntries.size());
+            ptr += mEntries.size();
+            uint32_t crc = crc32c(head.data(), ptr - head.data());
+            memcpy(ptr, &crc, sizeof(uint32_t));
+
+            if(fseek(mFile, 0, SEEK_SET) != 0 || fwrite(head.data(), sizeof(uint8_t), head.size(), mFile) != head.size() || fflush(mFile) != 0 || fsync(fileno(mFile)) != 0)
+                throw std::runtime_error("Could not write snapshot index.");
+            fclose(mFile);
+            mFile = 0;
+            if(rename((mPath + ".tmp").c_str(), mPath.c_str()) != 0)
+                throw std::runtime_error("Could not move snapshot into place: " + mPath);
+        }
+
+        void CSnapshot::open(const std::string& path)
+        {
+            mPath = path;
+            mFile = path == "-" ? stdin : fopen(path.c_str(), "rb");
+            if(!mFile)
+                throw std::runtime_error("Could not open snapshot: " + path);
+
+            uint8_t header[HeaderSize];
+            if(fread(header, sizeof(uint8_t), HeaderSize, mFile) != HeaderSize)
+                throw std::runtime_error("Snapshot header is truncated.");
+            uint32_t magic = 0, version = 0;
+            uint8_t* ptr = header;
+            memcpy(&magic, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&version, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&mBlockCount, ptr, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(mTipHash, ptr, SHA256_DIGEST_LENGTH);
+            if(magic != Magic || version != Version)
+                throw std::runtime_error("Not a snapshot or unsupported version: " + path);
+
+            // The checksum covers the entries too, so the count is bounded before anything is allocated for it:
+            // by the file size when there is one, else by growing the index only as entries actually arrive
+            struct stat info;
+            if(fstat(fileno(mFile), &info) == 0 && S_ISREG(info.st_mode))
+            {
+                uint64_t room = (uint64_t)info.st_size - HeaderSize;
+                if(room < sizeof(uint32_t) * 2 || mBlockCount > (room - sizeof(uint32_t) * 2) / EntrySize)
+                    throw std::runtime_error("Snapshot block count does not fit the file: " + std::to_string(mBlockCount));
+            }
+            mEntries.clear();
+            uint64_t remaining = mBlockCount;
+            while(remaining != 0)
+            {
+                size_t count = remaining < IndexSlice ? (size_t)remaining : (size_t)IndexSlice;
+                size_t start = mEntries.size();
+                mEntries.resize(start + count * EntrySize);
+                if(fread(mEntries.data() + start, sizeof(uint8_t), count * EntrySize, mFile) != count * EntrySize)
+                    throw std::runtime_error("Snapshot index is truncated.");
+                remaining -= count;
+            }
+            uint32_t crc = 0;
+            if(fread(&crc, sizeof(uint32_t), 1, mFile) != 1)
+                throw std::runtime_error("Snapshot index is truncated.");
+            uint32_t expected = crc32c(header, HeaderSize);
+            expected = crc32c(mEntries.data(), mEntries.size(), expected);
+            if(crc != expected)
+                throw std::runtime_error("Snapshot index checksum mismatch.");
+            mCursor = 0;
+            mPayloadOffset = 0;
+        }
+
+        bool CSnapshot::next(CBlockRecord* record, std::vector<uint8_t>* payload)
+        {
+            if(mCursor >= mBlockCount)
+                return false;
+            uint8_t* ptr = getEntry(mCursor++);
+            uint64_t createdTS = 0, offset = 0;
+            uint32_t codec = 0;
+            record->mVersion = CBlockRecord::Version;
+            memcpy(record->mHash, ptr, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            memcpy(record->mPrevHash, ptr, SHA256_DIGEST_LENGTH);
+            ptr += SHA256_DIGEST_LENGTH;
+            memcpy(&createdTS, ptr, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(&record->mNonce, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&record->mDataSize, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&codec, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&record->mStoredSize, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&record->mPayloadCrc, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&offset, ptr, sizeof(uint64_t));
+            if(codec >= ECT_COUNT || offset != mPayloadOffset)
+                return false;
+            record->mCreatedTS = createdTS;
+            record->mCodec = (E_CODEC_TYPE)codec;
+
+            payload->resize(record->mStoredSize);
+            if(record->mStoredSize != 0 && fread(payload->data(), sizeof(uint8_t), record->mStoredSize, mFile) != record->mStoredSize)
+                return false;
+            record->mPayload = payload->data();
+            mPayloadOffset += record->mStoredSize;
+            return true;
+        }
+
+        bool CSnapshot::isComplete()
+        {
+            uint32_t endMarker = 0;
+            return mCursor == mBlockCount && fread(&endMarker, sizeof(uint32_t), 1, mFile) == 1 && endMarker == EndMarker;
+        }
+    }
+}
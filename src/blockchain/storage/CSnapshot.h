@@ -0,0 +1,64 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_SNAPSHOT_INCLUDED__
+#define __C_SNAPSHOT_INCLUDED__
+#include "CBlockRecord.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Whole chain in one file that can be read front to back without seeking.
+        //
+        // Layout: header (magic, version, block count, tip hash), one entry per block in height order
+        // (hash, prevHash, createdTS, nonce, dataSize, codec, storedSize, payloadCrc, payload offset),
+        // crc32c of header and entries, payloads in height order, end marker.
+        class CSnapshot
+        {
+        private:
+            static const uint32_t Magic = 0x4E534342;       // "BCSN"
+            static const uint32_t Version = 1;
+            static const uint32_t EndMarker = 0x444E4553;   // "SEND"
+            static const uint32_t HeaderSize = sizeof(uint32_t) * 2 + sizeof(uint64_t) + SHA256_DIGEST_LENGTH;
+            static const uint32_t EntrySize = SHA256_DIGEST_LENGTH * 2 + sizeof(uint64_t) * 2 + sizeof(uint32_t) * 5;
+            static const uint32_t IndexSlice = 65536;       // Entries read at a time from a stream
+
+            std::string mPath;
+            FILE* mFile;
+            uint64_t mBlockCount;
+            uint8_t mTipHash[SHA256_DIGEST_LENGTH];
+            std::vector<uint8_t> mEntries;      // Encoded entries
+            uint64_t mCursor;                   // Next entry to append or read
+            uint64_t mPayloadOffset;            // Offset of the next payload from the start of the payload area
+
+            uint8_t* getEntry(uint64_t index) { return mEntries.data() + index * EntrySize; }
+        public:
+            CSnapshot();
+            ~CSnapshot();
+
+            void create(const std::string& path, uint64_t blockCount, const uint8_t* tipHash);    // Written to path.tmp until finish
+            void append(CBlockRecord* record);  // Next block in height order
+            void finish();                      // Write entries, sync and rename into place
+
+            void open(const std::string& path); // Read and check header and entries, "-" reads stdin
+            bool next(CBlockRecord* record, std::vector<uint8_t>* payload);    // Next block in height order, record payload points into payload
+            bool isComplete();                  // Every payload read and the end marker is present
+
+            uint64_t getBlockCount() { return mBlockCount; }
+            const uint8_t* getTipHash() { return mTipHash; }
+        };
+    }
+}
+
+#endif
@@ -7,16 +7,35 @@
  * in the source distribution.
 */
 #include "CStorageLocal.h"
+#include "storage.h"
+#include "crc32c.h"
+#include "../CPayloadCache.h"
+#include "../CBloomFilter.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
 #include <string.h>
 #include <stdexcept>
+#include <algorithm>
 
 namespace blockchain
 {
     namespace storage
     {
         std::string CStorageLocal::mDefaultBasePath("data/");
+        E_CODEC_TYPE CStorageLocal::mDefaultCodec(ECT_NONE);
+        uint32_t CStorageLocal::mDefaultCompressAge(0);
+        bool CStorageLocal::mDefaultDirectIO(false);
+        std::string CStorageLocal::mDefaultArchivePath;
+        uint32_t CStorageLocal::mDefaultArchiveAge(0);
+        uint32_t CStorageLocal::mDefaultArchiveSpan(1024);
+        uint64_t CStorageLocal::mDefaultArchiveRate(0);
+        uint64_t CStorageLocal::mDefaultScrubRate(0);
+        bool CStorageLocal::mDefaultScrubRepair(false);
+        bool CStorageLocal::mDefaultDedup(false);
 
         void CStorageLocal::setDefaultBasePath(const std::string& path)
         {
@@ -25,29 +44,115 @@ namespace blockchain
                 mDefaultBasePath.push_back('/');
         }
 
-        CStorageLocal::CStorageLocal() : mLog("Storage"), mBasePath(mDefaultBasePath)
+        void CStorageLocal::setDefaultDirectIO(bool directIO)
+        {
+            mDefaultDirectIO = directIO;
+        }
+
+        void CStorageLocal::setDefaultCompression(E_CODEC_TYPE codec, uint32_t minAge)
+        {
+            mDefaultCodec = codec;
+            mDefaultCompressAge = minAge;
+        }
+
+        void CStorageLocal::setDefaultArchivePath(const std::string& path)
+        {
+            mDefaultArchivePath = path;
+            if(path.size() > 1 && path[path.size()-1] != '/')
+                mDefaultArchivePath.push_back('/');
+        }
+
+        void CStorageLocal::setDefaultArchiving(uint32_t age, uint32_t span, uint64_t rate)
+        {
+            mDefaultArchiveAge = age;
+            mDefaultArchiveSpan = span;
+            mDefaultArchiveRate = rate;
+        }
+
+        void CStorageLocal::setDefaultScrubbing(uint64_t rate, bool repair)
+        {
+            mDefaultScrubRate = rate;
+            mDefaultScrubRepair = repair;
+        }
+
+        void CStorageLocal::setDefaultDedup(bool dedup)
+        {
+            mDefaultDedup = dedup;
+        }
+
+        CStorageLocal::CStorageLocal() : mBasePath(mDefaultBasePath), mArchivePath(mDefaultArchivePath.empty() ? mDefaultBasePath : mDefaultArchivePath), mLog("Storage")
         {
             struct stat info;
             if(stat(mBasePath.c_str(), &info) != 0 || !(info.st_mode & S_IFDIR))
+                mkdir(mBasePath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);   // create the directory
+            if(stat(mArchivePath.c_str(), &info) != 0 || !(info.st_mode & S_IFDIR))
+                mkdir(mArchivePath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+            mUncheckpointed = 0;
+            mCheckpointInterval = 1;
+            mCodec = mDefaultCodec;
+            mCompressAge = mDefaultCompressAge;
+            mDirectIO = mDefaultDirectIO;
+            pthread_mutex_init(&mTipLock, 0);
+            pthread_mutex_init(&mArchiveLock, 0);
+            mCompactor = 0;
+            mScrubber = 0;
+            mBlockSource = 0;
+            mChunks = mDefaultDedup ? new CChunkStore(mBasePath + "chunks/", mCodec) : 0;
+            mIO = createAsyncIO();
+            mLog.writeLine(std::string("Async I/O engine: ") + mIO->getName() + (crc32cIsAccelerated() ? ", CRC32C: hardware" : ", CRC32C: software"));
+            mJournal.open(mBasePath + "journal");
+            mSuperBlock.open(mBasePath + "superblock");
+            if(mSuperBlock.isEmpty())
             {
-                int status = mkdir(mBasePath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);   // create the directory
+                // Migrate the tip from the old metadata file if there is one
+                std::map<std::string, std::basic_string<uint8_t>> metaData;
+                loadMetaData(&metaData);
+                if(metaData.count("LAST_BLOCK_HASH") != 0 && metaData.count("BLOCK_COUNT") != 0)
+                {
+                    uint64_t blockCount = 0;
+                    memcpy(&blockCount, metaData["BLOCK_COUNT"].data(), sizeof(uint64_t));
+                    mSuperBlock.write(metaData["LAST_BLOCK_HASH"].data(), blockCount);
+                    mLog.writeLine("Migrated metadata to superblock.");
+                }
             }
 
-            loadMetaData();         // attempt to load the metadata
+            loadArchives(mBasePath);
+            if(mArchivePath != mBasePath)
+                loadArchives(mArchivePath);
         }
 
         CStorageLocal::~CStorageLocal()
-        {            
+        {
+            if(mScrubber)
+                mScrubber->dispose();
+            if(mCompactor)
+                mCompactor->dispose();
+            mIO->dispose();     // waits for queued saves
+            if(mChunks)
+            {
+                mChunks->logStats();
+                delete mChunks;
+            }
+            for(std::vector<CArchive*>::iterator it = mArchives.begin(); it != mArchives.end(); ++it)
+                delete *it;
+            pthread_mutex_destroy(&mArchiveLock);
+            pthread_mutex_destroy(&mTipLock);
         }
 
-        void CStorageLocal::loadChain(std::vector<CBlock*>* chain)
+        void CStorageLocal::loadChain(std::vector<CBlock*>* chain, CPayloadCache* cache)
         {
-            if(mMetaData.count("LAST_BLOCK_HASH") != 0)
+            recover();
+
+            if(mSuperBlock.getHeight() != 0)
             {
                 chain->clear();
 
-                CBlock* block = new CBlock(0, mMetaData["LAST_BLOCK_HASH"].data());
-                load(block);
+                // Pruned nodes read only the headers, the cache loads payloads when they are used
+                CBlock* block = new CBlock(0, mSuperBlock.getTipHash());
+                cache ? loadHeader(block) : load(block);
+                if(cache)
+                    cache->add(block, 0, false);
                 chain->push_back(block);
                 CBlock* cur = block;
 
@@ -55,109 +160,837 @@ namespace blockchain
                 while(cur->hasPrevHash())
                 {
                     block = new CBlock(0, cur->getPrevHash());
-                    load(block);
+                    cache ? loadHeader(block) : load(block);
+                    if(cache)
+                        cache->add(block, 0, false);   // loading walks back from the tip, older blocks go to the cold end
                     cur->setPrevBlock(block);
                     chain->insert(chain->begin(), block);
                     cur = block;
                 }
 
-                uint64_t chainSize = 0;
-                memcpy(&chainSize, mMetaData["BLOCK_COUNT"].data(), sizeof(uint64_t));
-                if(chain->size() != chainSize)
+                if(chain->size() != mSuperBlock.getHeight())
                     throw std::runtime_error("Manifest: Chain size does not match BLOCK_COUNT.");
             }
+
+            if(mDefaultArchiveAge != 0 && !mCompactor)
+            {
+                uint64_t nextHeight = 0;
+                pthread_mutex_lock(&mArchiveLock);
+                for(std::vector<CArchive*>::iterator it = mArchives.begin(); it != mArchives.end(); ++it)
+                    nextHeight = std::max(nextHeight, (*it)->getLastHeight() + 1);
+                pthread_mutex_unlock(&mArchiveLock);
+                mCompactor = new CCompactor(this, mDefaultArchiveAge, mDefaultArchiveSpan, mDefaultArchiveRate, nextHeight);
+            }
+            if(mDefaultScrubRate != 0 && !mScrubber)
+                mScrubber = new CScrubber(this, mDefaultScrubRate, mDefaultScrubRepair);
         }
 
         void CStorageLocal::load(CBlock* block)
+        {
+            std::vector<uint8_t> buf;
+            CBlockRecord record;
+            if(!readRecord(block->getHash(), &buf))
+                throw std::runtime_error("Block file not found.");
+            if(!record.decode(buf.data(), buf.size()) || memcmp(record.mHash, block->getHash(), SHA256_DIGEST_LENGTH) != 0 || !expandRecord(&record))
+                throw std::runtime_error("Block record is corrupt: " + block->getHashStr());
+            record.toBlock(block);
+        }
+
+        void CStorageLocal::loadHeader(CBlock* block)
+        {
+            uint64_t start = 0, size = 0;
+            CBlockRecord record;
+            int file = openRecord(block->getHash(), &start, &size);
+            if(file < 0)
+                throw std::runtime_error("Block file not found.");
+            bool ok = readRecordHeader(file, start, size, block->getHash(), &record);
+            close(file);
+            if(!ok)
+                throw std::runtime_error("Block record is corrupt: " + block->getHashStr());
+            block->setPrevHash(record.mPrevHash);
+            block->setCreatedTS(record.mCreatedTS);
+            block->setNonce(record.mNonce);
+            block->setAllocatedData(0, record.mDataSize);
+            block->evictData();
+        }
+
+        void CStorageLocal::save(CBlock* block, uint64_t blockCount)
+        {
+            CIORequest* request = saveAsync(block, blockCount);
+            int result = request->wait();
+            request->drop();
+            if(result < 0)
+                throw std::runtime_error("Could not write block record: " + std::string(strerror(-result)));
+        }
+
+        CIORequest* CStorageLocal::saveAsync(CBlock* block, uint64_t blockCount)
+        {
+            // Encoding and compression happen here, only the disk work is queued, new chunks ahead of the record
+            CBlockRecord record;
+            CSaveRequest* request = new CSaveRequest(this, block->getHash(), blockCount);
+            encodeRecord(block, &record, mCompressAge == 0 ? mCodec : ECT_NONE, false, &request->mChunkWrites);
+            request->mChunkWrites.queue(request);
+            if(prepareRecordWrite(mBasePath + block->getHashStr(), &record, request))
+            {
+                pthread_mutex_lock(&mTipLock);
+                mSavesInFlight.insert(blockCount);
+                pthread_mutex_unlock(&mTipLock);
+                mIO->submit(request);
+            }
+
+            // Compress the block that just became old enough, chunks are compressed when written
+            if(mCodec != ECT_NONE && mCompressAge != 0 && !mChunks)
+            {
+                CBlock* old = block;
+                for(uint32_t n = 0; n < mCompressAge && old; n++)
+                    old = old->getPrevBlock();
+                if(old)
+                    repack(old);
+            }
+            return request;
+        }
+
+        CIORequest* CStorageLocal::loadAsync(CBlock* block)
+        {
+            CLoadRequest* request = new CLoadRequest(this, block);
+            request->mFd = open((mBasePath + block->getHashStr()).c_str(), O_RDONLY);
+            struct stat info;
+            if(request->mFd < 0 && errno == ENOENT)
+            {
+                // Archived, read the record out of the archive file which stays open
+                int file = -1;
+                uint64_t offset = 0;
+                uint32_t size = 0;
+                if(!findArchived(block->getHash(), &file, &offset, &size))
+                {
+                    request->complete(-ENOENT);
+                    return request;
+                }
+                uint8_t* buf = mIO->allocBuffer(request, size);
+                request->addRead(file, buf, size, offset);
+                mIO->submit(request);
+                return request;
+            }
+            if(request->mFd < 0 || fstat(request->mFd, &info) != 0)
+            {
+                request->complete(-errno);
+                return request;
+            }
+            uint8_t* buf = mIO->allocBuffer(request, info.st_size);
+            request->addRead(request->mFd, buf, info.st_size, 0);
+            mIO->submit(request);
+            return request;
+        }
+
+        bool CStorageLocal::prepareRecordWrite(const std::string& path, CBlockRecord* record, CFileRequest* request)
+        {
+            bool direct = mDirectIO;
+            request->mFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if(request->mFd < 0 && direct)
+            {
+                direct = false;     // file system without O_DIRECT support
+                request->mFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            }
+            if(request->mFd < 0)
+            {
+                request->complete(-errno);
+                return false;
+            }
+
+            // O_DIRECT writes whole aligned blocks, decoding ignores the zero padding
+            uint32_t size = record->getEncodedSize();
+            if(direct)
+                size = (size + IAsyncIO::BufferAlignment - 1) / IAsyncIO::BufferAlignment * IAsyncIO::BufferAlignment;
+            uint8_t* buf = mIO->allocBuffer(request, size);
+            record->encode(buf);
+            request->addWrite(request->mFd, buf, size, 0);
+            request->addSync(request->mFd);     // block must be durable before the tip points at it
+            return true;
+        }
+
+        void CStorageLocal::repack(CBlock* block)
         {
             std::string path(mBasePath + block->getHashStr());
+            struct stat info;
+            if(stat(path.c_str(), &info) != 0)
+                return;
+
+            CBlockRecord record;
+            record.fromBlock(block, mCodec);
+            if(record.mCodec == ECT_NONE)
+                return;     // does not compress, keep it raw
+
+            // Replace through a rename so a crash leaves either the old or the new record
+            CRepackRequest* request = new CRepackRequest(path);
+            if(prepareRecordWrite(request->mTmpPath, &record, request))
+                mIO->submit(request);
+            request->drop();
+        }
+
+        void CStorageLocal::onSaved(CSaveRequest* request)
+        {
+            // Runs on the I/O completion thread, nothing may escape it
+            pthread_mutex_lock(&mTipLock);
+            mSavesInFlight.erase(request->mBlockCount);
+            std::string error(request->mResult == 0 ? "" : strerror(-request->mResult));
+            if(error.empty())
+            {
+                try
+                {
+                    mJournal.write(request->mBlockCount - 1, request->mHash);
+                }
+                catch(std::runtime_error& e)
+                {
+                    error = e.what();
+                }
+            }
+            if(error.empty())
+            {
+                mSavedTips[request->mBlockCount] = std::vector<uint8_t>(request->mHash, request->mHash + SHA256_DIGEST_LENGTH);
+                mFailedSaves.erase(request->mBlockCount);      // saved again
+                mUncheckpointed++;
+            }
+            else
+            {
+                mFailedSaves.insert(request->mBlockCount);
+                mLog.errorLine("Could not save block: " + hashToStr(request->mHash) + " " + error + ", superblock held below height " + std::to_string(request->mBlockCount));
+            }
+
+            // Newest completed save with no older save still in flight or failed
+            uint64_t oldest = 0;
+            if(!mSavesInFlight.empty())
+                oldest = *mSavesInFlight.begin();
+            if(!mFailedSaves.empty() && (oldest == 0 || *mFailedSaves.begin() < oldest))
+                oldest = *mFailedSaves.begin();
+            std::map<uint64_t, std::vector<uint8_t>>::iterator tip = oldest == 0 ? mSavedTips.end() : mSavedTips.lower_bound(oldest);
+            if(tip != mSavedTips.begin() && mUncheckpointed >= mCheckpointInterval)
+            {
+                --tip;
+                try
+                {
+                    mJournal.sync();    // the entries below the new tip must outlive it
+                    mSuperBlock.write(tip->second.data(), tip->first);
+                    mSavedTips.erase(mSavedTips.begin(), ++tip);
+                    mUncheckpointed = 0;
+                }
+                catch(std::runtime_error& e)
+                {
+                    mLog.errorLine(std::string("Could not checkpoint, retrying on the next save: ") + e.what());
+                }
+            }
+            pthread_mutex_unlock(&mTipLock);
+        }
+
+        void CStorageLocal::CFileRequest::onComplete()
+        {
+            if(mFd >= 0)
+                close(mFd);
+            mFd = -1;
+        }
+
+        void CStorageLocal::CSaveRequest::onComplete()
+        {
+            CFileRequest::onComplete();
+            if(mStorage->mChunks && !mStorage->mChunks->commit(&mChunkWrites, mResult == 0) && mResult == 0)
+                mResult = -EIO;     // the record refers to chunks that are not durable
+            mStorage->onSaved(this);
+        }
+
+        void CStorageLocal::CRepackRequest::onComplete()
+        {
+            CFileRequest::onComplete();
+            if(mResult != 0 || rename(mTmpPath.c_str(), mPath.c_str()) != 0)
+                unlink(mTmpPath.c_str());
+        }
+
+        void CStorageLocal::CLoadRequest::onComplete()
+        {
+            CFileRequest::onComplete();
+            if(mResult != 0)
+                return;
+            CBlockRecord record;
+            if(!record.decode(mBuffer, mBufferSize) || memcmp(record.mHash, mBlock->getHash(), SHA256_DIGEST_LENGTH) != 0 || !mStorage->expandRecord(&record))
+                mResult = -EIO;
+            else
+                record.toBlock(mBlock);
+        }
+
+        void CStorageLocal::setCompression(E_CODEC_TYPE codec, uint32_t minAge)
+        {
+            mCodec = codec;
+            mCompressAge = minAge;
+            if(mChunks)
+                mChunks->setCodec(codec);
+        }
+
+        void CStorageLocal::encodeRecord(CBlock* block, CBlockRecord* record, E_CODEC_TYPE codec, bool repair, CChunkStore::CWrites* writes)
+        {
+            record->fromBlock(block);
+            if(!mChunks || !mChunks->store(record, repair, writes))
+                record->compress(codec);
+        }
+
+        bool CStorageLocal::expandRecord(CBlockRecord* record)
+        {
+            if(record->mCodec != ECT_CHUNKS)
+                return true;
+            if(mChunks)
+                return mChunks->expand(record);
+            CChunkStore chunks(mBasePath + "chunks/");  // written with deduplication on, read with it off
+            return chunks.expand(record);
+        }
+
+        CChunkStore* CStorageLocal::getChunkStore()
+        {
+            return mChunks;
+        }
+
+        bool CStorageLocal::readFile(const std::string& path, std::vector<uint8_t>* buf)
+        {
             FILE* file = fopen(path.c_str(), "rb");
-            if(file)
+            if(!file)
+                return false;
+            struct stat info;
+            if(fstat(fileno(file), &info) != 0)
             {
-                size_t r;
-                uint32_t version = 0;
-                r = fread(&version, sizeof(uint32_t), 1, file);
-                if(r != 1)
-                    throw std::runtime_error("Could not read version.");
+                fclose(file);
+                return false;
+            }
+            buf->resize(info.st_size);
+            size_t r = fread(buf->data(), sizeof(uint8_t), buf->size(), file);
+            fclose(file);
+            buf->resize(r);
+            return true;
+        }
 
-                //todo: check version
+        bool CStorageLocal::readRecord(const uint8_t* hash, std::vector<uint8_t>* buf)
+        {
+            if(readFile(mBasePath + hashToStr(hash), buf))
+                return true;
+            int file = -1;
+            uint64_t offset = 0;
+            uint32_t size = 0;
+            if(!findArchived(hash, &file, &offset, &size))
+                return false;
+            buf->resize(size);
+            return pread(file, buf->data(), size, offset) == (ssize_t)size;
+        }
+
+        int CStorageLocal::openRecord(const uint8_t* hash, uint64_t* start, uint64_t* size)
+        {
+            // Block file first like readRecord, archives are shared so their descriptor is duplicated
+            struct stat info;
+            *start = 0;
+            int file = open((mBasePath + hashToStr(hash)).c_str(), O_RDONLY);
+            if(file >= 0 && fstat(file, &info) == 0)
+            {
+                *size = info.st_size;
+                return file;
+            }
+            if(file >= 0)
+                close(file);
+            int archive = -1;
+            uint32_t archivedSize = 0;
+            if(!findArchived(hash, &archive, start, &archivedSize) || (file = dup(archive)) < 0)
+                return -1;
+            *size = archivedSize;
+            return file;
+        }
+
+        bool CStorageLocal::readRecordHeader(int file, uint64_t start, uint64_t size, const uint8_t* hash, CBlockRecord* record)
+        {
+            std::vector<uint8_t> header(CBlockRecord::getHeaderSize(CBlockRecord::Version));
+            ssize_t r = pread(file, header.data(), header.size() < size ? header.size() : size, start);
+            return r >= 0 && record->decodeHeader(header.data(), r) && memcmp(record->mHash, hash, SHA256_DIGEST_LENGTH) == 0
+                   && size >= CBlockRecord::getHeaderSize(record->mVersion) + (uint64_t)record->mStoredSize + CBlockRecord::getTrailerSize(record->mVersion);
+        }
+
+        int CStorageLocal::openPayload(const uint8_t* hash, uint64_t* offset, uint32_t* size, uint32_t* crc)
+        {
+            uint64_t start = 0;
+            uint64_t recordSize = 0;
+            CBlockRecord record;
+            int file = openRecord(hash, &start, &recordSize);
+            if(file < 0)
+                return -1;
+            if(!readRecordHeader(file, start, recordSize, hash, &record) || record.mVersion < 2 || record.mCodec != ECT_NONE)
+            {
+                close(file);
+                return -1;
+            }
+            *offset = start + CBlockRecord::getHeaderSize(record.mVersion);
+            *size = record.mDataSize;
+            *crc = record.mPayloadCrc;
+            return file;
+        }
+
+        bool CStorageLocal::findArchived(const uint8_t* hash, int* file, uint64_t* offset, uint32_t* size)
+        {
+            bool found = false;
+            pthread_mutex_lock(&mArchiveLock);
+            for(std::vector<CArchive*>::iterator it = mArchives.begin(); it != mArchives.end() && !found; ++it)
+            {
+                if((*it)->find(hash, offset, size))
+                {
+                    *file = (*it)->getFile();
+                    found = true;
+                }
+            }
+            pthread_mutex_unlock(&mArchiveLock);
+            return found;
+        }
+
+        void CStorageLocal::loadArchives(const std::string& path)
+        {
+            DIR* dir = opendir(path.c_str());
+            if(!dir)
+                return;
+            struct dirent* entry;
+            while((entry = readdir(dir)) != 0)
+            {
+                std::string name(entry->d_name);
+                if(name.compare(0, 8, "archive-") == 0 && name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0)
+                {
+                    unlink((path + name).c_str());     // compaction interrupted before the rename
+                    continue;
+                }
+                if(!CArchive::isArchiveName(name))
+                    continue;
+                CArchive* archive = new CArchive();
+                if(archive->open(path + name))
+                    mArchives.push_back(archive);
+                else
+                {
+                    mLog.errorLine("Ignoring damaged archive: " + path + name);
+                    delete archive;
+                }
+            }
+            closedir(dir);
+        }
+
+        uint64_t CStorageLocal::getDurableHeight()
+        {
+            pthread_mutex_lock(&mTipLock);
+            uint64_t height = mSuperBlock.getHeight();
+            pthread_mutex_unlock(&mTipLock);
+            return height;
+        }
+
+        bool CStorageLocal::getBlockHash(uint64_t height, uint8_t* hash)
+        {
+            pthread_mutex_lock(&mTipLock);
+            bool found = mJournal.read(height, hash);
+            pthread_mutex_unlock(&mTipLock);
+            return found;
+        }
+
+        bool CStorageLocal::rewrite(CBlock* block)
+        {
+            // A single file shadows a damaged archived copy, readRecord looks at files first
+            CBlockRecord record;
+            encodeRecord(block, &record, mCodec, true);     // chunks it shares may be the damaged part
+            CRepackRequest* request = new CRepackRequest(mBasePath + block->getHashStr());
+            if(prepareRecordWrite(request->mTmpPath, &record, request))
+                mIO->submit(request);
+            int result = request->wait();
+            request->drop();
+            return result == 0;
+        }
+
+        void CStorageLocal::setBlockSource(IBlockSource* source)
+        {
+            mBlockSource = source;
+        }
+
+        IBlockSource* CStorageLocal::getBlockSource()
+        {
+            return mBlockSource;
+        }
+
+        CScrubber* CStorageLocal::getScrubber()
+        {
+            return mScrubber;
+        }
+
+        bool CStorageLocal::compact(uint64_t firstHeight, uint64_t lastHeight, CCompactor* compactor)
+        {
+            // Archives are compressed even when hot blocks are not, they are rarely read
+            E_CODEC_TYPE codec = mCodec == ECT_NONE ? ECT_DEFLATE : mCodec;
+            std::string name(CArchive::getFileName(firstHeight, lastHeight));
+            std::string tmpPath(mArchivePath + name + ".tmp");
+            CArchive* archive = new CArchive();
+            archive->create(tmpPath, firstHeight, lastHeight);
+
+            std::vector<std::string> merged;
+            std::vector<uint8_t> buf, out;
+            uint64_t rawBytes = 0, archivedBytes = 0;
+            for(uint64_t height = firstHeight; height <= lastHeight; height++)
+            {
+                if(!compactor->isRunning())
+                {
+                    delete archive;
+                    unlink(tmpPath.c_str());
+                    return false;
+                }
 
                 uint8_t hash[SHA256_DIGEST_LENGTH];
-                r = fread(hash, sizeof(uint8_t), SHA256_DIGEST_LENGTH, file);
-                if(r != SHA256_DIGEST_LENGTH)
-                    throw std::runtime_error("Could not read hash.");
+                pthread_mutex_lock(&mTipLock);
+                bool known = mJournal.read(height, hash);
+                pthread_mutex_unlock(&mTipLock);
+                std::string path(mBasePath + hashToStr(hash));
+                if(!known || !readFile(path, &buf))
+                    continue;       // never saved here or already archived
 
-                uint8_t prevHash[SHA256_DIGEST_LENGTH];
-                r = fread(prevHash, sizeof(uint8_t), SHA256_DIGEST_LENGTH, file);
-                if(r != SHA256_DIGEST_LENGTH)
-                    throw std::runtime_error("Could not read prevHash.");
+                CBlockRecord record;
+                if(!record.decode(buf.data(), buf.size()) || memcmp(record.mHash, hash, SHA256_DIGEST_LENGTH) != 0)
+                {
+                    mLog.errorLine("Not archiving damaged block record: " + hashToStr(hash));
+                    continue;
+                }
+                record.compress(codec);
+                out.clear();
+                record.encode(&out);
+                archive->append(hash, out.data(), out.size());
+                merged.push_back(path);
+                rawBytes += buf.size();
+                archivedBytes += out.size();
+                compactor->throttle(buf.size() + out.size());
+            }
+
+            try
+            {
+                archive->finish(mArchivePath + name);
+            }
+            catch(std::exception& e)
+            {
+                delete archive;
+                unlink(tmpPath.c_str());
+                throw;
+            }
 
-                block->setPrevHash(prevHash);
+            // finish() synced the archive and its directory entry, so it is durable before the single files go away
+            pthread_mutex_lock(&mArchiveLock);
+            mArchives.push_back(archive);
+            pthread_mutex_unlock(&mArchiveLock);
+            for(std::vector<std::string>::iterator it = merged.begin(); it != merged.end(); ++it)
+                unlink(it->c_str());
 
-                time_t createdTS = 0;
-                r = fread(&createdTS, sizeof(time_t), 1, file);
-                if(r != 1)
-                    throw std::runtime_error("Could not read createdTS.");
+            mLog.writeLine("Archived heights " + std::to_string(firstHeight) + "-" + std::to_string(lastHeight) + ": " + std::to_string(merged.size()) + " blocks, " + std::to_string(rawBytes) + " -> " + std::to_string(archivedBytes) + " bytes.");
+            return true;
+        }
 
-                block->setCreatedTS(createdTS);
+        void CStorageLocal::exportSnapshot(const std::string& path)
+        {
+            pthread_mutex_lock(&mTipLock);
+            uint64_t height = mSuperBlock.getHeight();
+            uint8_t tip[SHA256_DIGEST_LENGTH];
+            memcpy(tip, mSuperBlock.getTipHash(), SHA256_DIGEST_LENGTH);
 
-                uint32_t nonce = 0;
-                r = fread(&nonce, sizeof(uint32_t), 1, file);
-                if(r != 1)
-                    throw std::runtime_error("Could not read nonce.");
+            // Block hashes in height order from the journal, chains older than the journal walk back from the tip
+            std::vector<uint8_t> hashes(height * SHA256_DIGEST_LENGTH);
+            bool journaled = true;
+            for(uint64_t n = 0; n < height && journaled; n++)
+                journaled = mJournal.read(n, hashes.data() + n * SHA256_DIGEST_LENGTH);
+            pthread_mutex_unlock(&mTipLock);
+            if(height != 0 && (!journaled || memcmp(hashes.data() + (height - 1) * SHA256_DIGEST_LENGTH, tip, SHA256_DIGEST_LENGTH) != 0))
+            {
+                uint8_t cur[SHA256_DIGEST_LENGTH];
+                memcpy(cur, tip, SHA256_DIGEST_LENGTH);
+                for(uint64_t n = height; n > 0; n--)
+                {
+                    memcpy(hashes.data() + (n - 1) * SHA256_DIGEST_LENGTH, cur, SHA256_DIGEST_LENGTH);
+                    if(!verifyRecord(cur, cur))
+                        throw std::runtime_error("Block record is missing or corrupt: " + hashToStr(cur));
+                }
+            }
 
-                block->setNonce(nonce);
+            CSnapshot snapshot;
+            snapshot.create(path, height, tip);
+            std::vector<uint8_t> buf;
+            uint64_t bytes = 0;
+            for(uint64_t n = 0; n < height; n++)
+            {
+                const uint8_t* hash = hashes.data() + n * SHA256_DIGEST_LENGTH;
+                CBlockRecord record;
+                if(!readRecord(hash, &buf) || !record.decode(buf.data(), buf.size()) || memcmp(record.mHash, hash, SHA256_DIGEST_LENGTH) != 0)
+                    throw std::runtime_error("Block record is missing or corrupt: " + hashToStr(hash));
+                if(record.mCodec == ECT_CHUNKS)
+                {
+                    // Snapshots are self contained, chunked payloads go in whole
+                    if(!expandRecord(&record))
+                        throw std::runtime_error("Block chunks are missing or corrupt: " + hashToStr(hash));
+                    record.compress(mCodec);
+                }
+                snapshot.append(&record);
+                bytes += record.mStoredSize;
+            }
+            snapshot.finish();
+            mLog.writeLine("Exported snapshot " + path + ": " + std::to_string(height) + " blocks, " + std::to_string(bytes) + " payload bytes.");
+        }
 
-                uint32_t dataSize = 0; 
-                r = fread(&dataSize, sizeof(uint32_t), 1, file);
-                if(r != 1)
-                    throw std::runtime_error("Could not read dataSize.");
+        void CStorageLocal::importSnapshot(const std::string& path, uint32_t threads)
+        {
+            if(mSuperBlock.getHeight() != 0)
+                throw std::runtime_error("Snapshots can only be imported into empty storage.");
+            if(threads == 0)
+            {
+                long cores = sysconf(_SC_NPROCESSORS_ONLN);
+                threads = cores > 0 ? (uint32_t)cores : 1;
+            }
+
+            CSnapshot snapshot;
+            snapshot.open(path);
+            mLog.writeLine("Importing snapshot " + path + ": " + std::to_string(snapshot.getBlockCount()) + " blocks, " + std::to_string(threads) + " verifier threads.");
+
+            CImport import;
+            import.mStorage = this;
+            import.mDone = false;
+            import.mFailed = false;
+            pthread_mutex_init(&import.mLock, 0);
+            pthread_cond_init(&import.mCond, 0);
+            std::vector<pthread_t> workers;
+            for(uint32_t n = 0; n < threads; n++)
+            {
+                pthread_t thread;
+                if(pthread_create(&thread, 0, &static_importer, &import) == 0)
+                    workers.push_back(thread);
+            }
+            if(workers.empty())
+                throw std::runtime_error("Failed to start snapshot import threads.");
 
-                uint8_t* data = new uint8_t[dataSize];
-                uint8_t* ptr = data;
-                for(uint32_t n = 0; n < dataSize; n += mChunkSize)
+            // Read sequentially, check links here and leave checksums and hashes to the workers
+            std::vector<uint8_t> hashes;
+            uint8_t prevHash[SHA256_DIGEST_LENGTH];
+            memset(prevHash, 0, SHA256_DIGEST_LENGTH);
+            std::string error;
+            while(error.empty())
+            {
+                CImportJob* job = new CImportJob();
+                if(!snapshot.next(&job->mRecord, &job->mPayload))
                 {
-                    r = fread(ptr, sizeof(uint8_t), mChunkSize, file);
-                    if(r == 0)
-                        throw std::runtime_error("Could not read data chunk.");
-                    ptr += r;
+                    delete job;
+                    if(hashes.size() != snapshot.getBlockCount() * SHA256_DIGEST_LENGTH || !snapshot.isComplete())
+                        error = "Snapshot is truncated.";
+                    break;
                 }
+                if(memcmp(job->mRecord.mPrevHash, prevHash, SHA256_DIGEST_LENGTH) != 0)
+                    error = "Snapshot block does not link to its parent: " + hashToStr(job->mRecord.mHash);
+                memcpy(prevHash, job->mRecord.mHash, SHA256_DIGEST_LENGTH);
+                hashes.insert(hashes.end(), prevHash, prevHash + SHA256_DIGEST_LENGTH);
 
-                block->setAllocatedData(data, dataSize);
+                pthread_mutex_lock(&import.mLock);
+                while(!import.mFailed && import.mJobs.size() >= threads * 4)
+                    pthread_cond_wait(&import.mCond, &import.mLock);
+                if(import.mFailed)
+                    error = import.mError;
+                import.mJobs.push(job);
+                pthread_cond_broadcast(&import.mCond);
+                pthread_mutex_unlock(&import.mLock);
+            }
+            if(error.empty() && snapshot.getBlockCount() != 0 && memcmp(prevHash, snapshot.getTipHash(), SHA256_DIGEST_LENGTH) != 0)
+                error = "Snapshot tip does not match its last block.";
 
-                fclose(file);
+            pthread_mutex_lock(&import.mLock);
+            import.mDone = true;
+            pthread_cond_broadcast(&import.mCond);
+            pthread_mutex_unlock(&import.mLock);
+            for(std::vector<pthread_t>::iterator it = workers.begin(); it != workers.end(); ++it)
+                pthread_join(*it, 0);
+            if(error.empty() && import.mFailed)
+                error = import.mError;
+            while(!import.mJobs.empty())
+            {
+                delete import.mJobs.front();
+                import.mJobs.pop();
             }
-            else
-                throw std::runtime_error("Block file not found.");
+            pthread_cond_destroy(&import.mCond);
+            pthread_mutex_destroy(&import.mLock);
+
+            uint64_t count = hashes.size() / SHA256_DIGEST_LENGTH;
+            if(!error.empty())
+            {
+                for(uint64_t n = 0; n < count; n++)
+                    unlink((mBasePath + hashToStr(hashes.data() + n * SHA256_DIGEST_LENGTH)).c_str());
+                throw std::runtime_error(error);
+            }
+
+            // Records were written without syncing, make them durable once before the tip points at them
+            int dir = open(mBasePath.c_str(), O_RDONLY | O_DIRECTORY);
+            if(dir < 0 || syncfs(dir) != 0)
+            {
+                if(dir >= 0)
+                    close(dir);
+                throw std::runtime_error("Could not sync imported blocks.");
+            }
+            close(dir);
+
+            pthread_mutex_lock(&mTipLock);
+            for(uint64_t n = 0; n < count; n++)
+                mJournal.write(n, hashes.data() + n * SHA256_DIGEST_LENGTH);
+            if(count != 0)
+            {
+                mJournal.sync();
+                mSuperBlock.write(snapshot.getTipHash(), count);
+            }
+            pthread_mutex_unlock(&mTipLock);
+            mLog.writeLine("Imported " + std::to_string(count) + " blocks.");
         }
 
-        void CStorageLocal::save(CBlock* block, uint64_t blockCount)
+        void* CStorageLocal::static_importer(void* param)
         {
-            std::string path(mBasePath + block->getHashStr());
-            FILE* file = fopen(path.c_str(), "wb");
-            if(file)
+            CImport* import = (CImport*)param;
+            import->mStorage->importer(import);
+            return 0;
+        }
+
+        void CStorageLocal::importer(CImport* import)
+        {
+            std::vector<uint8_t> out;
+            while(true)
             {
-                fwrite(&Version, sizeof(uint32_t), 1, file);
-                fwrite(block->getHash(), sizeof(uint8_t), SHA256_DIGEST_LENGTH, file);
-                fwrite(block->getPrevHash(), sizeof(uint8_t), SHA256_DIGEST_LENGTH, file);
-                time_t createdTS = block->getCreatedTS();
-                fwrite(&createdTS, sizeof(time_t), 1, file);
-                uint32_t nonce = block->getNonce();
-                fwrite(&nonce, sizeof(uint32_t), 1, file);
-                uint32_t dataSize = block->getDataSize();
-                fwrite(&dataSize, sizeof(uint32_t), 1, file);
-                fwrite(block->getData(), sizeof(uint8_t), dataSize, file);
-                fclose(file);
+                pthread_mutex_lock(&import->mLock);
+                while(!import->mDone && !import->mFailed && import->mJobs.empty())
+                    pthread_cond_wait(&import->mCond, &import->mLock);
+                if(import->mFailed || import->mJobs.empty())
+                {
+                    pthread_mutex_unlock(&import->mLock);
+                    return;
+                }
+                CImportJob* job = import->mJobs.front();
+                import->mJobs.pop();
+                pthread_cond_broadcast(&import->mCond);
+                pthread_mutex_unlock(&import->mLock);
 
-                
-                mMetaData["LAST_BLOCK_HASH"] = std::basic_string<uint8_t>((uint8_t*)block->getHash(), SHA256_DIGEST_LENGTH);
-                mMetaData["LAST_BLOCK_HASH_STR"] = std::basic_string<uint8_t>((uint8_t*)block->getHashStr().data(), block->getHashStr().size());
-                mMetaData["BLOCK_COUNT"] = std::basic_string<uint8_t>((uint8_t*)&blockCount, sizeof(uint64_t));
-                saveMetaData();
+                CBlockRecord* record = &job->mRecord;
+                std::string error;
+                if(crc32c(record->mPayload, record->mStoredSize) != record->mPayloadCrc || (record->mCodec == ECT_NONE && record->mStoredSize != record->mDataSize))
+                    error = "Snapshot payload checksum mismatch: ";
+                else
+                {
+                    try
+                    {
+                        CBlock block(0, record->mHash);
+                        record->toBlock(&block);
+                        if(!block.isValid())
+                            error = "Snapshot block hash mismatch: ";
+                    }
+                    catch(std::exception& e)
+                    {
+                        error = "Snapshot payload does not decompress: ";
+                    }
+                }
+                if(error.empty())
+                {
+                    out.clear();
+                    record->encode(&out);
+                    int file = open((mBasePath + hashToStr(record->mHash)).c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+                    if(file < 0 || write(file, out.data(), out.size()) != (ssize_t)out.size())
+                        error = "Could not write imported block: ";
+                    if(file >= 0)
+                        close(file);
+                }
+                if(!error.empty())
+                {
+                    pthread_mutex_lock(&import->mLock);
+                    if(!import->mFailed)
+                        import->mError = error + hashToStr(record->mHash);
+                    import->mFailed = true;
+                    pthread_cond_broadcast(&import->mCond);
+                    pthread_mutex_unlock(&import->mLock);
+                }
+                delete job;
             }
         }
 
-        void CStorageLocal::loadMetaData()
+        bool CStorageLocal::loadFilter(CBloomFilter* filter, const uint8_t* tipHash)
+        {
+            return filter->load(mBasePath + "bloom", tipHash);
+        }
+
+        void CStorageLocal::saveFilter(CBloomFilter* filter, const uint8_t* tipHash)
+        {
+            filter->save(mBasePath + "bloom", tipHash);
+        }
+
+        bool CStorageLocal::verifyRecord(const uint8_t* hash, uint8_t* prevHash)
+        {
+            std::vector<uint8_t> buf;
+            CBlockRecord record;
+            if(!readRecord(hash, &buf))
+                return false;
+            if(!record.decode(buf.data(), buf.size()) || memcmp(record.mHash, hash, SHA256_DIGEST_LENGTH) != 0)
+                return false;
+            if(prevHash)
+                memcpy(prevHash, record.mPrevHash, SHA256_DIGEST_LENGTH);
+            return true;
+        }
+
+        void CStorageLocal::recover()
+        {
+            uint64_t height = mSuperBlock.getHeight();
+            uint8_t tip[SHA256_DIGEST_LENGTH];
+            memcpy(tip, mSuperBlock.getTipHash(), SHA256_DIGEST_LENGTH);
+            bool changed = false;
+
+            // Tip record itself did not survive, step back along the journal
+            while(height > 0 && !verifyRecord(tip, 0))
+            {
+                mLog.errorLine("Tip block record is damaged, rolling back: " + hashToStr(tip));
+                height--;
+                changed = true;
+                if(height == 0 || !mJournal.read(height - 1, tip))
+                {
+                    height = 0;
+                    memset(tip, 0, SHA256_DIGEST_LENGTH);
+                }
+            }
+
+            // Replay blocks saved after the last durable superblock
+            uint64_t replayed = 0;
+            uint8_t hash[SHA256_DIGEST_LENGTH];
+            while(mJournal.read(height, hash))
+            {
+                uint8_t prevHash[SHA256_DIGEST_LENGTH];
+                if(!verifyRecord(hash, prevHash))
+                {
+                    mLog.errorLine("Dropping torn block record: " + hashToStr(hash));
+                    unlink((mBasePath + hashToStr(hash)).c_str());
+                    break;
+                }
+                if(height > 0 && memcmp(prevHash, tip, SHA256_DIGEST_LENGTH) != 0)
+                    break;
+                memcpy(tip, hash, SHA256_DIGEST_LENGTH);
+                height++;
+                replayed++;
+                changed = true;
+            }
+
+            if(mJournal.getCount() > height)
+                mJournal.truncate(height);
+
+            if(changed)
+            {
+                mJournal.sync();
+                mSuperBlock.write(tip, height);
+                mLog.writeLine("Recovered tip at height " + std::to_string(height) + " (replayed " + std::to_string(replayed) + " blocks).");
+            }
+        }
+
+        void CStorageLocal::setCheckpointInterval(uint32_t interval)
+        {
+            mCheckpointInterval = interval == 0 ? 1 : interval;
+        }
+
+        std::string CStorageLocal::hashToStr(const uint8_t* hash)
+        {
+            char buf[SHA256_DIGEST_LENGTH * 2 + 1];
+            for(uint32_t n = 0; n < SHA256_DIGEST_LENGTH; n++)
+                sprintf(buf + n * 2, "%02x", hash[n]);
+            buf[SHA256_DIGEST_LENGTH * 2] = 0;
+            return std::string(buf);
+        }
+
+        void CStorageLocal::loadMetaData(std::map<std::string, std::basic_string<uint8_t>>* metaData)
         {
             std::string metaDataFn(mBasePath + "metadata");
             FILE* file = fopen(metaDataFn.c_str(), "rb");
@@ -207,43 +1040,13 @@ namespace blockchain
                             throw std::runtime_error("Could not read varVal.");
                     }
 
-                    mMetaData[varName] = varVal;
+                    (*metaData)[varName] = varVal;
                 }
 
                 fclose(file);
             }
         }
 
-        void CStorageLocal::saveMetaData()
-        {
-            std::string metaDataFn(mBasePath + "metadata");
-            FILE* file = fopen(metaDataFn.c_str(), "wb");
-            if(file)
-            {
-                fwrite(&Version, sizeof(uint32_t), 1, file);
-                uint64_t varCount = mMetaData.size();
-                fwrite(&varCount, sizeof(uint64_t), 1, file);
-                if(varCount != 0)
-                {
-                    for(std::map<std::string, std::basic_string<uint8_t>>::iterator it = mMetaData.begin(); it != mMetaData.end(); ++it)
-                    { 
-                        std::string varName(it->first);
-                        uint32_t varSize = varName.size();
-                        if(varSize == 0)
-                            continue;
-                        fwrite(&varSize, sizeof(uint32_t), 1, file);
-                        fwrite(varName.c_str(), sizeof(char), varName.size(), file);
-                        std::basic_string<uint8_t> varVal(it->second);
-                        uint32_t valSize = varVal.size();
-                        fwrite(&valSize, sizeof(uint32_t), 1, file);
-                        if(valSize != 0)
-                            fwrite(varVal.c_str(), sizeof(uint8_t), varVal.size(), file);
-                    }
-                }
-                fclose(file);
-            }
-        }
-
         void CStorageLocal::dispose()
         {
             delete this;
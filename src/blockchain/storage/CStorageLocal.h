@@ -9,12 +9,27 @@
 #ifndef __C_STORAGE_LOCAL_INCLUDED__
 #define __C_STORAGE_LOCAL_INCLUDED__
 #include "IStorage.h"
+#include "CSuperBlock.h"
+#include "CJournal.h"
+#include "CBlockRecord.h"
+#include "ECodecType.h"
+#include "IAsyncIO.h"
+#include "CArchive.h"
+#include "CCompactor.h"
+#include "CSnapshot.h"
+#include "CScrubber.h"
+#include "CChunkStore.h"
+#include "IBlockSource.h"
 #include "../CBlock.h"
 #include "../CChain.h"
 #include "../CLog.h"
 #include <string>
+#include <string.h>
 #include <vector>
 #include <map>
+#include <set>
+#include <queue>
+#include <pthread.h>
 
 namespace blockchain
 {
@@ -24,25 +39,160 @@ namespace blockchain
         {
         private:
             static std::string mDefaultBasePath;
-            const uint32_t Version = 1;
+            static E_CODEC_TYPE mDefaultCodec;
+            static uint32_t mDefaultCompressAge;
+            static bool mDefaultDirectIO;
+            static std::string mDefaultArchivePath;
+            static uint32_t mDefaultArchiveAge;
+            static uint32_t mDefaultArchiveSpan;
+            static uint64_t mDefaultArchiveRate;
+            static uint64_t mDefaultScrubRate;
+            static bool mDefaultScrubRepair;
+            static bool mDefaultDedup;
             const std::string mBasePath = std::string("data/");
-            const uint32_t mChunkSize = 2048;
-            std::map<std::string, std::basic_string<uint8_t>> mMetaData;
+            const std::string mArchivePath;     // Cold tier for archives, mBasePath when not set
+            CSuperBlock mSuperBlock;
+            CJournal mJournal;
+            uint32_t mCheckpointInterval;   // Saves between superblock writes
+            uint32_t mUncheckpointed;       // Saves since the last superblock write
+            E_CODEC_TYPE mCodec;            // Payload codec for stored blocks
+            uint32_t mCompressAge;          // Blocks stay raw until this many newer blocks exist, 0 compresses on save
+            bool mDirectIO;                 // O_DIRECT for block writes
+            IAsyncIO* mIO;
+            pthread_mutex_t mTipLock;       // Guards journal, superblock and the two below
+            std::set<uint64_t> mSavesInFlight;                          // Block counts being saved
+            std::set<uint64_t> mFailedSaves;                            // Block counts whose save failed, the superblock stays below them
+            std::map<uint64_t, std::vector<uint8_t>> mSavedTips;        // Saved and not yet in the superblock
+            pthread_mutex_t mArchiveLock;   // Guards mArchives, archives themselves are immutable
+            std::vector<CArchive*> mArchives;
+            CCompactor* mCompactor;
+            CScrubber* mScrubber;
+            IBlockSource* mBlockSource;
+            CChunkStore* mChunks;           // Payload deduplication, 0 when off
 
             CLog mLog;
+
+            void loadMetaData(std::map<std::string, std::basic_string<uint8_t>>* metaData);   // legacy metadata map, read once for migration
+            bool readFile(const std::string& path, std::vector<uint8_t>* buf);
+            bool findArchived(const uint8_t* hash, int* file, uint64_t* offset, uint32_t* size);
+            int openRecord(const uint8_t* hash, uint64_t* start, uint64_t* size);   // Block file or a duplicate of the archive descriptor, -1 when missing
+            bool readRecordHeader(int file, uint64_t start, uint64_t size, const uint8_t* hash, CBlockRecord* record);     // Fields before the payload, false when they do not check out
+            void loadHeader(CBlock* block);                                 // Header and size only, the payload is left evicted
+            void loadArchives(const std::string& path);
+            void repack(CBlock* block);                                     // Rewrite a stored block with mCodec
+            void encodeRecord(CBlock* block, CBlockRecord* record, E_CODEC_TYPE codec, bool repair = false, CChunkStore::CWrites* writes = 0);  // Chunked when deduplicating, else compressed with codec, repair rewrites damaged chunks
+            bool verifyRecord(const uint8_t* hash, uint8_t* prevHash);       // Record exists and passes its checksums
+        protected:
+            class CFileRequest : public CIORequest
+            {
+            public:
+                int mFd;
+
+                CFileRequest() { mFd = -1; }
+                virtual void onComplete();          // closes mFd
+            };
+
+            class CSaveRequest : public CFileRequest
+            {
+            public:
+                CStorageLocal* mStorage;
+                uint8_t mHash[SHA256_DIGEST_LENGTH];
+                uint64_t mBlockCount;
+                CChunkStore::CWrites mChunkWrites;  // New chunks the record refers to, written by the first ops
+
+                CSaveRequest(CStorageLocal* storage, const uint8_t* hash, uint64_t blockCount)
+                {
+                    mStorage = storage;
+                    memcpy(mHash, hash, SHA256_DIGEST_LENGTH);
+                    mBlockCount = blockCount;
+                }
+                virtual void onComplete();          // chunks, journal entry and superblock
+            };
+
+            class CRepackRequest : public CFileRequest
+            {
+            public:
+                std::string mPath;
+                std::string mTmpPath;
+
+                CRepackRequest(const std::string& path) : mPath(path), mTmpPath(path + ".tmp") {}
+                virtual void onComplete();          // rename over the old record
+            };
+
+            class CLoadRequest : public CFileRequest
+            {
+            public:
+                CStorageLocal* mStorage;
+                CBlock* mBlock;
+
+                CLoadRequest(CStorageLocal* storage, CBlock* block) { mStorage = storage; mBlock = block; }
+                virtual void onComplete();          // decode into mBlock
+            };
+
+            class CImportJob
+            {
+            public:
+                CBlockRecord mRecord;
+                std::vector<uint8_t> mPayload;      // mRecord.mPayload points here
+            };
+
+            class CImport
+            {
+            public:
+                CStorageLocal* mStorage;
+                pthread_mutex_t mLock;
+                pthread_cond_t mCond;               // job queued, job taken or finished
+                std::queue<CImportJob*> mJobs;
+                bool mDone;
+                bool mFailed;
+                std::string mError;
+            };
+
+            static void* static_importer(void* param);
+            void importer(CImport* import);         // Verify queued blocks and write their records
+            bool prepareRecordWrite(const std::string& path, CBlockRecord* record, CFileRequest* request);  // Open, encode and queue write + sync
+            void onSaved(CSaveRequest* request);
         public:
             static void setDefaultBasePath(const std::string& path);
+            static void setDefaultDirectIO(bool directIO);
+            static void setDefaultCompression(E_CODEC_TYPE codec, uint32_t minAge = 0);
+            static void setDefaultArchivePath(const std::string& path);
+            static void setDefaultArchiving(uint32_t age, uint32_t span = 1024, uint64_t rate = 0);   // 0 age disables the compactor, rate in bytes per second
+            static void setDefaultScrubbing(uint64_t rate, bool repair = false);      // 0 rate disables the scrubber, rate in bytes per second
+            static void setDefaultDedup(bool dedup);                                   // Share repeated payload chunks between blocks
+            static std::string hashToStr(const uint8_t* hash);
 
             CStorageLocal();
             ~CStorageLocal();
 
-            virtual void loadChain(std::vector<CBlock*>* chain);
+            virtual void loadChain(std::vector<CBlock*>* chain, CPayloadCache* cache = 0);
 
             virtual void load(CBlock* block);
             virtual void save(CBlock* block, uint64_t blockCount);
 
-            void loadMetaData();
-            void saveMetaData();
+            virtual CIORequest* loadAsync(CBlock* block);
+            virtual CIORequest* saveAsync(CBlock* block, uint64_t blockCount);
+
+            void recover();                                     // Validate the tip and replay the journal tail
+            void setCheckpointInterval(uint32_t interval);      // Write the superblock every n saves
+            void setCompression(E_CODEC_TYPE codec, uint32_t minAge = 0);   // Compress blocks older than minAge heights
+            uint64_t getDurableHeight();                        // Height in the superblock
+            bool getBlockHash(uint64_t height, uint8_t* hash); // Hash at a height from the journal
+            bool readRecord(const uint8_t* hash, std::vector<uint8_t>* buf);  // Block file, then archives
+            bool expandRecord(CBlockRecord* record);            // Resolve a chunk list into the payload, false when chunks are missing
+            CChunkStore* getChunkStore();
+            bool rewrite(CBlock* block);                        // Replace a damaged record with a good copy
+            virtual void setBlockSource(IBlockSource* source);
+            IBlockSource* getBlockSource();
+            CScrubber* getScrubber();
+            bool compact(uint64_t firstHeight, uint64_t lastHeight, CCompactor* compactor);    // Merge a height range into one archive, false when stopped
+
+            virtual void exportSnapshot(const std::string& path);
+            virtual int openPayload(const uint8_t* hash, uint64_t* offset, uint32_t* size, uint32_t* crc);
+            void importSnapshot(const std::string& path, uint32_t threads = 0);    // Fill empty storage from a snapshot, 0 threads uses every core
+
+            virtual bool loadFilter(CBloomFilter* filter, const uint8_t* tipHash);
+            virtual void saveFilter(CBloomFilter* filter, const uint8_t* tipHash);
 
             virtual void dispose();
         };
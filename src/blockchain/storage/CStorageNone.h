@@ -18,11 +18,22 @@ namespace blockchain
         class CStorageNone : public IStorage
         {
         public:
-            virtual void loadChain(std::vector<CBlock*>* chain) {};
+            virtual void loadChain(std::vector<CBlock*>* chain, CPayloadCache* cache = 0) {};
 
             virtual void load(CBlock* block) {}
             virtual void save(CBlock* block, uint64_t blockCount) {}
 
+            virtual CIORequest* loadAsync(CBlock* block) { CIORequest* request = new CIORequest(); request->complete(0); return request; }
+            virtual CIORequest* saveAsync(CBlock* block, uint64_t blockCount) { CIORequest* request = new CIORequest(); request->complete(0); return request; }
+
+            virtual void exportSnapshot(const std::string& path) { throw std::runtime_error("No storage to export."); }
+            virtual int openPayload(const uint8_t* hash, uint64_t* offset, uint32_t* size, uint32_t* crc) { return -1; }
+
+            virtual bool loadFilter(CBloomFilter* filter, const uint8_t* tipHash) { return false; }
+            virtual void saveFilter(CBloomFilter* filter, const uint8_t* tipHash) {}
+
+            virtual void setBlockSource(IBlockSource* source) {}
+
             virtual void dispose() { delete this; }
         };
     }
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CSuperBlock.h"
+#include "crc32c.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdexcept>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Slot layout: magic, version, sequence, height, tip hash, crc32c of everything before it
+        static const uint32_t PayloadSize = sizeof(uint32_t) * 2 + sizeof(uint64_t) * 2 + SHA256_DIGEST_LENGTH;
+
+        CSuperBlock::CSuperBlock()
+        {
+            mFile = -1;
+            mSequence = 0;
+            mHeight = 0;
+            memset(mTipHash, 0, SHA256_DIGEST_LENGTH);
+        }
+
+        CSuperBlock::~CSuperBlock()
+        {
+            close();
+        }
+
+        void CSuperBlock::open(const std::string& path)
+        {
+            close();
+            mFile = ::open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if(mFile < 0)
+                throw std::runtime_error("Could not open superblock.");
+
+            mSequence = 0;
+            for(uint32_t slot = 0; slot < SlotCount; slot++)
+            {
+                uint64_t sequence = 0, height = 0;
+                uint8_t tipHash[SHA256_DIGEST_LENGTH];
+                if(readSlot(slot, &sequence, &height, tipHash) && sequence > mSequence)
+                {
+                    mSequence = sequence;
+                    mHeight = height;
+                    memcpy(mTipHash, tipHash, SHA256_DIGEST_LENGTH);
+                }
+            }
+        }
+
+        void CSuperBlock::close()
+        {
+            if(mFile >= 0)
+            {
+                ::close(mFile);
+                mFile = -1;
+            }
+        }
+
+        bool CSuperBlock::readSlot(uint32_t slot, uint64_t* sequence, uint64_t* height, uint8_t* tipHash)
+        {
+            uint8_t buf[SlotSize];
+            if(pread(mFile, buf, SlotSize, (off_t)slot * SlotSize) != SlotSize)
+                return false;
+
+            uint32_t crc = 0;
+            memcpy(&crc, buf + PayloadSize, sizeof(uint32_t));
+            if(crc != crc32c(buf, PayloadSize))
+                return false;
+
+            uint8_t* ptr = buf;
+            uint32_t magic = 0, version = 0;
+            memcpy(&magic, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(&version, ptr, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            if(magic != Magic || version != Version)
+                return false;
+
+            memcpy(sequence, ptr, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(height, ptr, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(tipHash, ptr, SHA256_DIGEST_LENGTH);
+            return true;
+        }
+
+        void CSuperBlock::write(const uint8_t* tipHash, uint64_t height)
+        {
+            if(mFile < 0)
+                throw std::runtime_error("Superblock is not open.");
+
+            uint32_t magic = Magic, version = Version;
+            uint64_t sequence = mSequence + 1;
+            uint8_t buf[SlotSize];
+            memset(buf, 0, SlotSize);
+            uint8_t* ptr = buf;
+            memcpy(ptr, &magic, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &version, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            memcpy(ptr, &sequence, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(ptr, &height, sizeof(uint64_t));
+            ptr += sizeof(uint64_t);
+            memcpy(ptr, tipHash, SHA256_DIGEST_LENGTH);
+            uint32_t crc = crc32c(buf, PayloadSize);
+            memcpy(buf + PayloadSize, &crc, sizeof(uint32_t));
+
+            // Never overwrite the slot holding the current tip
+            if(pwrite(mFile, buf, SlotSize, (off_t)(sequence % SlotCount) * SlotSize) != SlotSize)
+                throw std::runtime_error("Could not write superblock.");
+            if(fdatasync(mFile) != 0)
+                throw std::runtime_error("Could not sync superblock.");
+
+            mSequence = sequence;
+            mHeight = height;
+            memcpy(mTipHash, tipHash, SHA256_DIGEST_LENGTH);
+        }
+    }
+}
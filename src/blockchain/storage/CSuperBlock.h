@@ -0,0 +1,52 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_SUPER_BLOCK_INCLUDED__
+#define __C_SUPER_BLOCK_INCLUDED__
+#include <stdint.h>
+#include <string>
+#include <openssl/sha.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Fixed size chain tip record kept in two alternating slots of one file.
+        // Each update is a single positioned write of one slot, a torn write only
+        // damages the slot being written and the other slot still holds the previous tip.
+        class CSuperBlock
+        {
+        private:
+            static const uint32_t Magic = 0x42534342;   // "BCSB"
+            static const uint32_t Version = 1;
+            static const uint32_t SlotSize = 512;       // one sector per slot
+            static const uint32_t SlotCount = 2;
+
+            int mFile;
+            uint64_t mSequence;                         // Sequence of the last valid slot, 0 when empty
+            uint64_t mHeight;                           // Block count at the tip
+            uint8_t mTipHash[SHA256_DIGEST_LENGTH];     // Hash of the last saved block
+
+            bool readSlot(uint32_t slot, uint64_t* sequence, uint64_t* height, uint8_t* tipHash);
+        public:
+            CSuperBlock();
+            ~CSuperBlock();
+
+            void open(const std::string& path);         // Open or create and load the newest valid slot
+            void close();
+            void write(const uint8_t* tipHash, uint64_t height);   // Write the next slot
+
+            bool isEmpty() { return mSequence == 0; }
+            uint64_t getSequence() { return mSequence; }
+            uint64_t getHeight() { return mHeight; }
+            const uint8_t* getTipHash() { return mTipHash; }
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "CThrottle.h"
+
+namespace blockchain
+{
+    namespace storage
+    {
+        CThrottle::CThrottle(uint64_t rate)
+        {
+            mRate = rate;
+            restart();
+        }
+
+        void CThrottle::restart()
+        {
+            clock_gettime(CLOCK_MONOTONIC, &mWindowStart);
+            mWindowBytes = 0;
+        }
+
+        uint64_t CThrottle::account(size_t bytes)
+        {
+            if(mRate == 0)
+                return 0;
+            mWindowBytes += bytes;
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            uint64_t elapsed = (now.tv_sec - mWindowStart.tv_sec) * 1000000 + (now.tv_nsec - mWindowStart.tv_nsec) / 1000;
+            uint64_t allowed = mWindowBytes * 1000000 / mRate;     // time the bytes so far are allowed to take
+            if(elapsed > 1000000)
+                restart();
+            return allowed > elapsed ? allowed - elapsed : 0;
+        }
+
+        struct timespec CThrottle::deadline(uint64_t usec)
+        {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += usec / 1000000;
+            until.tv_nsec += (usec % 1000000) * 1000;
+            if(until.tv_nsec >= 1000000000)
+            {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            return until;
+        }
+
+        bool CThrottle::sleep(pthread_mutex_t* lock, pthread_cond_t* cond, bool* running, uint64_t usec)
+        {
+            struct timespec until = deadline(usec);
+            pthread_mutex_lock(lock);
+            while(*running && pthread_cond_timedwait(cond, lock, &until) == 0);
+            bool result = *running;
+            pthread_mutex_unlock(lock);
+            return result;
+        }
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __C_THROTTLE_INCLUDED__
+#define __C_THROTTLE_INCLUDED__
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Byte rate limit for background I/O. The caller sleeps for what account returns,
+        // so it can wake early on shutdown.
+        class CThrottle
+        {
+        private:
+            uint64_t mRate;                 // Bytes per second, 0 is unthrottled
+            struct timespec mWindowStart;
+            uint64_t mWindowBytes;          // Bytes moved since mWindowStart
+        public:
+            CThrottle(uint64_t rate = 0);
+
+            void restart();                 // New window, idle time does not build up a burst
+            uint64_t account(size_t bytes); // Microseconds to sleep to stay within the rate
+            uint64_t getRate() { return mRate; }
+
+            static struct timespec deadline(uint64_t usec);    // CLOCK_REALTIME time usec from now, for pthread_cond_timedwait
+            static bool sleep(pthread_mutex_t* lock, pthread_cond_t* cond, bool* running, uint64_t usec);    // Until usec passed or *running is cleared, false when stopping
+        };
+    }
+}
+
+#endif
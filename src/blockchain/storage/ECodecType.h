@@ -0,0 +1,27 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __E_CODEC_TYPE_INCLUDED__
+#define __E_CODEC_TYPE_INCLUDED__
+
+namespace blockchain
+{
+    namespace storage
+    {
+        enum E_CODEC_TYPE
+        {
+            ECT_NONE = 0,
+            ECT_LZ,         // built-in LZ4 block format, fast
+            ECT_DEFLATE,    // zlib deflate, higher ratio
+            ECT_CHUNKS,     // payload is a chunk list, chunks live in CChunkStore
+            ECT_COUNT
+        };
+    }
+}
+
+#endif
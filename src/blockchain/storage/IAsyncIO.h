@@ -0,0 +1,34 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __I_ASYNC_IO_INCLUDED__
+#define __I_ASYNC_IO_INCLUDED__
+#include "CIORequest.h"
+
+namespace blockchain
+{
+    namespace storage
+    {
+        class IAsyncIO
+        {
+        public:
+            static const uint32_t BufferAlignment = 4096;                       // Satisfies O_DIRECT
+
+            virtual void submit(CIORequest** requests, uint32_t count) = 0;     // Submit a batch, each request is grabbed until complete
+            void submit(CIORequest* request) { submit(&request, 1); }
+            virtual uint8_t* allocBuffer(CIORequest* request, uint32_t size) = 0;   // Request owned buffer, registered with the kernel when possible
+            virtual void releaseBuffer(int index) = 0;                          // Return a registered buffer
+            virtual void drain() = 0;                                           // Wait for every submitted request
+            virtual const char* getName() = 0;
+
+            virtual void dispose() = 0;                                         // drain and dispose
+        };
+    }
+}
+
+#endif
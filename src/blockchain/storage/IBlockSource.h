@@ -0,0 +1,26 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __I_BLOCK_SOURCE_INCLUDED__
+#define __I_BLOCK_SOURCE_INCLUDED__
+#include "../CBlock.h"
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Somewhere else to get a block from when the stored copy is damaged, usually a peer.
+        class IBlockSource
+        {
+        public:
+            virtual bool fetchBlock(const uint8_t* hash, CBlock* block) = 0;   // Fill block with header and payload, false when no source has it
+        };
+    }
+}
+
+#endif
@@ -9,20 +9,41 @@
 #ifndef __I_STORAGE_INCLUDED__
 #define __I_STORAGE_INCLUDED__
 #include "../CBlock.h"
+#include "CIORequest.h"
+#include "IBlockSource.h"
 #include <vector>
+#include <string>
+#include <stdexcept>
 
 namespace blockchain
 {
+    class CPayloadCache;
+    class CBloomFilter;
+
     namespace storage
     {
         class IStorage
         {
         public:
-            virtual void loadChain(std::vector<CBlock*>* chain) = 0;    // Load chain into memory
+            virtual void loadChain(std::vector<CBlock*>* chain, CPayloadCache* cache = 0) = 0;  // Load chain into memory, payloads beyond the cache budget are evicted as they load
 
             virtual void load(CBlock* block) = 0;                       // Load block
             virtual void save(CBlock* block, uint64_t blockCount) = 0;  // Save block
 
+            virtual CIORequest* loadAsync(CBlock* block) = 0;                       // Load block without blocking, block must outlive the request, caller drops
+            virtual CIORequest* saveAsync(CBlock* block, uint64_t blockCount) = 0;  // Save block without blocking, caller drops
+
+            virtual void exportSnapshot(const std::string& path) = 0;   // Write the durable chain to a snapshot file
+
+            // File holding the raw payload of a stored block at offset, with the payload checksum, so it can be
+            // sent without reading it. Caller closes. -1 when the block is not stored or its payload is packed.
+            virtual int openPayload(const uint8_t* hash, uint64_t* offset, uint32_t* size, uint32_t* crc) = 0;
+
+            virtual bool loadFilter(CBloomFilter* filter, const uint8_t* tipHash) = 0;     // Persisted filter, false when it has to be rebuilt
+            virtual void saveFilter(CBloomFilter* filter, const uint8_t* tipHash) = 0;
+
+            virtual void setBlockSource(IBlockSource* source) = 0;     // Where damaged blocks are fetched again from
+
             virtual void dispose() = 0;                                 // dispose 
         };
     }
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "codec.h"
+#include <string.h>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // LZ4 block format: sequences of [token][literal length][literals][offset][match length]
+        static const uint32_t MinMatch = 4;
+        static const uint32_t LastLiterals = 5;     // the block always ends with literals
+        static const uint32_t MatchStartLimit = 12; // no match may start this close to the end
+        static const uint32_t HashLog = 14;
+        static const uint32_t MaxOffset = 65535;
+
+        static inline uint32_t read32(const uint8_t* ptr)
+        {
+            uint32_t v;
+            memcpy(&v, ptr, sizeof(uint32_t));
+            return v;
+        }
+
+        static inline uint32_t hash32(uint32_t v)
+        {
+            return (v * 2654435761U) >> (32 - HashLog);
+        }
+
+        static void writeLength(std::vector<uint8_t>* out, uint32_t len)
+        {
+            while(len >= 255)
+            {
+                out->push_back(255);
+                len -= 255;
+            }
+            out->push_back((uint8_t)len);
+        }
+
+        static void writeSequence(std::vector<uint8_t>* out, const uint8_t* literals, uint32_t litLen, uint32_t offset, uint32_t matchLen)
+        {
+            uint8_t token = (uint8_t)((litLen >= 15 ? 15 : litLen) << 4);
+            if(matchLen != 0)
+                token |= (uint8_t)(matchLen - MinMatch >= 15 ? 15 : matchLen - MinMatch);
+            out->push_back(token);
+            if(litLen >= 15)
+                writeLength(out, litLen - 15);
+            out->insert(out->end(), literals, literals + litLen);
+            if(matchLen == 0)
+                return;
+            out->push_back((uint8_t)(offset & 0xFF));
+            out->push_back((uint8_t)(offset >> 8));
+            if(matchLen - MinMatch >= 15)
+                writeLength(out, matchLen - MinMatch - 15);
+        }
+
+        static void compressLZ(const uint8_t* src, uint32_t size, std::vector<uint8_t>* out)
+        {
+            out->clear();
+            out->reserve(size + size / 255 + 16);
+            uint32_t anchor = 0;
+            if(size > MatchStartLimit)
+            {
+                std::vector<int32_t> table(1 << HashLog, -1);
+                uint32_t ip = 0;
+                uint32_t matchLimit = size - LastLiterals;
+                while(ip < size - MatchStartLimit)
+                {
+                    uint32_t seq = read32(src + ip);
+                    uint32_t h = hash32(seq);
+                    int32_t ref = table[h];
+                    table[h] = (int32_t)ip;
+                    if(ref < 0 || ip - (uint32_t)ref > MaxOffset || read32(src + ref) != seq)
+                    {
+                        ip++;
+                        continue;
+                    }
+                    uint32_t matchLen = MinMatch;
+                    while(ip + matchLen < matchLimit && src[ref + matchLen] == src[ip + matchLen])
+                        matchLen++;
+                    writeSequence(out, src + anchor, ip - anchor, ip - (uint32_t)ref, matchLen);
+                    ip += matchLen;
+                    anchor = ip;
+                }
+            }
+            writeSequence(out, src + anchor, size - anchor, 0, 0);
+        }
+
+        static bool readLength(const uint8_t** ip, const uint8_t* end, uint32_t* len)
+        {
+            uint8_t b;
+            do
+            {
+                if(*ip >= end)
+                    return false;
+                b = *(*ip)++;
+                *len += b;
+            } while(b == 255);
+            return true;
+        }
+
+        static bool decompressLZ(const uint8_t* src, uint32_t size, uint8_t* dst, uint32_t dstSize)
+        {
+            const uint8_t* ip = src;
+            const uint8_t* end = src + size;
+            uint8_t* op = dst;
+            uint8_t* opEnd = dst + dstSize;
+            while(ip < end)
+            {
+                uint8_t token = *ip++;
+                uint32_t litLen = token >> 4;
+                if(litLen == 15 && !readLength(&ip, end, &litLen))
+                    return false;
+                if((uint32_t)(end - ip) < litLen || (uint32_t)(opEnd - op) < litLen)
+                    return false;
+                memcpy(op, ip, litLen);
+                ip += litLen;
+                op += litLen;
+                if(ip == end)
+                    break;  // last sequence has no match
+
+                if(end - ip < 2)
+                    return false;
+                uint32_t offset = ip[0] | (ip[1] << 8);
+                ip += 2;
+                uint32_t matchLen = token & 0x0F;
+                if(matchLen == 15 && !readLength(&ip, end, &matchLen))
+                    return false;
+                matchLen += MinMatch;
+                if(offset == 0 || offset > (uint32_t)(op - dst) || (uint32_t)(opEnd - op) < matchLen)
+                    return false;
+                const uint8_t* match = op - offset;
+                for(uint32_t n = 0; n < matchLen; n++)  // byte copy, matches may overlap the output
+                    op[n] = match[n];
+                op += matchLen;
+            }
+            return op == opEnd;
+        }
+
+        bool compressData(E_CODEC_TYPE codec, const uint8_t* data, uint32_t size, std::vector<uint8_t>* out)
+        {
+            if(codec == ECT_NONE)
+            {
+                out->assign(data, data + size);
+                return true;
+            }
+            else if(codec == ECT_LZ)
+            {
+                compressLZ(data, size, out);
+                return true;
+            }
+            else if(codec == ECT_DEFLATE)
+            {
+                uLongf outSize = compressBound(size);
+                out->resize(outSize);
+                if(compress2(out->data(), &outSize, data, size, Z_BEST_COMPRESSION) != Z_OK)
+                    return false;
+                out->resize(outSize);
+                return true;
+            }
+            return false;
+        }
+
+        bool decompressData(E_CODEC_TYPE codec, const uint8_t* data, uint32_t size, uint8_t* out, uint32_t outSize)
+        {
+            if(codec == ECT_NONE)
+            {
+                if(size != outSize)
+                    return false;
+                memcpy(out, data, size);
+                return true;
+            }
+            else if(codec == ECT_LZ)
+                return decompressLZ(data, size, out, outSize);
+            else if(codec == ECT_DEFLATE)
+            {
+                uLongf sz = outSize;
+                return uncompress(out, &sz, data, size) == Z_OK && sz == outSize;
+            }
+            return false;
+        }
+
+        E_CODEC_TYPE codecFromName(const std::string& name)
+        {
+            if(name == "none")
+                return ECT_NONE;
+            else if(name == "lz")
+                return ECT_LZ;
+            else if(name == "deflate")
+                return ECT_DEFLATE;
+            throw std::runtime_error("Unknown codec: " + name);
+        }
+    }
+}
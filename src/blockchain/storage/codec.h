@@ -0,0 +1,30 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ * 
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __CODEC_INCLUDED__
+#define __CODEC_INCLUDED__
+#include "ECodecType.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // Replaces out with the compressed form of data, false when the codec is unknown or fails
+        bool compressData(E_CODEC_TYPE codec, const uint8_t* data, uint32_t size, std::vector<uint8_t>* out);
+
+        // Decompresses exactly outSize bytes into out, false on corrupt input
+        bool decompressData(E_CODEC_TYPE codec, const uint8_t* data, uint32_t size, uint8_t* out, uint32_t outSize);
+
+        E_CODEC_TYPE codecFromName(const std::string& name);   // "none", "lz" or "deflate"
+    }
+}
+
+#endif
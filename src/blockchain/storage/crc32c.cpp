@@ -0,0 +1,169 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#include "crc32c.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace blockchain
+{
+    namespace storage
+    {
+        static const uint32_t Polynomial = 0x82F63B78;     // reflected Castagnoli polynomial
+
+        class CCrc32cTable
+        {
+        public:
+            uint32_t mTable[256];
+
+            CCrc32cTable()
+            {
+                for(uint32_t n = 0; n < 256; n++)
+                {
+                    uint32_t c = n;
+                    for(int k = 0; k < 8; k++)
+                        c = (c & 1) ? (c >> 1) ^ Polynomial : (c >> 1);
+                    mTable[n] = c;
+                }
+            }
+        };
+
+        static const CCrc32cTable sTable;
+
+        static uint32_t crc32cSoftware(const uint8_t* data, size_t size, uint32_t crc)
+        {
+            for(size_t n = 0; n < size; n++)
+                crc = sTable.mTable[(crc ^ data[n]) & 0xFF] ^ (crc >> 8);
+            return crc;
+        }
+
+#if defined(__x86_64__)
+        // SSE4.2 crc32 instruction, 8 bytes per step
+        __attribute__((target("sse4.2"))) static uint32_t crc32cHardware(const uint8_t* data, size_t size, uint32_t crc)
+        {
+            uint64_t c = crc;
+            while(size >= sizeof(uint64_t))
+            {
+                uint64_t v;
+                memcpy(&v, data, sizeof(uint64_t));
+                c = _mm_crc32_u64(c, v);
+                data += sizeof(uint64_t);
+                size -= sizeof(uint64_t);
+            }
+            crc = (uint32_t)c;
+            while(size--)
+                crc = _mm_crc32_u8(crc, *data++);
+            return crc;
+        }
+
+        static bool hasHardware()
+        {
+            return __builtin_cpu_supports("sse4.2");
+        }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+        // ARMv8 CRC extension
+        static uint32_t crc32cHardware(const uint8_t* data, size_t size, uint32_t crc)
+        {
+            while(size >= sizeof(uint64_t))
+            {
+                uint64_t v;
+                memcpy(&v, data, sizeof(uint64_t));
+                crc = __crc32cd(crc, v);
+                data += sizeof(uint64_t);
+                size -= sizeof(uint64_t);
+            }
+            while(size--)
+                crc = __crc32cb(crc, *data++);
+            return crc;
+        }
+
+        static bool hasHardware()
+        {
+            return true;
+        }
+#else
+        static uint32_t crc32cHardware(const uint8_t* data, size_t size, uint32_t crc)
+        {
+            return crc32cSoftware(data, size, crc);
+        }
+
+        static bool hasHardware()
+        {
+            return false;
+        }
+#endif
+
+        typedef uint32_t (*crc32cFunc)(const uint8_t*, size_t, uint32_t);
+        static const crc32cFunc sCrc32c = hasHardware() ? crc32cHardware : crc32cSoftware;
+
+        uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc)
+        {
+            return ~sCrc32c(data, size, ~crc);
+        }
+
+        // Multiply a vector by a matrix over GF(2), both as 32 bit rows
+        static uint32_t gf2Times(const uint32_t* matrix, uint32_t vec)
+        {
+            uint32_t sum = 0;
+            for(; vec; vec >>= 1, matrix++)
+            {
+                if(vec & 1)
+                    sum ^= *matrix;
+            }
+            return sum;
+        }
+
+        // Operators that feed 2^n zero bytes through a crc, so combining costs one product per size bit
+        class CCrc32cZeros
+        {
+        public:
+            uint32_t mOperator[64][32];
+
+            CCrc32cZeros()
+            {
+                uint32_t bit[32], square[32];
+                bit[0] = Polynomial;        // one zero bit
+                for(int n = 1; n < 32; n++)
+                    bit[n] = 1u << (n - 1);
+                for(int k = 0; k < 3; k++)  // square up to one zero byte
+                {
+                    for(int n = 0; n < 32; n++)
+                        square[n] = gf2Times(bit, bit[n]);
+                    memcpy(bit, square, sizeof(bit));
+                }
+                memcpy(mOperator[0], bit, sizeof(bit));
+                for(int k = 1; k < 64; k++)
+                {
+                    for(int n = 0; n < 32; n++)
+                        mOperator[k][n] = gf2Times(mOperator[k - 1], mOperator[k - 1][n]);
+                }
+            }
+        };
+
+        static const CCrc32cZeros sZeros;
+
+        uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t sizeB)
+        {
+            for(int k = 0; sizeB != 0; k++, sizeB >>= 1)
+            {
+                if(sizeB & 1)
+                    crcA = gf2Times(sZeros.mOperator[k], crcA);
+            }
+            return crcA ^ crcB;
+        }
+
+        bool crc32cIsAccelerated()
+        {
+            return hasHardware();
+        }
+    }
+}
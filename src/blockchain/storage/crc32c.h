@@ -0,0 +1,29 @@
+/*
+ * Copyright 2023-2024 Alessandro Ubriaco. All Rights Reserved.
+ *
+ * Licensed under the Apache License 2.0 (the "License").
+ * You may not use this file except in the compliance with the License.
+ * You may obtain a copy of the license in the file LICENSE.txt
+ * in the source distribution.
+*/
+#ifndef __CRC32C_INCLUDED__
+#define __CRC32C_INCLUDED__
+#include <stdint.h>
+#include <stddef.h>
+
+namespace blockchain
+{
+    namespace storage
+    {
+        // CRC32C (Castagnoli), pass the previous result as crc to continue a running checksum
+        uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+        // Checksum of A followed by B from crcA, crcB and the size of B, without touching the data
+        uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t sizeB);
+
+        // Whether crc32c() runs on the CPU's crc instruction (SSE4.2 / ARMv8 CRC)
+        bool crc32cIsAccelerated();
+    }
+}
+
+#endif
@@ -9,6 +9,9 @@
 #include "storage.h"
 #include "CStorageNone.h"
 #include "CStorageLocal.h"
+#include "CAsyncIOUring.h"
+#include "CAsyncIOThreadPool.h"
+#include <stdexcept>
 
 namespace blockchain
 {
@@ -22,5 +25,20 @@ namespace blockchain
                 return new CStorageNone();
             return 0;
         }
+
+        IAsyncIO* createAsyncIO()
+        {
+#ifdef __BLOCKCHAIN_IO_URING__
+            try
+            {
+                if(CAsyncIOUring::isSupported())
+                    return new CAsyncIOUring();
+            }
+            catch (std::runtime_error e)
+            {
+            }
+#endif
+            return new CAsyncIOThreadPool();
+        }
     }
 }
@@ -10,12 +10,14 @@
 #define __STORAGE_INCLUDED__
 #include "IStorage.h"
 #include "EStorageType.h"
+#include "IAsyncIO.h"
 
 namespace blockchain
 {
     namespace storage
     {
         IStorage* createStorage(E_STORAGE_TYPE type);
+        IAsyncIO* createAsyncIO();      // io_uring when the kernel allows it, thread pool otherwise
     }
 }
 
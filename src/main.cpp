@@ -8,6 +8,7 @@
  */
 #include "blockchain/CChain.h"
 #include "blockchain/storage/CStorageLocal.h"
+#include "blockchain/storage/codec.h"
 #include <iostream>
 #include <ctime>
 #include <unistd.h>
@@ -18,6 +19,7 @@ using namespace std;
 using namespace blockchain;
 
 CChain *gChain;
+volatile sig_atomic_t gExportRequested = 0;
 
 void interruptCallback(int sig)
 {
@@ -25,6 +27,11 @@ void interruptCallback(int sig)
     gChain->stop();
 }
 
+void exportCallback(int sig)
+{
+    gExportRequested = 1;
+}
+
 bool tobool(std::string str)
 {
     for (int n = 0; n < str.size(); n++)
@@ -61,7 +68,7 @@ int main(int argc, char **argv)
     if (argc == 1)
     {
         cout << "Usage:\n"
-             << binName + " -hYOURHOST -cCONNECTTO -nFALSE\n\n-h\tHOSTNAME\tYour host entry point.\n-c\tHOSTNAME\tConnect to node entrypoint hostname.\n-n\ttrue | false\tIs this a new chain or not.\n\n";
+             << binName + " -hYOURHOST -cCONNECTTO -nFALSE\n\n-h\tHOST[:PORT][,PATH] | PATH\tYour host entry point, a PATH is a Unix socket for nodes and producers on this machine.\n-c\tHOST[:PORT] | PATH[,...]\tConnect to node entrypoints, blocks are downloaded from all of them.\n-n\ttrue | false\tIs this a new chain or not.\n-s\tPATH | none\tStorage directory or no storage.\n-z\tCODEC[:AGE]\tCompress stored blocks with none, lz or deflate, only once AGE blocks newer exist.\n-d\ttrue | false\tWrite block files with O_DIRECT.\n-a\tAGE[:SPAN[:KBPS]]\tArchive blocks older than AGE in archives of SPAN blocks, compacting at most KBPS kilobytes per second.\n-A\tPATH\tCold directory for archives.\n-p\tBLOCKS[:MB]\tPruned mode, keep payloads of at most BLOCKS blocks or MB megabytes in memory.\n-i\tPATH\tImport a snapshot into empty storage before starting, - reads stdin.\n-e\tPATH\tWrite a snapshot to PATH on SIGUSR1.\n-v\tMBPS[:REPAIR]\tVerify stored blocks in the background at MBPS megabytes per second, REPAIR true fetches damaged blocks from peers.\n-D\ttrue | false\tStore repeated payload chunks once.\n-t\tTHREADS\tServer I/O threads, defaults to the core count up to 4.\n-q\tSIZE[:POLICY]\tOutbound messages queued per peer, when full block, drop the oldest or disconnect.\n-w\tWINDOW\tBlocks sent to a peer before waiting for its answers.\n-g\tDEGREE\tNodes to keep connected to, picked at random from the ones peers list, 0 connects to every node.\n-x\tBYTES\tCompress frames of at least BYTES sent to peers that read them, 0 sends everything raw.\n\n";
         return 1;
     }
 
@@ -100,17 +107,24 @@ int main(int argc, char **argv)
 
     uint32_t hostPort = 7698, connectPort = 7698;
     std::string host(params["h"]), connectTo(params["c"]);
-    size_t pos = params["h"].find(':');
+    size_t pos = params["h"].find(',');
     if (pos != std::string::npos)
     {
+        // A second, path entry takes local producers next to the TCP port
         host = params["h"].substr(0, pos);
-        hostPort = (uint32_t)std::stoi(params["h"].substr(pos + 1));
+        if (!net::INet::isLocalAddress(params["h"].substr(pos + 1)))
+        {
+            cout << "The second -h entry must be a Unix socket path.\n";
+            return 1;
+        }
+        net::CServer::setDefaultLocalPath(params["h"].substr(pos + 1));
     }
-    pos = params["c"].find(':');
-    if (pos != std::string::npos)
+    if (net::INet::isLocalAddress(host))
+        hostPort = 0;   // peers reach the node by its path alone
+    else if ((pos = host.find(':')) != std::string::npos)
     {
-        connectTo = params["c"].substr(0, pos);
-        connectPort = (uint32_t)std::stoi(params["c"].substr(pos + 1));
+        hostPort = (uint32_t)std::stoi(host.substr(pos + 1));
+        host = host.substr(0, pos);
     }
 
     storage::E_STORAGE_TYPE storageType(storage::EST_LOCAL);
@@ -123,6 +137,116 @@ int main(int argc, char **argv)
             storage::CStorageLocal::setDefaultBasePath(params["s"]);
     }
 
+    if (params.count("z") != 0)
+    {
+        std::string codecName(params["z"]);
+        uint32_t compressAge = 0;
+        pos = codecName.find(':');
+        if (pos != std::string::npos)
+        {
+            compressAge = (uint32_t)std::stoi(codecName.substr(pos + 1));
+            codecName = codecName.substr(0, pos);
+        }
+        storage::CStorageLocal::setDefaultCompression(storage::codecFromName(codecName), compressAge);
+    }
+
+    if (params.count("d") != 0)
+        storage::CStorageLocal::setDefaultDirectIO(tobool(params["d"]));
+
+    if (params.count("a") != 0)
+    {
+        std::string archiving(params["a"]);
+        uint32_t archiveAge = 0, archiveSpan = 1024;
+        uint64_t archiveRate = 0;
+        pos = archiving.find(':');
+        archiveAge = (uint32_t)std::stoi(archiving.substr(0, pos));
+        if (pos != std::string::npos)
+        {
+            archiving = archiving.substr(pos + 1);
+            pos = archiving.find(':');
+            archiveSpan = (uint32_t)std::stoi(archiving.substr(0, pos));
+            if (pos != std::string::npos)
+                archiveRate = (uint64_t)std::stoul(archiving.substr(pos + 1)) * 1024;
+        }
+        storage::CStorageLocal::setDefaultArchiving(archiveAge, archiveSpan, archiveRate);
+    }
+
+    if (params.count("A") != 0)
+        storage::CStorageLocal::setDefaultArchivePath(params["A"]);
+
+    if (params.count("t") != 0)
+        net::CServer::setDefaultIOThreads((uint32_t)std::stoi(params["t"]));
+
+    if (params.count("q") != 0)
+    {
+        std::string queueing(params["q"]);
+        net::E_QUEUE_POLICY policy = net::EQP_BLOCK;
+        pos = queueing.find(':');
+        if (pos != std::string::npos)
+        {
+            policy = net::COutQueue::policyFromName(queueing.substr(pos + 1));
+            queueing = queueing.substr(0, pos);
+        }
+        net::CClient::setDefaultQueue((uint32_t)std::stoi(queueing), policy);
+    }
+
+    if (params.count("w") != 0)
+        net::CClient::setDefaultWindow((uint32_t)std::stoi(params["w"]));
+
+    if (params.count("g") != 0)
+        net::CServer::setDefaultDegree((uint32_t)std::stoi(params["g"]));
+
+    if (params.count("x") != 0)
+        net::CWireCompression::setDefaultMinSize((uint32_t)std::stoul(params["x"]));
+
+    if (params.count("D") != 0)
+        storage::CStorageLocal::setDefaultDedup(tobool(params["D"]));
+
+    if (params.count("v") != 0)
+    {
+        std::string scrubbing(params["v"]);
+        bool repair = false;
+        pos = scrubbing.find(':');
+        if (pos != std::string::npos)
+        {
+            repair = tobool(scrubbing.substr(pos + 1));
+            scrubbing = scrubbing.substr(0, pos);
+        }
+        storage::CStorageLocal::setDefaultScrubbing((uint64_t)(std::stod(scrubbing) * 1024 * 1024), repair);
+    }
+
+    if (params.count("p") != 0)
+    {
+        uint32_t maxBlocks = 0;
+        uint64_t maxBytes = 0;
+        pos = params["p"].find(':');
+        maxBlocks = (uint32_t)std::stoi(params["p"].substr(0, pos));
+        if (pos != std::string::npos)
+            maxBytes = (uint64_t)std::stoul(params["p"].substr(pos + 1)) * 1024 * 1024;
+        CPayloadCache::setDefaultBudget(maxBlocks, maxBytes);
+    }
+
+    if (params.count("i") != 0)
+    {
+        if (storageType != storage::EST_LOCAL)
+        {
+            cout << "Snapshots can only be imported into local storage.\n";
+            return 1;
+        }
+        storage::CStorageLocal* importer = new storage::CStorageLocal();
+        try
+        {
+            importer->importSnapshot(params["i"]);
+        }
+        catch (std::exception &e)
+        {
+            cout << "Snapshot import failed: " << e.what() << "\n";
+            importer->dispose();
+            return 1;
+        }
+        importer->dispose();
+    }
+
     cout << "Start.\n";
 
     CChain chain(host, hostPort, isNewChain, connectTo, 1, storageType, connectPort);
@@ -209,11 +333,33 @@ int main(int argc, char **argv)
     sigaction(SIGINT, &sigIntHandler, NULL);
     sigaction(SIGQUIT, &sigIntHandler, NULL);
 
+    // Snapshot Signal
+    if (params.count("e") != 0)
+    {
+        struct sigaction sigExportHandler;
+        sigExportHandler.sa_handler = exportCallback;
+        sigemptyset(&sigExportHandler.sa_mask);
+        sigExportHandler.sa_flags = 0;
+        sigaction(SIGUSR1, &sigExportHandler, NULL);
+    }
+
     CBlock* printedBlock = chain.getCurrentBlock();
 
     while (chain.isRunning()) {
 
         usleep(5000);
+        if(gExportRequested)
+        {
+            gExportRequested = 0;
+            try
+            {
+                chain.getStorage()->exportSnapshot(params["e"]);
+            }
+            catch (std::exception &e)
+            {
+                cout << "Snapshot export failed: " << e.what() << "\n";
+            }
+        }
         if(printedBlock != chain.getCurrentBlock())
         {
             printChain(&chain);